@@ -1,20 +1,317 @@
+#include "kernels/cpu/thread_pool.h"
 #include "model.h"
+#include "random_model.h"
+#ifdef FR_ENABLE_PIPELINE
+#include "pipeline.h"
+#endif
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
 
 #include <benchmark/benchmark.h>
 
-static void BM_0p1BV4Model(benchmark::State &state) {
-  rwkv::Model model("../rwkv-4-0.1b-fp16.fr", "cuda fp16");
+// Benchmarks of the cpu backend on models with random weights (see
+// random_model.h), generated when a benchmark first uses them (so not for
+// benchmarks excluded by --benchmark_filter) into $FR_BENCH_MODEL_DIR
+// (default: the working directory). The benchmarks are registered for every
+// combination of
+//   --sizes=0.1b,0.4b     model sizes, see kSizes
+//   --dtypes=fp16,fp32    weight dtypes
+//   --threads=1,N         thread counts (default 1 and all hardware threads)
+//   --batches=1,8         sessions per token for BM_Batch
+//   --prompts=16,128      prompt lengths for BM_Prefill
+// and report tokens/s, time to first token, load time and the peak RSS of the
+// process during each benchmark. Use the --benchmark_out=<file>
+// --benchmark_out_format=json flags of google benchmark for results to
+// archive.
+
+namespace {
+
+struct ModelSize {
+  const char *name;
+  int n_layer;
+  int n_embd;
+};
+
+// the shapes of the released RWKV-4 models
+const ModelSize kSizes[] = {
+    {"0.1b", 12, 768},  {"0.4b", 24, 1024}, {"1.5b", 24, 2048},
+    {"3b", 32, 2560},   {"7b", 32, 4096},   {"14b", 40, 5120},
+};
+const int kVocab = 65536;
+
+std::vector<std::string> Split(const std::string &str) {
+  std::vector<std::string> ret;
+  std::istringstream stream(str);
+  for (std::string item; std::getline(stream, item, ',');) {
+    ret.push_back(item);
+  }
+  return ret;
+}
+
+std::vector<int64_t> SplitInts(const std::string &str) {
+  std::vector<int64_t> ret;
+  for (auto &item : Split(str)) {
+    ret.push_back(std::stoll(item));
+  }
+  return ret;
+}
+
+// A model of a benchmark, generated by path() if its file doesn't exist yet
+struct ModelSpec {
+  const ModelSize *size;
+  std::string dtype;
+
+  std::string path() const {
+    const char *dir = std::getenv("FR_BENCH_MODEL_DIR");
+    std::string path = std::string(dir ? dir : ".") + "/random-rwkv-4-" +
+                       size->name + "-" + dtype + ".fr";
+    if (!std::ifstream(path).good()) {
+      rwkv::RandomModelConfig config;
+      config.n_layer = size->n_layer;
+      config.n_embd = size->n_embd;
+      config.n_vocab = kVocab;
+      config.dtype =
+          dtype == "fp32" ? rwkv::DType::kFloat32 : rwkv::DType::kFloat16;
+      rwkv::WriteRandomModel(path, config);
+    }
+    return path;
+  }
+};
+
+// The peak RSS (VmHWM) is reset to the current RSS at the start of every
+// benchmark, so that it is not the peak of an earlier, larger benchmark.
+// Without /proc/self/clear_refs it is the peak of the process so far.
+void ResetPeakRss() { std::ofstream("/proc/self/clear_refs") << "5"; }
+
+double PeakRssMb() {
+  std::ifstream status("/proc/self/status");
+  for (std::string line; std::getline(status, line);) {
+    if (line.rfind("VmHWM:", 0) == 0) {
+      return std::stoll(line.substr(6)) / 1024.;
+    }
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // ru_maxrss is in kilobytes on Linux
+  return usage.ru_maxrss / 1024.;
+}
+
+// The model kept by LoadModel
+std::unique_ptr<rwkv::Model> &CachedModel() {
+  static std::unique_ptr<rwkv::Model> model;
+  return model;
+}
+
+// google benchmark runs a benchmark function several times, keep the last
+// model instead of reloading it every time. Only one model is kept, so that
+// the RSS of a benchmark includes no other model.
+rwkv::Model &LoadModel(const std::string &path, int num_threads) {
+  auto &model = CachedModel();
+  static std::string loaded_path;
+  static int loaded_num_threads = 0;
+  // the weights are first touched by the threads of the current pool
+  rwkv::cpu::ThreadPool::SetInstanceNumThreads(num_threads);
+  if (!model || loaded_path != path || loaded_num_threads != num_threads) {
+    model.reset();
+    model = std::make_unique<rwkv::Model>(path, "cpu fp32");
+    loaded_path = path;
+    loaded_num_threads = num_threads;
+  }
+  return *model;
+}
+
+void SetCommonCounters(benchmark::State &state, int64_t tokens) {
+  state.counters["tokens_per_second"] =
+      benchmark::Counter(tokens, benchmark::Counter::kIsRate);
+  state.counters["peak_rss_mb"] = PeakRssMb();
+}
+
+// one token per iteration
+void BM_Decode(benchmark::State &state, const ModelSpec &spec) {
+  auto &model = LoadModel(spec.path(), state.range(0));
+  ResetPeakRss();
   auto states = model.CreateInitialStates();
-  for (auto _ : state)
-    auto output = rwkv::Copy(model.Run(0, states), rwkv::Device::kCPU);
+  for (auto _ : state) {
+    auto output = model.Run(0, states);
+    benchmark::DoNotOptimize(output.data_ptr());
+  }
+  SetCommonCounters(state, state.iterations());
+}
+
+// a prompt of state.range(1) tokens per iteration, from the initial states.
+// The time of an iteration is the time to first token.
+void BM_Prefill(benchmark::State &state, const ModelSpec &spec) {
+  auto &model = LoadModel(spec.path(), state.range(0));
+  ResetPeakRss();
+  std::vector<int> ids(state.range(1));
+  for (size_t i = 0; i < ids.size(); i++) {
+    ids[i] = (i * 7919) % kVocab;
+  }
+  double seconds = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto states = model.CreateInitialStates();
+    state.ResumeTiming();
+    auto start = std::chrono::steady_clock::now();
+    auto output = model.Run(ids, states);
+    benchmark::DoNotOptimize(output.data_ptr());
+    seconds += std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+  }
+  SetCommonCounters(state, state.iterations() * ids.size());
+  state.counters["ttft_ms"] = benchmark::Counter(
+      seconds * 1e3, benchmark::Counter::kAvgIterations);
+}
+
+// one token for each of state.range(1) sessions per iteration. The cpu
+// backend runs them one after another, this is the baseline of
+// BM_Pipeline.
+void BM_Batch(benchmark::State &state, const ModelSpec &spec) {
+  auto &model = LoadModel(spec.path(), state.range(0));
+  ResetPeakRss();
+  std::vector<std::vector<std::vector<rwkv::Tensor>>> sessions(
+      state.range(1), model.CreateInitialStates());
+  for (auto _ : state) {
+    for (auto &states : sessions) {
+      auto output = model.Run(0, states);
+      benchmark::DoNotOptimize(output.data_ptr());
+    }
+  }
+  SetCommonCounters(state, state.iterations() * sessions.size());
+}
+
+void BM_Load(benchmark::State &state, const ModelSpec &spec) {
+  const auto path = spec.path();
+  // the model of the previous benchmark is not part of the load
+  CachedModel().reset();
+  ResetPeakRss();
+  rwkv::cpu::ThreadPool::SetInstanceNumThreads(state.range(0));
+  for (auto _ : state) {
+    rwkv::Model model(path, "cpu fp32");
+    benchmark::DoNotOptimize(&model);
+  }
+  SetCommonCounters(state, 0);
+  state.counters.erase("tokens_per_second");
+}
+
+#ifdef FR_ENABLE_PIPELINE
+// state.range(0) stages, state.range(1) sessions. The peak RSS is the one of
+// the driver, the stages are other processes.
+void BM_Pipeline(benchmark::State &state, const ModelSpec &spec) {
+  const auto path = spec.path();
+  // the model of the previous benchmark is not part of the load
+  CachedModel().reset();
+  ResetPeakRss();
+  rwkv::PipelineModel model(path, "cpu fp32", state.range(0));
+  std::vector<int> sessions;
+  for (int i = 0; i < state.range(1); i++) {
+    sessions.push_back(model.CreateSession());
+  }
+  std::vector<int> ids(sessions.size(), 0);
+  for (auto _ : state) {
+    auto outputs = model.Run(sessions, ids);
+  }
+  SetCommonCounters(state, state.iterations() * sessions.size());
 }
-BENCHMARK(BM_0p1BV4Model);
+#endif
+
+} // namespace
 
-// static void BM_1p5BV4Model(benchmark::State &state) {
-//   rwkv::Model model("../rwkv-4-1.5b.fr", "cuda fp16");
-//   for (auto _ : state)
-//     auto output = rwkv::Copy(model.Run(0), rwkv::Device::kCPU);
-// }
-// BENCHMARK(BM_1p5BV4Model);
+int main(int argc, char **argv) {
+  std::string sizes = "0.1b,0.4b";
+  std::string dtypes = "fp16,fp32";
+  std::string threads = "1";
+  int hardware_threads = std::thread::hardware_concurrency();
+  if (hardware_threads > 1) {
+    threads += "," + std::to_string(hardware_threads);
+  }
+  std::string batches = "1,8";
+  std::string prompts = "16,128";
+  // our flags, the others are left to google benchmark
+  int new_argc = 0;
+  for (int i = 0; i < argc; i++) {
+    std::string arg = argv[i];
+    auto parse = [&](const std::string &flag, std::string &value) {
+      if (arg.rfind(flag + "=", 0) == 0) {
+        value = arg.substr(flag.size() + 1);
+        return true;
+      }
+      return false;
+    };
+    if (!parse("--sizes", sizes) && !parse("--dtypes", dtypes) &&
+        !parse("--threads", threads) && !parse("--batches", batches) &&
+        !parse("--prompts", prompts)) {
+      argv[new_argc++] = argv[i];
+    }
+  }
+  argc = new_argc;
 
-BENCHMARK_MAIN();
+  for (auto &size_name : Split(sizes)) {
+    const ModelSize *size = nullptr;
+    for (auto &s : kSizes) {
+      if (size_name == s.name) {
+        size = &s;
+      }
+    }
+    RV_CHECK(size != nullptr);
+    for (auto &dtype : Split(dtypes)) {
+      RV_CHECK(dtype == "fp16" || dtype == "fp32");
+      const ModelSpec spec{size, dtype};
+      const auto suffix = "/" + size_name + "/" + dtype;
+      auto *load = benchmark::RegisterBenchmark(("BM_Load" + suffix).c_str(),
+                                                BM_Load, spec);
+      auto *decode = benchmark::RegisterBenchmark(
+          ("BM_Decode" + suffix).c_str(), BM_Decode, spec);
+      auto *prefill = benchmark::RegisterBenchmark(
+          ("BM_Prefill" + suffix).c_str(), BM_Prefill, spec);
+      auto *batch = benchmark::RegisterBenchmark(
+          ("BM_Batch" + suffix).c_str(), BM_Batch, spec);
+      load->ArgName("threads");
+      decode->ArgName("threads");
+      prefill->ArgNames({"threads", "prompt"});
+      batch->ArgNames({"threads", "batch"});
+      for (auto num_threads : SplitInts(threads)) {
+        load->Arg(num_threads);
+        decode->Arg(num_threads);
+        for (auto prompt : SplitInts(prompts)) {
+          prefill->Args({num_threads, prompt});
+        }
+        for (auto batch_size : SplitInts(batches)) {
+          batch->Args({num_threads, batch_size});
+        }
+      }
+      for (auto *b : {load, decode, prefill, batch}) {
+        b->UseRealTime()->Unit(benchmark::kMillisecond);
+      }
+#ifdef FR_ENABLE_PIPELINE
+      benchmark::RegisterBenchmark(("BM_Pipeline" + suffix).c_str(),
+                                   BM_Pipeline, spec)
+          ->ArgNames({"stages", "batch"})
+          ->Args({1, 8})
+          ->Args({2, 1})
+          ->Args({2, 8})
+          ->Args({4, 8})
+          ->UseRealTime()
+          ->Unit(benchmark::kMillisecond);
+#endif
+    }
+  }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
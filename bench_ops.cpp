@@ -0,0 +1,369 @@
+#include "kernels/cpu/matmul.h"
+#include "kernels/kernels.h"
+#include "kernels/registry.h"
+#include "tensor.h"
+
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+// Micro-benchmarks of every kernel in the KernelRegistry which has an input
+// generator below, on the shapes of RWKV (n_embd, 4 * n_embd and the vocab).
+// Every variant registered for an op (e.g. the SIMD and the scalar matmul) is
+// run on the same inputs, one after another. bytes_per_second is the minimal
+// memory traffic of the kernel (every weight, input and output once) and
+// flops the arithmetic of its matmuls and element-wise math, to compare with
+// the memory bandwidth and the peak of the machine. Flags:
+//   --embd=768,2048,4096  the n_embd to run
+//   --dtypes=fp16,fp32    the weight dtypes of matmul, att and ffn
+// and the flags of google benchmark, e.g. --benchmark_filter=matmul.
+
+namespace {
+
+using rwkv::Device;
+using rwkv::DType;
+using rwkv::Shape;
+using rwkv::Tensor;
+
+const int64_t kVocab = 65536;
+// as the released RWKV-5 models
+const int64_t kHeadSize = 64;
+
+std::string DTypeName(DType dtype) {
+  return dtype == DType::kFloat16 ? "fp16" : "fp32";
+}
+
+int64_t ElemSize(DType dtype) { return dtype == DType::kFloat16 ? 2 : 4; }
+
+Tensor Random(const Shape &shape, DType dtype, float low, float high) {
+  static std::mt19937 gen(0);
+  std::uniform_real_distribution<float> dist(low, high);
+  auto x = Tensor::Empty(shape, dtype, Device::kCPU);
+  for (int64_t i = 0; i < x.numel(); i++) {
+    if (dtype == DType::kFloat16) {
+      x.data_ptr<rwkv::float16>()[i] = rwkv::float16(dist(gen));
+    } else {
+      x.data_ptr<float>()[i] = dist(gen);
+    }
+  }
+  return x;
+}
+
+Tensor Vector(int64_t n, float low = -1, float high = 1) {
+  return Random({n}, DType::kFloat32, low, high);
+}
+
+// [k, n] as loaded by init_model
+Tensor Weight(int64_t k, int64_t n, DType dtype) {
+  float s = std::sqrt(3.f / k);
+  return rwkv::cpu::shard_weight(Random({k, n}, dtype, -s, s));
+}
+
+void SetCounters(benchmark::State &state, double bytes, double flops) {
+  state.SetBytesProcessed(state.iterations() * bytes);
+  if (flops > 0) {
+    state.counters["flops"] = benchmark::Counter(
+        flops, benchmark::Counter::kIsIterationInvariantRate);
+  }
+}
+
+struct Options {
+  std::vector<int64_t> embds;
+  std::vector<DType> dtypes;
+};
+
+// Registers the benchmarks of op `name` on `device` for all its variants
+using OpRegisterer =
+    std::function<void(const std::string &name, Device device,
+                       const Options &options)>;
+
+template <typename Kernel, typename Fn>
+void RegisterVariants(const std::string &name, Device device,
+                      const std::string &suffix, Fn fn) {
+  for (auto &[variant, kernel] :
+       rwkv::KernelRegistry::Instance().Variants<Kernel>(name, device)) {
+    benchmark::RegisterBenchmark(
+        (name + "/" + rwkv::DeviceName(device) + "/" + variant + "/" + suffix)
+            .c_str(),
+        [kernel = kernel, fn](benchmark::State &state) { fn(state, kernel); })
+        ->UseRealTime();
+  }
+}
+
+void RegisterMatmul(const std::string &name, Device device,
+                    const Options &options) {
+  using Kernel = decltype(rwkv::matmul) *;
+  for (auto c : options.embds) {
+    // att, ffn key, ffn value and head weights
+    for (auto [k, n] : std::vector<std::pair<int64_t, int64_t>>{
+             {c, c}, {c, 4 * c}, {4 * c, c}, {c, kVocab}}) {
+      for (auto dtype : options.dtypes) {
+        auto suffix = DTypeName(dtype) + "/" + std::to_string(k) + "x" +
+                      std::to_string(n);
+        RegisterVariants<Kernel>(
+            name, device, suffix,
+            [k = k, n = n, dtype](benchmark::State &state, Kernel kernel) {
+              auto a = Vector(k);
+              auto b = Weight(k, n, dtype);
+              for (auto _ : state) {
+                auto c = kernel(a, b);
+                benchmark::DoNotOptimize(c.data_ptr());
+              }
+              SetCounters(state, k * n * ElemSize(dtype) + (k + n) * 4,
+                          2. * k * n);
+            });
+      }
+    }
+  }
+}
+
+void RegisterLayerNorm(const std::string &name, Device device,
+                       const Options &options) {
+  using Kernel = decltype(rwkv::layernorm) *;
+  for (auto c : options.embds) {
+    RegisterVariants<Kernel>(
+        name, device, std::to_string(c),
+        [c](benchmark::State &state, Kernel kernel) {
+          auto x = Vector(c);
+          auto w = Vector(c, 0.5, 1.5);
+          auto b = Vector(c);
+          for (auto _ : state) {
+            auto y = kernel(x, w, b);
+            benchmark::DoNotOptimize(y.data_ptr());
+          }
+          SetCounters(state, 4 * c * 4, 8. * c);
+        });
+  }
+}
+
+void RegisterCastDType(const std::string &name, Device device,
+                       const Options &) {
+  using Kernel = decltype(rwkv::cast_dtype) *;
+  // e.g. the logits
+  RegisterVariants<Kernel>(name, device, "fp32_to_fp16/" +
+                                             std::to_string(kVocab),
+                           [](benchmark::State &state, Kernel kernel) {
+                             auto x = Vector(kVocab);
+                             for (auto _ : state) {
+                               auto y = kernel(x, DType::kFloat16);
+                               benchmark::DoNotOptimize(y.data_ptr());
+                             }
+                             SetCounters(state, kVocab * 6, 0);
+                           });
+}
+
+void RegisterFill(const std::string &name, Device device, const Options &) {
+  using Kernel = decltype(rwkv::fill_) *;
+  RegisterVariants<Kernel>(name, device, std::to_string(kVocab),
+                           [](benchmark::State &state, Kernel kernel) {
+                             auto x = Vector(kVocab);
+                             for (auto _ : state) {
+                               kernel(x, 0.5f);
+                               benchmark::DoNotOptimize(x.data_ptr());
+                             }
+                             SetCounters(state, kVocab * 4, 0);
+                           });
+}
+
+void RegisterScalarDiv(const std::string &name, Device device,
+                       const Options &) {
+  using Kernel = decltype(rwkv::scalar_div_) *;
+  RegisterVariants<Kernel>(name, device, std::to_string(kVocab),
+                           [](benchmark::State &state, Kernel kernel) {
+                             auto x = Vector(kVocab);
+                             for (auto _ : state) {
+                               // x / 1 keeps the values for the next
+                               // iteration
+                               kernel(x, 1.f);
+                               benchmark::DoNotOptimize(x.data_ptr());
+                             }
+                             SetCounters(state, kVocab * 8, kVocab);
+                           });
+}
+
+void RegisterAtt(const std::string &name, Device device,
+                 const Options &options) {
+  using Kernel = decltype(rwkv::att) *;
+  for (auto c : options.embds) {
+    for (auto dtype : options.dtypes) {
+      RegisterVariants<Kernel>(
+          name, device, DTypeName(dtype) + "/" + std::to_string(c),
+          [c, dtype](benchmark::State &state, Kernel kernel) {
+            auto x = Vector(c);
+            auto sx = Vector(c);
+            auto aa = Vector(c);
+            auto bb = Vector(c, 0.5, 1.5);
+            auto pp = Vector(c);
+            auto ln_w = Vector(c, 0.5, 1.5);
+            auto ln_b = Vector(c);
+            auto k_mix = Vector(c, 0, 1);
+            auto v_mix = Vector(c, 0, 1);
+            auto r_mix = Vector(c, 0, 1);
+            auto t_decay = Vector(c, -2, -0.5);
+            auto t_first = Vector(c);
+            auto kw = Weight(c, c, dtype);
+            auto vw = Weight(c, c, dtype);
+            auto rw = Weight(c, c, dtype);
+            auto ow = Weight(c, c, dtype);
+            for (auto _ : state) {
+              auto out = kernel(x, sx, aa, bb, pp, ln_w, ln_b, k_mix, v_mix,
+                                r_mix, t_decay, t_first, kw, vw, rw, ow);
+              benchmark::DoNotOptimize(std::get<0>(out).data_ptr());
+            }
+            // 4 weights and about 20 vectors
+            SetCounters(state, 4 * c * c * ElemSize(dtype) + 20 * c * 4,
+                        8. * c * c + 30. * c);
+          });
+    }
+  }
+}
+
+void RegisterAttV5(const std::string &name, Device device,
+                   const Options &options) {
+  using Kernel = decltype(rwkv::att_v5) *;
+  for (auto c : options.embds) {
+    for (auto dtype : options.dtypes) {
+      RegisterVariants<Kernel>(
+          name, device, DTypeName(dtype) + "/" + std::to_string(c),
+          [c, dtype](benchmark::State &state, Kernel kernel) {
+            const int64_t n_head = c / kHeadSize;
+            auto x = Vector(c);
+            auto sx = Vector(c);
+            auto s = Random({n_head, kHeadSize, kHeadSize}, DType::kFloat32,
+                            -1, 1);
+            auto ln_w = Vector(c, 0.5, 1.5);
+            auto ln_b = Vector(c);
+            auto k_mix = Vector(c, 0, 1);
+            auto v_mix = Vector(c, 0, 1);
+            auto r_mix = Vector(c, 0, 1);
+            auto g_mix = Vector(c, 0, 1);
+            // exp(-exp(w)) is in (0, 1), the state stays bounded
+            auto t_decay = Vector(c, 0.5, 0.99);
+            auto t_first = Vector(c);
+            auto kw = Weight(c, c, dtype);
+            auto vw = Weight(c, c, dtype);
+            auto rw = Weight(c, c, dtype);
+            auto gw = Weight(c, c, dtype);
+            auto ow = Weight(c, c, dtype);
+            auto lx_w = Vector(c, 0.5, 1.5);
+            auto lx_b = Vector(c);
+            for (auto _ : state) {
+              auto out =
+                  kernel(x, sx, s, ln_w, ln_b, k_mix, v_mix, r_mix, g_mix,
+                         t_decay, t_first, kw, vw, rw, gw, ow, lx_w, lx_b);
+              benchmark::DoNotOptimize(std::get<0>(out).data_ptr());
+            }
+            // 5 weights, the state read and written, and about 25 vectors
+            SetCounters(state,
+                        5 * c * c * ElemSize(dtype) + 2 * c * kHeadSize * 4 +
+                            25 * c * 4,
+                        10. * c * c + 4. * c * kHeadSize);
+          });
+    }
+  }
+}
+
+void RegisterFfn(const std::string &name, Device device,
+                 const Options &options) {
+  using Kernel = decltype(rwkv::ffn) *;
+  for (auto c : options.embds) {
+    for (auto dtype : options.dtypes) {
+      RegisterVariants<Kernel>(
+          name, device, DTypeName(dtype) + "/" + std::to_string(c),
+          [c, dtype](benchmark::State &state, Kernel kernel) {
+            auto x = Vector(c);
+            auto sx = Vector(c);
+            auto ln_w = Vector(c, 0.5, 1.5);
+            auto ln_b = Vector(c);
+            auto k_mix = Vector(c, 0, 1);
+            auto r_mix = Vector(c, 0, 1);
+            auto kw = Weight(c, 4 * c, dtype);
+            auto vw = Weight(4 * c, c, dtype);
+            auto rw = Weight(c, c, dtype);
+            for (auto _ : state) {
+              auto out = kernel(x, sx, ln_w, ln_b, k_mix, r_mix, kw, vw, rw);
+              benchmark::DoNotOptimize(std::get<0>(out).data_ptr());
+            }
+            // 3 weights, the [4 * c] hidden and about 12 vectors
+            SetCounters(state,
+                        9 * c * c * ElemSize(dtype) + 2 * 4 * c * 4 +
+                            12 * c * 4,
+                        18. * c * c + 20. * c);
+          });
+    }
+  }
+}
+
+const std::map<std::string, OpRegisterer> &Registerers() {
+  static const std::map<std::string, OpRegisterer> registerers = {
+      {"matmul", RegisterMatmul},   {"layernorm", RegisterLayerNorm},
+      {"cast_dtype", RegisterCastDType}, {"fill_", RegisterFill},
+      {"scalar_div_", RegisterScalarDiv}, {"att", RegisterAtt},
+      {"att_v5", RegisterAttV5},    {"ffn", RegisterFfn},
+  };
+  return registerers;
+}
+
+template <typename T>
+std::vector<T> ParseList(const std::string &str,
+                         const std::function<T(const std::string &)> &parse) {
+  std::vector<T> ret;
+  std::istringstream stream(str);
+  for (std::string item; std::getline(stream, item, ',');) {
+    ret.push_back(parse(item));
+  }
+  return ret;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string embds = "768,2048,4096";
+  std::string dtypes = "fp16,fp32";
+  // our flags, the others are left to google benchmark
+  int new_argc = 0;
+  for (int i = 0; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("--embd=", 0) == 0) {
+      embds = arg.substr(7);
+    } else if (arg.rfind("--dtypes=", 0) == 0) {
+      dtypes = arg.substr(9);
+    } else {
+      argv[new_argc++] = argv[i];
+    }
+  }
+  argc = new_argc;
+  Options options;
+  options.embds = ParseList<int64_t>(
+      embds, [](const std::string &s) { return std::stoll(s); });
+  options.dtypes = ParseList<DType>(dtypes, [](const std::string &s) {
+    RV_CHECK(s == "fp16" || s == "fp32");
+    return s == "fp16" ? DType::kFloat16 : DType::kFloat32;
+  });
+
+  // only the cpu kernels take inputs in host memory
+  for (auto &[name, device] : rwkv::KernelRegistry::Instance().Keys()) {
+    auto it = Registerers().find(name);
+    if (device == Device::kCPU && it != Registerers().end()) {
+      it->second(name, device, options);
+    } else {
+      std::cout << "skipping " << name << " on " << rwkv::DeviceName(device)
+                << std::endl;
+    }
+  }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "kernels/cpu/matmul.h"
+#include "model.h"
+#include "tokenizer.h"
+
+// max |input| of every block weight over the token id `prompts`, run on the
+// cpu backend. Used by the exporters for the input scales of the int8
+// weights.
+inline std::map<std::string, float>
+calibrate(const std::string &model_path,
+          const std::vector<std::vector<int>> &prompts) {
+  RV_CHECK(!prompts.empty());
+  rwkv::Model model(model_path, "cpu fp32");
+  std::map<std::string, float> input_absmax;
+  rwkv::cpu::set_gemv_observer([&](const rwkv::Tensor &w, const float *x) {
+    // the head stays in fp16 for the precision of the logits
+    if (w.name.rfind("blocks.", 0) != 0) {
+      return;
+    }
+    auto &absmax = input_absmax[w.name];
+    for (int64_t i = 0; i < w.size(0); i++) {
+      absmax = std::max(absmax, std::abs(x[i]));
+    }
+  });
+  for (auto &prompt : prompts) {
+    auto states = model.CreateInitialStates();
+    model.Run(prompt, states);
+  }
+  rwkv::cpu::set_gemv_observer(nullptr);
+  std::cout << "calibrated " << input_absmax.size() << " weights on "
+            << prompts.size() << " prompts" << std::endl;
+  return input_absmax;
+}
+
+// the same over the prompts in `prompt_path` (one per line)
+inline std::map<std::string, float>
+calibrate(const std::string &model_path, const std::string &tokenizer_path,
+          const std::string &prompt_path) {
+  rwkv::Tokenizer tokenizer(tokenizer_path);
+  std::vector<std::vector<int>> prompts;
+  std::ifstream prompt_file(prompt_path);
+  for (std::string line; std::getline(prompt_file, line);) {
+    if (!line.empty()) {
+      prompts.push_back(tokenizer.encode(line));
+    }
+  }
+  return calibrate(model_path, prompts);
+}
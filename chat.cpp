@@ -52,6 +52,7 @@ int main(int argc, char **argv) {
     }
     auto output = Copy(model.Run(prompt_ids, states), rwkv::Device::kCPU);
     std::string response;
+    rwkv::StreamingDecoder decoder(tokenizer);
     int num_new_tokens = 0;
     for (; num_new_tokens < kMaxOutputLength; num_new_tokens++) {
       for (auto &[id, occurence] : occurences) {
@@ -85,9 +86,8 @@ int main(int argc, char **argv) {
       if (output_id == kEndOfSentence && !kQAMode) {
         break;
       }
-      auto output_str = tokenizer.decode(output_id);
-      std::cout << output_str;
-      response += output_str;
+      auto n = decoder.decode(output_id, response);
+      std::cout << std::string_view(response).substr(response.size() - n);
       if (response.size() >= 2 &&
           response.substr(response.size() - 2) == "\n\n") {
         break;
@@ -98,6 +98,8 @@ int main(int argc, char **argv) {
       // }
       output = Copy(model.Run(output_id, states), rwkv::Device::kCPU);
     }
+    auto n = decoder.flush(response);
+    std::cout << std::string_view(response).substr(response.size() - n);
     auto model_time = std::chrono::duration_cast<std::chrono::milliseconds>(
         std::chrono::system_clock::now() - tmp);
     auto end = std::chrono::system_clock::now();
@@ -0,0 +1,17 @@
+#include <iostream>
+
+#include "tokenizer.h"
+
+// usage: compile_tokenizer <tokenizer> <output path>
+// Writes the vocab and the trie of a msgpack tokenizer (as converted by
+// tools/convert_tokenizer.py) as a compiled tokenizer file, which is mmap-ed
+// instead of parsed when loaded.
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " <tokenizer> <output path>"
+              << std::endl;
+    return 1;
+  }
+  rwkv::Tokenizer tokenizer(argv[1]);
+  tokenizer.save(argv[2]);
+}
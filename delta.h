@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "lora.h"
+#include "tensor.h"
+
+namespace rwkv {
+
+// The delta of a fine-tuned weight against the weight of its base model (see
+// tools/make_delta.py), added on the fly by the cpu gemv. Exactly one of the
+// two forms is set:
+//   * int8: `w = base + q * scale[n]` for every output column n, about half
+//     the size of an fp16 weight,
+//   * low rank: `w = base + a @ b`, applied like an unmerged LoRA adapter
+//     (with scale 1). r * (K + N) fp32 values, e.g. 1/32 of an fp16
+//     2048x2048 weight for r = 16.
+struct WeightDelta {
+  struct Int8 {
+    // int8, [K, N], sharded like the base weight (see cpu::shard_weight)
+    Tensor q;
+    // fp32, [N]
+    Tensor scale;
+  };
+  std::optional<Int8> int8;
+  std::optional<LoraAdapter::Weight> low_rank;
+};
+
+// The deltas of a variant model which are not materialized, by the name of
+// the base weight. Owned by the Model, the base weights stay shared.
+using WeightDeltas =
+    std::unordered_map<std::string, std::shared_ptr<const WeightDelta>>;
+
+// The deltas applied by the cpu kernels on the current thread, or nullptr.
+// Set by Model for its forwards.
+inline const WeightDeltas *&ActiveDeltas() {
+  thread_local const WeightDeltas *deltas = nullptr;
+  return deltas;
+}
+
+class ScopedDeltas {
+public:
+  explicit ScopedDeltas(const WeightDeltas *deltas) : _prev(ActiveDeltas()) {
+    ActiveDeltas() = deltas;
+  }
+  ~ScopedDeltas() { ActiveDeltas() = _prev; }
+  FR_DISALLOW_COPY_AND_MOVE(ScopedDeltas);
+
+private:
+  const WeightDeltas *_prev;
+};
+
+} // namespace rwkv
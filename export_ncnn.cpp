@@ -1,3 +1,7 @@
+#include <string>
+
+#include "calibrate.h"
+#include "kernels/ncnn-meta/kernels.h"
 #include "model.h"
 
 namespace rwkv {
@@ -7,10 +11,27 @@ void destroy();
 } // namespace ncnnmeta
 } // namespace rwkv
 
+// usage: export_ncnn [--batch] <output prefix> <model> [<tokenizer> <prompt
+// file>]
+// With a tokenizer and a file of sample prompts, the block weights are
+// exported as int8, calibrated on the prompts. With --batch the graph runs
+// one token of each of many sessions (see Model::RunBatch) instead of many
+// tokens of one session.
 int main(int argc, char **argv) {
+  bool batch = argc > 1 && std::string(argv[1]) == "--batch";
+  if (batch) {
+    argc--;
+    argv++;
+  }
   std::string output_prefix(argv[1]);
+  std::map<std::string, float> int8_input_absmax;
+  if (argc > 4) {
+    int8_input_absmax = calibrate(argv[2], argv[3], argv[4]);
+  }
   // TODO: refactor
   rwkv::ncnnmeta::init(output_prefix + ".bin", output_prefix + ".param");
+  rwkv::ncnnmeta::set_batch(batch);
+  rwkv::ncnnmeta::set_int8_input_absmax(int8_input_absmax);
 
   // NOTE: fp32 here is just a placeholder. The dtype used by ncnn is determined
   // when the model is loaded.
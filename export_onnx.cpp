@@ -0,0 +1,26 @@
+#include <string>
+
+#include "calibrate.h"
+#include "kernels/onnx-meta/kernels.h"
+#include "model.h"
+
+// usage: export_onnx <output path> <model> [<tokenizer> <prompt file>]
+// The weights are exported as fp16. With a tokenizer and a file of sample
+// prompts, the block weights are exported as int8 (QDQ) instead, calibrated
+// on the prompts. The written model is checked by the ONNX checker.
+int main(int argc, char **argv) {
+  std::string output_path(argv[1]);
+  std::map<std::string, float> int8_input_absmax;
+  if (argc > 4) {
+    int8_input_absmax = calibrate(argv[2], argv[3], argv[4]);
+  }
+  rwkv::onnxmeta::init(output_path);
+  rwkv::onnxmeta::set_int8_input_absmax(int8_input_absmax);
+
+  // NOTE: the activations of the exported graph are always fp32
+  rwkv::Model model(argv[2], "onnx-meta fp32");
+  auto states = model.CreateInitialStates();
+  model.Run(0, states);
+  rwkv::onnxmeta::destroy();
+  rwkv::onnxmeta::check_model(output_path);
+}
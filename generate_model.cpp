@@ -0,0 +1,37 @@
+#include <iostream>
+#include <string>
+
+#include "random_model.h"
+
+// usage: generate_model <output path> <n_layer> <n_embd> <n_vocab>
+//                       [fp16|fp32] [v4|v5] [n_head] [seed]
+// Writes a model with random weights, e.g. `generate_model 0.1b.fr 12 768
+// 65536` for the shape of RWKV-4 0.1B or `generate_model 7b.fr 32 4096 65536`
+// for 7B. It can be exported to ncnn by export_ncnn as a real model.
+int main(int argc, char **argv) {
+  if (argc < 5) {
+    std::cerr << "usage: " << argv[0]
+              << " <output path> <n_layer> <n_embd> <n_vocab> [fp16|fp32] "
+                 "[v4|v5] [n_head] [seed]"
+              << std::endl;
+    return 1;
+  }
+  rwkv::RandomModelConfig config;
+  config.n_layer = std::stoi(argv[2]);
+  config.n_embd = std::stoi(argv[3]);
+  config.n_vocab = std::stoi(argv[4]);
+  if (argc > 5) {
+    config.dtype = std::string(argv[5]) == "fp32" ? rwkv::DType::kFloat32
+                                                   : rwkv::DType::kFloat16;
+  }
+  if (argc > 6) {
+    config.version = std::string(argv[6]) == "v5" ? 5 : 4;
+  }
+  // head size 64 as the released RWKV-5 models
+  config.n_head = argc > 7 ? std::stoi(argv[7]) : config.n_embd / 64;
+  if (argc > 8) {
+    config.seed = std::stoull(argv[8]);
+  }
+  rwkv::WriteRandomModel(argv[1], config);
+  return 0;
+}
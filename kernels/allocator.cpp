@@ -0,0 +1,125 @@
+#include "kernels/allocator.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <kernels/kernels.h>
+#include <kernels/registry.h>
+
+namespace rwkv {
+
+namespace {
+void AtomicMax(std::atomic<int64_t> &x, int64_t value) {
+  int64_t prev = x.load(std::memory_order_relaxed);
+  while (prev < value &&
+         !x.compare_exchange_weak(prev, value, std::memory_order_relaxed)) {
+  }
+}
+
+void PrintAtExit() { PrintAllocatorStats(std::cerr); }
+} // namespace
+
+const char *AllocTagName(AllocTag tag) {
+  switch (tag) {
+  case AllocTag::kWeights:
+    return "weights";
+  case AllocTag::kStates:
+    return "states";
+  case AllocTag::kActivations:
+    return "activations";
+  }
+  return "unknown";
+}
+
+// Registered by the first allocator, i.e. after the kernel registry is
+// constructed, so that it runs before the registry is destroyed
+Allocator::Allocator() {
+  static const bool print_at_exit = [] {
+    if (std::getenv("FR_MEMORY_STATS") == nullptr) {
+      return false;
+    }
+    std::atexit(PrintAtExit);
+    return true;
+  }();
+  (void)print_at_exit;
+}
+
+void Allocator::Account(AllocTag tag, int64_t bytes, int64_t allocations) {
+  for (int i : {static_cast<int>(tag), kNumAllocTags}) {
+    int64_t current =
+        _current[i].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    AtomicMax(_peak[i], current);
+    _num_allocations[i].fetch_add(allocations, std::memory_order_relaxed);
+  }
+}
+
+void Allocator::Retag(size_t size, AllocTag from, AllocTag to) {
+  if (from == to) {
+    return;
+  }
+  int64_t bytes = AlignedSize(size);
+  _current[static_cast<int>(from)].fetch_sub(bytes, std::memory_order_relaxed);
+  int64_t current = _current[static_cast<int>(to)].fetch_add(
+                        bytes, std::memory_order_relaxed) +
+                    bytes;
+  AtomicMax(_peak[static_cast<int>(to)], current);
+}
+
+AllocatorStats Allocator::stats() const {
+  AllocatorStats stats;
+  stats.current_bytes = _current[kNumAllocTags].load(std::memory_order_relaxed);
+  stats.peak_bytes = _peak[kNumAllocTags].load(std::memory_order_relaxed);
+  stats.num_allocations =
+      _num_allocations[kNumAllocTags].load(std::memory_order_relaxed);
+  for (int i = 0; i < kNumAllocTags; i++) {
+    stats.tag_current_bytes[i] = _current[i].load(std::memory_order_relaxed);
+    stats.tag_peak_bytes[i] = _peak[i].load(std::memory_order_relaxed);
+    stats.tag_num_allocations[i] =
+        _num_allocations[i].load(std::memory_order_relaxed);
+  }
+  stats.reserved_bytes = ReservedBytes();
+  stats.num_forwards = _num_forwards.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void Allocator::ResetPeakStats() {
+  for (int i = 0; i <= kNumAllocTags; i++) {
+    _peak[i].store(_current[i].load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+  }
+}
+
+void PrintAllocatorStats(std::ostream &os) {
+  auto mb = [](int64_t bytes) { return bytes / 1024. / 1024.; };
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(2);
+  for (auto &[name, device] : KernelRegistry::Instance().Keys()) {
+    if (name != "allocator") {
+      continue;
+    }
+    auto stats = allocator(device).stats();
+    if (stats.num_allocations == 0) {
+      continue;
+    }
+    out << "memory on " << DeviceName(device) << ": " << mb(stats.current_bytes)
+        << " MB in use, " << mb(stats.peak_bytes) << " MB peak, "
+        << mb(stats.reserved_bytes) << " MB reserved ("
+        << stats.fragmentation() * 100 << "% fragmentation), "
+        << stats.num_allocations << " allocations, "
+        << stats.allocations_per_forward() << " per forward in "
+        << stats.num_forwards << " forwards\n";
+    for (int i = 0; i < kNumAllocTags; i++) {
+      out << "  " << std::left << std::setw(12)
+          << AllocTagName(static_cast<AllocTag>(i)) << std::right
+          << std::setw(12) << mb(stats.tag_current_bytes[i]) << " MB in use"
+          << std::setw(12) << mb(stats.tag_peak_bytes[i]) << " MB peak"
+          << std::setw(12) << stats.tag_num_allocations[i]
+          << " allocations\n";
+    }
+  }
+  os << out.str() << std::flush;
+}
+
+} // namespace rwkv
@@ -1,16 +1,123 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <ostream>
 
 namespace rwkv {
+
+// What an allocation holds. An allocation gets the tag of the innermost
+// ScopedAllocTag of the allocating thread, kActivations (i.e. anything else)
+// by default.
+enum class AllocTag {
+  kWeights,
+  kStates,
+  kActivations,
+};
+constexpr int kNumAllocTags = 3;
+const char *AllocTagName(AllocTag tag);
+
+inline AllocTag &CurrentAllocTag() {
+  thread_local AllocTag tag = AllocTag::kActivations;
+  return tag;
+}
+
+class ScopedAllocTag {
+public:
+  explicit ScopedAllocTag(AllocTag tag) : _prev(CurrentAllocTag()) {
+    CurrentAllocTag() = tag;
+  }
+  ~ScopedAllocTag() { CurrentAllocTag() = _prev; }
+  ScopedAllocTag(const ScopedAllocTag &) = delete;
+  ScopedAllocTag &operator=(const ScopedAllocTag &) = delete;
+
+private:
+  AllocTag _prev;
+};
+
+// A snapshot of the counters of an allocator, in (aligned) bytes
+struct AllocatorStats {
+  int64_t current_bytes = 0;
+  int64_t peak_bytes = 0;
+  int64_t num_allocations = 0;
+  // indexed by AllocTag
+  int64_t tag_current_bytes[kNumAllocTags] = {};
+  int64_t tag_peak_bytes[kNumAllocTags] = {};
+  int64_t tag_num_allocations[kNumAllocTags] = {};
+  // the bytes held from the device, more than current_bytes for a caching
+  // allocator
+  int64_t reserved_bytes = 0;
+  // the forwards run by models on the device, see Model::Run
+  int64_t num_forwards = 0;
+
+  // the activation allocations per forward, 0 in a steady state without
+  // allocations in the hot path
+  double allocations_per_forward() const {
+    return num_forwards == 0
+               ? 0
+               : static_cast<double>(tag_num_allocations[static_cast<int>(
+                     AllocTag::kActivations)]) /
+                     num_forwards;
+  }
+  // the fraction of the reserved bytes which is not in use
+  double fragmentation() const {
+    return reserved_bytes <= 0
+               ? 0
+               : 1 - static_cast<double>(current_bytes) / reserved_bytes;
+  }
+};
+
 class Allocator {
 public:
-  void *Allocate(size_t size) {
-    size = (size + kAlignSize - 1) / kAlignSize * kAlignSize;
-    return DoAllocate(size);
+  Allocator();
+  virtual ~Allocator() = default;
+
+  void *Allocate(size_t size, AllocTag tag = CurrentAllocTag()) {
+    size = AlignedSize(size);
+    void *ptr = DoAllocate(size);
+    Account(tag, size, 1);
+    return ptr;
+  }
+  // `size` and `tag` are those of the allocation
+  void Deallocate(void *ptr, size_t size, AllocTag tag) {
+    DoDeallocate(ptr);
+    Account(tag, -static_cast<int64_t>(AlignedSize(size)), 0);
   }
+  // Moves an allocation from tag `from` to `to`, e.g. the state tensors
+  // created during a forward
+  void Retag(size_t size, AllocTag from, AllocTag to);
+  void CountForward() { _num_forwards.fetch_add(1, std::memory_order_relaxed); }
+
+  AllocatorStats stats() const;
+  // Sets the peaks to the current values, e.g. after loading a model
+  void ResetPeakStats();
+
   virtual void *DoAllocate(size_t size) = 0;
-  virtual void Deallocate(void *ptr) = 0;
+  virtual void DoDeallocate(void *ptr) = 0;
+  // The bytes held from the device, for caching allocators
+  virtual int64_t ReservedBytes() const {
+    return _current[kNumAllocTags].load(std::memory_order_relaxed);
+  }
+
   static const int kAlignSize = 512;
+
+private:
+  static size_t AlignedSize(size_t size) {
+    return (size + kAlignSize - 1) / kAlignSize * kAlignSize;
+  }
+  void Account(AllocTag tag, int64_t bytes, int64_t allocations);
+
+  // indexed by AllocTag, and kNumAllocTags for the total
+  std::atomic<int64_t> _current[kNumAllocTags + 1] = {};
+  std::atomic<int64_t> _peak[kNumAllocTags + 1] = {};
+  std::atomic<int64_t> _num_allocations[kNumAllocTags + 1] = {};
+  std::atomic<int64_t> _num_forwards{0};
 };
+
+// The stats of the allocators of all devices which have allocated anything.
+// They are also printed to stderr at exit if the FR_MEMORY_STATS environment
+// variable is set.
+void PrintAllocatorStats(std::ostream &os);
+
 } // namespace rwkv
@@ -11,12 +11,14 @@ public:
   void *DoAllocate(size_t size) {
     return aligned_alloc(kAlignSize, size);
   }
-  void Deallocate(void *ptr) { free(ptr); }
+  void DoDeallocate(void *ptr) { free(ptr); }
 };
 
+// never destroyed, so that tensors freed at exit and the stats printed at
+// exit (see PrintAllocatorStats) can still use it
 rwkv::Allocator& allocator() {
-  static Allocator allocator;
-  return allocator;
+  static auto *allocator = new Allocator;
+  return *allocator;
 }
 
 KernelRegister allocator_reg("allocator", Device::kCPU, allocator);
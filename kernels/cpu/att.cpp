@@ -0,0 +1,92 @@
+#include <cmath>
+
+#include <kernels/registry.h>
+#include <tensor.h>
+
+#include "matmul.h"
+
+namespace rwkv {
+namespace cpu {
+
+Tensor layernorm(const Tensor &x, const Tensor &weight, const Tensor &bias);
+
+std::tuple<Tensor, Tensor, Tensor, Tensor, Tensor>
+att(const Tensor &x, const Tensor &sx, const Tensor &aa, const Tensor &bb,
+    const Tensor &pp, const Tensor &ln_w, const Tensor &ln_b,
+    const Tensor &k_mix, const Tensor &v_mix, const Tensor &r_mix,
+    const Tensor &t_decay, const Tensor &t_first, const Tensor &kw,
+    const Tensor &vw, const Tensor &rw, const Tensor &ow) {
+  RV_CHECK(x.dtype() == DType::kFloat32 && sx.dtype() == DType::kFloat32);
+  auto c = x.numel();
+  Tensor xx = layernorm(x, ln_w, ln_b);
+
+  // kx, vx, rx, k, v, r
+  auto buf = Tensor::Empty({6 * c}, DType::kFloat32, Device::kCPU);
+  float *kx = buf.data_ptr<float>();
+  float *vx = kx + c;
+  float *rx = vx + c;
+  float *k = rx + c;
+  float *v = k + c;
+  float *r = v + c;
+  {
+    auto *xx_ptr = xx.data_ptr<float>();
+    auto *sx_ptr = sx.data_ptr<float>();
+    auto *k_mix_ptr = k_mix.data_ptr<float>();
+    auto *v_mix_ptr = v_mix.data_ptr<float>();
+    auto *r_mix_ptr = r_mix.data_ptr<float>();
+    for (int64_t i = 0; i < c; i++) {
+      kx[i] = xx_ptr[i] * k_mix_ptr[i] + sx_ptr[i] * (1 - k_mix_ptr[i]);
+      vx[i] = xx_ptr[i] * v_mix_ptr[i] + sx_ptr[i] * (1 - v_mix_ptr[i]);
+      rx[i] = xx_ptr[i] * r_mix_ptr[i] + sx_ptr[i] * (1 - r_mix_ptr[i]);
+    }
+  }
+
+  gemv({{kx, &kw, k}, {vx, &vw, v}, {rx, &rw, r, Activation::kSigmoid}});
+
+  auto t1 = Tensor::Empty({c}, DType::kFloat32, Device::kCPU);
+  auto t2 = Tensor::Empty({c}, DType::kFloat32, Device::kCPU);
+  auto p = Tensor::Empty({c}, DType::kFloat32, Device::kCPU);
+  {
+    auto *t_first_ptr = t_first.data_ptr<float>();
+    auto *t_decay_ptr = t_decay.data_ptr<float>();
+    auto *aa_ptr = aa.data_ptr<float>();
+    auto *bb_ptr = bb.data_ptr<float>();
+    auto *pp_ptr = pp.data_ptr<float>();
+    auto *t1_ptr = t1.data_ptr<float>();
+    auto *t2_ptr = t2.data_ptr<float>();
+    auto *p_ptr = p.data_ptr<float>();
+    // same as WkvForwardOne in kernels/cuda/att.cu
+    for (int64_t i = 0; i < c; i++) {
+      float ww = t_first_ptr[i] + k[i];
+      float pp_ = pp_ptr[i];
+      float p_ = std::max(pp_, ww);
+      float e1 = std::exp(pp_ - p_);
+      float e2 = std::exp(ww - p_);
+      float aa_ = aa_ptr[i];
+      float bb_ = bb_ptr[i];
+      // r * wkv
+      r[i] *= (e1 * aa_ + e2 * v[i]) / (e1 * bb_ + e2);
+      ww = t_decay_ptr[i] + pp_;
+      p_ = std::max(ww, k[i]);
+      e1 = std::exp(ww - p_);
+      e2 = std::exp(k[i] - p_);
+      t1_ptr[i] = e1 * aa_ + e2 * v[i];
+      t2_ptr[i] = e1 * bb_ + e2;
+      p_ptr[i] = p_;
+    }
+  }
+
+  auto x_plus_out = Tensor::Empty(x.shape(), DType::kFloat32, Device::kCPU);
+  auto *out_ptr = x_plus_out.data_ptr<float>();
+  gemv({{r, &ow, out_ptr}});
+  auto *x_ptr = x.data_ptr<float>();
+  for (int64_t i = 0; i < c; i++) {
+    out_ptr[i] += x_ptr[i];
+  }
+  return {x_plus_out, xx, t1, t2, p};
+}
+
+KernelRegister att_reg("att", Device::kCPU, att);
+
+} // namespace cpu
+} // namespace rwkv
@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <cmath>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define FR_CPU_AVX2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define FR_CPU_NEON 1
+#endif
+
+#include <kernels/registry.h>
+#include <tensor.h>
+
+#include "matmul.h"
+#include "thread_pool.h"
+
+namespace rwkv {
+namespace cpu {
+
+Tensor layernorm(const Tensor &x, const Tensor &weight, const Tensor &bias);
+
+namespace {
+
+// One row i of the wkv state of a head, with a[j] = k_i * v[j]:
+//   out[j] += r_i * (u_i * a[j] + s[j])
+//   new_s[j] = a[j] + w_i * s[j]
+// A row is head_size floats, so the state of a head (e.g. 64x64 fp32, 16KB)
+// stays in L1 while its rows are processed one by one.
+void wkv_row(const float *s, float *new_s, const float *v, float *out,
+             float r_i, float k_i, float u_i, float w_i, int64_t n) {
+  int64_t j = 0;
+#if defined(FR_CPU_AVX2)
+  __m256 r8 = _mm256_set1_ps(r_i);
+  __m256 k8 = _mm256_set1_ps(k_i);
+  __m256 u8 = _mm256_set1_ps(u_i);
+  __m256 w8 = _mm256_set1_ps(w_i);
+  for (; j + 8 <= n; j += 8) {
+    __m256 a = _mm256_mul_ps(k8, _mm256_loadu_ps(v + j));
+    __m256 s8 = _mm256_loadu_ps(s + j);
+    __m256 o = _mm256_fmadd_ps(u8, a, s8);
+    _mm256_storeu_ps(out + j, _mm256_fmadd_ps(r8, o, _mm256_loadu_ps(out + j)));
+    _mm256_storeu_ps(new_s + j, _mm256_fmadd_ps(w8, s8, a));
+  }
+#elif defined(FR_CPU_NEON)
+  float32x4_t u4 = vdupq_n_f32(u_i);
+  float32x4_t w4 = vdupq_n_f32(w_i);
+  for (; j + 4 <= n; j += 4) {
+    float32x4_t a = vmulq_n_f32(vld1q_f32(v + j), k_i);
+    float32x4_t s4 = vld1q_f32(s + j);
+    float32x4_t o = vfmaq_f32(s4, u4, a);
+    vst1q_f32(out + j, vfmaq_n_f32(vld1q_f32(out + j), o, r_i));
+    vst1q_f32(new_s + j, vfmaq_f32(a, w4, s4));
+  }
+#endif
+  for (; j < n; j++) {
+    float a = k_i * v[j];
+    out[j] += r_i * (u_i * a + s[j]);
+    new_s[j] = a + w_i * s[j];
+  }
+}
+
+} // namespace
+
+// RWKV-5.2 att. `t_decay` (already exp(-exp(w))) and `t_first` are either
+// per channel or per head. The new wkv state is returned in a new tensor, `s`
+// is not modified.
+std::tuple<Tensor, Tensor, Tensor>
+att_v5(const Tensor &x, const Tensor &sx, const Tensor &s, const Tensor &ln_w,
+       const Tensor &ln_b, const Tensor &k_mix, const Tensor &v_mix,
+       const Tensor &r_mix, const Tensor &g_mix, const Tensor &t_decay,
+       const Tensor &t_first, const Tensor &kw, const Tensor &vw,
+       const Tensor &rw, const Tensor &gw, const Tensor &ow,
+       const Tensor &lx_w, const Tensor &lx_b) {
+  RV_CHECK(x.dtype() == DType::kFloat32 && sx.dtype() == DType::kFloat32);
+  RV_CHECK(s.dtype() == DType::kFloat32 && s.shape().size() == 3);
+  auto c = x.numel();
+  auto n_head = s.size(0);
+  auto head_size = s.size(1);
+  RV_CHECK(n_head * head_size == c && s.size(2) == head_size);
+  RV_CHECK(t_decay.numel() == c || t_decay.numel() == n_head);
+  RV_CHECK(t_first.numel() == c || t_first.numel() == n_head);
+  Tensor xx = layernorm(x, ln_w, ln_b);
+
+  // kx, vx, rx, gx, k, v, r, silu(g), out
+  auto buf = Tensor::Empty({9 * c}, DType::kFloat32, Device::kCPU);
+  float *kx = buf.data_ptr<float>();
+  float *vx = kx + c;
+  float *rx = vx + c;
+  float *gx = rx + c;
+  float *k = gx + c;
+  float *v = k + c;
+  float *r = v + c;
+  float *g = r + c;
+  float *out = g + c;
+  {
+    auto *xx_ptr = xx.data_ptr<float>();
+    auto *sx_ptr = sx.data_ptr<float>();
+    auto *k_mix_ptr = k_mix.data_ptr<float>();
+    auto *v_mix_ptr = v_mix.data_ptr<float>();
+    auto *r_mix_ptr = r_mix.data_ptr<float>();
+    auto *g_mix_ptr = g_mix.data_ptr<float>();
+    for (int64_t i = 0; i < c; i++) {
+      kx[i] = xx_ptr[i] * k_mix_ptr[i] + sx_ptr[i] * (1 - k_mix_ptr[i]);
+      vx[i] = xx_ptr[i] * v_mix_ptr[i] + sx_ptr[i] * (1 - v_mix_ptr[i]);
+      rx[i] = xx_ptr[i] * r_mix_ptr[i] + sx_ptr[i] * (1 - r_mix_ptr[i]);
+      gx[i] = xx_ptr[i] * g_mix_ptr[i] + sx_ptr[i] * (1 - g_mix_ptr[i]);
+    }
+  }
+
+  gemv({{kx, &kw, k},
+        {vx, &vw, v},
+        {rx, &rw, r},
+        {gx, &gw, g, Activation::kSilu}});
+
+  Tensor new_s = Tensor::Empty(s.shape(), DType::kFloat32, Device::kCPU);
+  auto *s_ptr = s.data_ptr<float>();
+  auto *new_s_ptr = new_s.data_ptr<float>();
+  auto *decay_ptr = t_decay.data_ptr<float>();
+  auto *first_ptr = t_first.data_ptr<float>();
+  auto *lx_w_ptr = lx_w.data_ptr<float>();
+  auto *lx_b_ptr = lx_b.data_ptr<float>();
+  int64_t decay_stride = t_decay.numel() == c ? 1 : 0;
+  int64_t first_stride = t_first.numel() == c ? 1 : 0;
+  // a head always goes to the same thread, so its state stays in the cache of
+  // that core between tokens
+  auto &pool = ThreadPool::Instance();
+  pool.Run([&](int thread_id) {
+    auto [begin, end] =
+        ShardRange(n_head, thread_id, pool.num_threads(), /*align=*/1);
+    for (int64_t h = begin; h < end; h++) {
+      auto *head_s = s_ptr + h * head_size * head_size;
+      auto *head_new_s = new_s_ptr + h * head_size * head_size;
+      auto *head_out = out + h * head_size;
+      std::fill_n(head_out, head_size, 0.f);
+      for (int64_t i = 0; i < head_size; i++) {
+        int64_t ch = h * head_size + i;
+        float w_i = decay_stride ? decay_ptr[ch] : decay_ptr[h];
+        float u_i = first_stride ? first_ptr[ch] : first_ptr[h];
+        wkv_row(head_s + i * head_size, head_new_s + i * head_size,
+                v + h * head_size, head_out, r[ch], k[ch], u_i, w_i,
+                head_size);
+      }
+      // group norm, one group per head
+      float mean = 0;
+      for (int64_t j = 0; j < head_size; j++) {
+        mean += head_out[j];
+      }
+      mean /= head_size;
+      float var = 0;
+      for (int64_t j = 0; j < head_size; j++) {
+        var += (head_out[j] - mean) * (head_out[j] - mean);
+      }
+      var /= head_size;
+      float rstd = 1.f / std::sqrt(var + 64e-5f);
+      for (int64_t j = 0; j < head_size; j++) {
+        int64_t ch = h * head_size + j;
+        head_out[j] = ((head_out[j] - mean) * rstd * lx_w_ptr[ch] +
+                       lx_b_ptr[ch]) *
+                      g[ch];
+      }
+    }
+  });
+
+  auto x_plus_out = Tensor::Empty(x.shape(), DType::kFloat32, Device::kCPU);
+  auto *y_ptr = x_plus_out.data_ptr<float>();
+  gemv({{out, &ow, y_ptr}});
+  auto *x_ptr = x.data_ptr<float>();
+  for (int64_t i = 0; i < c; i++) {
+    y_ptr[i] += x_ptr[i];
+  }
+  return {x_plus_out, xx, new_s};
+}
+
+KernelRegister att_v5_reg("att_v5", Device::kCPU, att_v5);
+
+} // namespace cpu
+} // namespace rwkv
@@ -0,0 +1,54 @@
+#include <kernels/registry.h>
+#include <tensor.h>
+
+#include "matmul.h"
+
+namespace rwkv {
+namespace cpu {
+
+Tensor layernorm(const Tensor &x, const Tensor &weight, const Tensor &bias);
+
+std::tuple<Tensor, Tensor> ffn(const Tensor &x, const Tensor &sx,
+                               const Tensor &ln_w, const Tensor &ln_b,
+                               const Tensor &k_mix, const Tensor &r_mix,
+                               const Tensor &kw, const Tensor &vw,
+                               const Tensor &rw) {
+  RV_CHECK(x.dtype() == DType::kFloat32 && sx.dtype() == DType::kFloat32);
+  auto c = x.numel();
+  auto hidden = kw.size(1);
+  Tensor xx = layernorm(x, ln_w, ln_b);
+
+  // kx, rx, r, relu(k) ** 2
+  auto buf = Tensor::Empty({3 * c + hidden}, DType::kFloat32, Device::kCPU);
+  float *kx = buf.data_ptr<float>();
+  float *rx = kx + c;
+  float *r = rx + c;
+  float *vx = r + c;
+  {
+    auto *xx_ptr = xx.data_ptr<float>();
+    auto *sx_ptr = sx.data_ptr<float>();
+    auto *k_mix_ptr = k_mix.data_ptr<float>();
+    auto *r_mix_ptr = r_mix.data_ptr<float>();
+    for (int64_t i = 0; i < c; i++) {
+      kx[i] = xx_ptr[i] * k_mix_ptr[i] + sx_ptr[i] * (1 - k_mix_ptr[i]);
+      rx[i] = xx_ptr[i] * r_mix_ptr[i] + sx_ptr[i] * (1 - r_mix_ptr[i]);
+    }
+  }
+
+  gemv({{kx, &kw, vx, Activation::kReluSquare},
+        {rx, &rw, r, Activation::kSigmoid}});
+
+  auto x_plus_out = Tensor::Empty(x.shape(), DType::kFloat32, Device::kCPU);
+  auto *out_ptr = x_plus_out.data_ptr<float>();
+  gemv({{vx, &vw, out_ptr}});
+  auto *x_ptr = x.data_ptr<float>();
+  for (int64_t i = 0; i < c; i++) {
+    out_ptr[i] = x_ptr[i] + r[i] * out_ptr[i];
+  }
+  return {x_plus_out, xx};
+}
+
+KernelRegister ffn_reg("ffn", Device::kCPU, ffn);
+
+} // namespace cpu
+} // namespace rwkv
@@ -0,0 +1,42 @@
+#include <cmath>
+
+#include <kernels/registry.h>
+#include <tensor.h>
+
+namespace rwkv {
+namespace cpu {
+
+Tensor layernorm(const Tensor &x, const Tensor &weight, const Tensor &bias) {
+  RV_CHECK(x.dtype() == DType::kFloat32);
+  RV_CHECK(weight.dtype() == DType::kFloat32 &&
+           bias.dtype() == DType::kFloat32);
+  auto c = weight.numel();
+  RV_CHECK(x.numel() % c == 0);
+  auto y = Tensor::Empty(x.shape(), DType::kFloat32, Device::kCPU);
+  auto *w_ptr = weight.data_ptr<float>();
+  auto *b_ptr = bias.data_ptr<float>();
+  for (int64_t row = 0; row < x.numel() / c; row++) {
+    auto *x_ptr = x.data_ptr<float>() + row * c;
+    auto *y_ptr = y.data_ptr<float>() + row * c;
+    float mean = 0;
+    for (int64_t i = 0; i < c; i++) {
+      mean += x_ptr[i];
+    }
+    mean /= c;
+    float var = 0;
+    for (int64_t i = 0; i < c; i++) {
+      var += (x_ptr[i] - mean) * (x_ptr[i] - mean);
+    }
+    var /= c;
+    float rstd = 1.f / std::sqrt(var + 1e-5f);
+    for (int64_t i = 0; i < c; i++) {
+      y_ptr[i] = (x_ptr[i] - mean) * rstd * w_ptr[i] + b_ptr[i];
+    }
+  }
+  return y;
+}
+
+KernelRegister layernorm_reg("layernorm", Device::kCPU, layernorm);
+
+} // namespace cpu
+} // namespace rwkv
@@ -0,0 +1,436 @@
+#include "matmul.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+#include <immintrin.h>
+#define FR_CPU_AVX2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define FR_CPU_NEON 1
+#endif
+#if defined(FR_CPU_AVX2)
+#define FR_CPU_SIMD_NAME "avx2"
+#elif defined(FR_CPU_NEON)
+#define FR_CPU_SIMD_NAME "neon"
+#endif
+
+#include <delta.h>
+#include <kernels/registry.h>
+#include <lora.h>
+#include <tensor.h>
+
+#include "thread_pool.h"
+
+namespace rwkv {
+namespace cpu {
+
+Tensor cast_dtype(const Tensor &x, DType dtype);
+
+namespace {
+
+#ifdef FR_CPU_AVX2
+inline float hsum(__m256 v) {
+  __m128 lo = _mm256_castps256_ps128(v);
+  __m128 hi = _mm256_extractf128_ps(v, 1);
+  lo = _mm_add_ps(lo, hi);
+  lo = _mm_hadd_ps(lo, lo);
+  lo = _mm_hadd_ps(lo, lo);
+  return _mm_cvtss_f32(lo);
+}
+
+inline __m256 load8(const float *p) { return _mm256_loadu_ps(p); }
+inline __m256 load8(const float16 *p) {
+  return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+}
+inline __m256 load8(const int8_t *p) {
+  return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))));
+}
+#endif
+
+#ifdef FR_CPU_NEON
+inline float32x4_t load4(const float *p) { return vld1q_f32(p); }
+inline float32x4_t load4(const float16 *p) {
+  return vcvt_f32_f16(vld1_f16(reinterpret_cast<const __fp16 *>(p)));
+}
+inline float32x4_t load4(const int8_t *p) {
+  int32_t packed;
+  memcpy(&packed, p, sizeof(packed));
+  int16x8_t x = vmovl_s8(vreinterpret_s8_s32(vdup_n_s32(packed)));
+  return vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+}
+#endif
+
+// The SIMD path is skipped with `kVectorized` false, for the scalar variant of
+// matmul (see bench_ops)
+template <typename T, bool kVectorized = true>
+float dot(const float *x, const T *w, int64_t k) {
+  int64_t i = 0;
+  float sum = 0;
+#if defined(FR_CPU_SIMD_NAME)
+  if constexpr (kVectorized) {
+#if defined(FR_CPU_AVX2)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= k; i += 16) {
+      acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), load8(w + i), acc0);
+      acc1 =
+          _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), load8(w + i + 8), acc1);
+    }
+    sum = hsum(_mm256_add_ps(acc0, acc1));
+#elif defined(FR_CPU_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0);
+    float32x4_t acc1 = vdupq_n_f32(0);
+    for (; i + 8 <= k; i += 8) {
+      acc0 = vfmaq_f32(acc0, vld1q_f32(x + i), load4(w + i));
+      acc1 = vfmaq_f32(acc1, vld1q_f32(x + i + 4), load4(w + i + 4));
+    }
+    sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#endif
+  } else
+#endif
+  {
+    // independent accumulators, float reductions are not auto-vectorized
+    // without -ffast-math
+    float acc[4] = {0, 0, 0, 0};
+    for (; i + 4 <= k; i += 4) {
+      for (int j = 0; j < 4; j++) {
+        acc[j] += x[i + j] * static_cast<float>(w[i + j]);
+      }
+    }
+    sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+  }
+  for (; i < k; i++) {
+    sum += x[i] * static_cast<float>(w[i]);
+  }
+  return sum;
+}
+
+inline float activate(float x, Activation act) {
+  switch (act) {
+  case Activation::kNone:
+    return x;
+  case Activation::kSigmoid:
+    return 1.f / (1.f + std::exp(-x));
+  case Activation::kReluSquare:
+    return x > 0 ? x * x : 0;
+  case Activation::kSilu:
+    return x / (1.f + std::exp(-x));
+  }
+  return x;
+}
+
+// the low-rank side term of an unmerged LoRA adapter, y[n] += dot(xa, b_t[n])
+struct LoraTerm {
+  // scale * x @ a, [r]
+  std::vector<float> xa;
+  // [N, r], nullptr if the term is unused
+  const float *b_t = nullptr;
+};
+
+// Sets `term` to the LoraTerm of `weight` for the input `x` of a [K, N]
+// weight, reusing the buffer of `term.xa`
+void set_lora_term(LoraTerm &term, const LoraAdapter::Weight &weight,
+                   const float *x, int64_t k, int64_t n) {
+  auto &[a_t, b_t, scale] = weight;
+  auto rank = a_t.size(0);
+  RV_CHECK(a_t.size(1) == k && b_t.size(0) == n && b_t.size(1) == rank);
+  term.xa.resize(rank);
+  for (int64_t j = 0; j < rank; j++) {
+    term.xa[j] = scale * dot(x, a_t.data_ptr<float>() + j * k, k);
+  }
+  term.b_t = b_t.data_ptr<float>();
+}
+
+template <bool kVectorized>
+float lora_dot(const LoraTerm &term, int64_t n) {
+  int64_t rank = term.xa.size();
+  return dot<float, kVectorized>(term.xa.data(), term.b_t + n * rank, rank);
+}
+
+// y[n] = act(dot(x, w_t[n])) for n in [begin, end), w_t is [N, K]. The int8
+// `delta` and the low-rank terms (of a low-rank delta and of a LoRA adapter)
+// are optional.
+template <bool kVectorized, typename T>
+void gemv_rows(const float *x, const T *w_t, float *y, int64_t k,
+               int64_t begin, int64_t end, Activation act,
+               const WeightDelta::Int8 *delta, const LoraTerm *delta_term,
+               const LoraTerm *lora) {
+  for (int64_t n = begin; n < end; n++) {
+    float sum = dot<T, kVectorized>(x, w_t + n * k, k);
+    if (delta != nullptr) {
+      sum += delta->scale.data_ptr<float>()[n] *
+             dot<int8_t, kVectorized>(x, delta->q.data_ptr<int8_t>() + n * k,
+                                      k);
+    }
+    if (delta_term != nullptr) {
+      sum += lora_dot<kVectorized>(*delta_term, n);
+    }
+    if (lora != nullptr) {
+      sum += lora_dot<kVectorized>(*lora, n);
+    }
+    y[n] = activate(sum, act);
+  }
+}
+
+// transpose the columns [begin, end) of a [K, N] matrix into the rows
+// [begin, end) of a [N, K] matrix
+template <typename T>
+void transpose_rows(const T *src, T *dst, int64_t k, int64_t n, int64_t begin,
+                    int64_t end) {
+  const int64_t kTile = 32;
+  for (int64_t n0 = begin; n0 < end; n0 += kTile) {
+    int64_t n1 = std::min(end, n0 + kTile);
+    for (int64_t k0 = 0; k0 < k; k0 += kTile) {
+      int64_t k1 = std::min(k, k0 + kTile);
+      for (int64_t i = n0; i < n1; i++) {
+        for (int64_t j = k0; j < k1; j++) {
+          dst[i * k + j] = src[j * n + i];
+        }
+      }
+    }
+  }
+}
+
+} // namespace
+
+Tensor shard_weight(const Tensor &w) {
+  RV_CHECK(w.shape().size() == 2);
+  RV_CHECK(w.device() == Device::kCPU);
+  RV_CHECK(w.dtype() == DType::kFloat32 || w.dtype() == DType::kFloat16 ||
+           w.dtype() == DType::kInt8);
+  RV_CHECK(!w.is_sharded);
+  auto k = w.size(0);
+  auto n = w.size(1);
+  // large allocations are mmap-ed and not touched until the transpose below
+  auto ret = Tensor::Empty(w.shape(), w.dtype(), Device::kCPU);
+  auto &pool = ThreadPool::Instance();
+  pool.Run([&](int thread_id) {
+    auto [begin, end] = ShardRange(n, thread_id, pool.num_threads());
+    if (w.dtype() == DType::kFloat16) {
+      transpose_rows(w.data_ptr<float16>(), ret.data_ptr<float16>(), k, n,
+                     begin, end);
+    } else if (w.dtype() == DType::kInt8) {
+      transpose_rows(w.data_ptr<int8_t>(), ret.data_ptr<int8_t>(), k, n, begin,
+                     end);
+    } else {
+      transpose_rows(w.data_ptr<float>(), ret.data_ptr<float>(), k, n, begin,
+                     end);
+    }
+  });
+  ret.name = w.name;
+  ret.is_constant = w.is_constant;
+  ret.is_sharded = true;
+  return ret;
+}
+
+Tensor apply_delta(const Tensor &w, const WeightDelta &delta) {
+  RV_CHECK(w.is_sharded);
+  RV_CHECK(delta.int8.has_value() != delta.low_rank.has_value());
+  auto k = w.size(0);
+  auto n = w.size(1);
+  if (delta.int8) {
+    RV_CHECK(delta.int8->q.is_sharded && w.shape() == delta.int8->q.shape());
+  } else {
+    RV_CHECK(delta.low_rank->a_t.size(1) == k &&
+             delta.low_rank->b_t.size(0) == n);
+  }
+  auto ret = Tensor::Empty(w.shape(), w.dtype(), Device::kCPU);
+  auto &pool = ThreadPool::Instance();
+  pool.Run([&](int thread_id) {
+    auto [begin, end] = ShardRange(n, thread_id, pool.num_threads());
+    // the delta at (row, col) of the sharded [N, K] layout
+    auto delta_at = [&](int64_t row, int64_t col) {
+      if (delta.int8) {
+        return delta.int8->q.data_ptr<int8_t>()[row * k + col] *
+               delta.int8->scale.data_ptr<float>()[row];
+      }
+      auto &[a_t, b_t, scale] = *delta.low_rank;
+      auto rank = a_t.size(0);
+      float sum = 0;
+      for (int64_t l = 0; l < rank; l++) {
+        sum += a_t.data_ptr<float>()[l * k + col] *
+               b_t.data_ptr<float>()[row * rank + l];
+      }
+      return scale * sum;
+    };
+    for (int64_t i = begin * k; i < end * k; i++) {
+      float d = delta_at(i / k, i % k);
+      if (w.dtype() == DType::kFloat16) {
+        ret.data_ptr<float16>()[i] =
+            static_cast<float16>(w.data_ptr<float16>()[i] + d);
+      } else {
+        ret.data_ptr<float>()[i] = w.data_ptr<float>()[i] + d;
+      }
+    }
+  });
+  ret.name = w.name;
+  ret.is_constant = w.is_constant;
+  ret.is_sharded = true;
+  return ret;
+}
+
+namespace {
+GemvObserver gemv_observer;
+}
+
+void set_gemv_observer(GemvObserver observer) {
+  gemv_observer = std::move(observer);
+}
+
+namespace {
+// The state of a gemv call read by the pool threads, kept per calling thread
+// and reused so that a token allocates nothing once the buffers have grown.
+// The pool threads only read it while the caller waits in ThreadPool::Run.
+struct GemvScratch {
+  const GemvTask *tasks = nullptr;
+  size_t n_tasks = 0;
+  int num_threads = 1;
+  // of every task, the int8 delta of its weight or nullptr
+  std::vector<const WeightDelta::Int8 *> deltas;
+  // of every task, the low-rank terms of a delta and of a LoRA adapter. They
+  // only grow, so that the `xa` of the terms keep their buffers.
+  std::vector<LoraTerm> delta_terms;
+  std::vector<LoraTerm> lora_terms;
+};
+
+template <bool kVectorized>
+void gemv_impl(std::initializer_list<GemvTask> tasks) {
+  for (auto &task : tasks) {
+    RV_CHECK(task.w->is_sharded);
+    if (gemv_observer) {
+      gemv_observer(*task.w, task.x);
+    }
+  }
+  thread_local GemvScratch scratch;
+  scratch.tasks = tasks.begin();
+  scratch.n_tasks = tasks.size();
+  scratch.deltas.assign(tasks.size(), nullptr);
+  for (auto *terms : {&scratch.delta_terms, &scratch.lora_terms}) {
+    if (terms->size() < tasks.size()) {
+      terms->resize(tasks.size());
+    }
+    for (size_t i = 0; i < tasks.size(); i++) {
+      (*terms)[i].b_t = nullptr;
+    }
+  }
+  // the deltas are looked up on the calling thread, see ActiveDeltas. x @ a
+  // of the low-rank terms is tiny, compute it once here instead of in every
+  // thread.
+  if (auto *active_deltas = ActiveDeltas(); active_deltas != nullptr &&
+                                            !active_deltas->empty()) {
+    int i = 0;
+    for (auto &task : tasks) {
+      auto it = active_deltas->find(task.w->name);
+      if (it != active_deltas->end()) {
+        auto &delta = *it->second;
+        if (delta.int8) {
+          scratch.deltas[i] = &*delta.int8;
+        } else {
+          set_lora_term(scratch.delta_terms[i], *delta.low_rank, task.x,
+                        task.w->size(0), task.w->size(1));
+        }
+      }
+      i++;
+    }
+  }
+  if (auto *lora = ActiveLora()) {
+    int i = 0;
+    for (auto &task : tasks) {
+      auto it = lora->weights.find(task.w->name);
+      if (it != lora->weights.end()) {
+        set_lora_term(scratch.lora_terms[i], it->second, task.x,
+                      task.w->size(0), task.w->size(1));
+      }
+      i++;
+    }
+  }
+  auto &pool = ThreadPool::Instance();
+  scratch.num_threads = pool.num_threads();
+  // the pool threads have their own `scratch`, pass the one of this thread.
+  // A single pointer also fits in std::function without an allocation.
+  auto *s = &scratch;
+  pool.Run([s](int thread_id) {
+    // the term of task i in `terms`, if any
+    auto term_of = [](const std::vector<LoraTerm> &terms,
+                      size_t i) -> const LoraTerm * {
+      return terms[i].b_t != nullptr ? &terms[i] : nullptr;
+    };
+    for (size_t i = 0; i < s->n_tasks; i++) {
+      auto &task = s->tasks[i];
+      auto k = task.w->size(0);
+      auto n = task.w->size(1);
+      auto [begin, end] = ShardRange(n, thread_id, s->num_threads);
+      auto *lora = term_of(s->lora_terms, i);
+      auto *delta_term = term_of(s->delta_terms, i);
+      auto *delta = s->deltas[i];
+      if (task.w->dtype() == DType::kFloat16) {
+        gemv_rows<kVectorized>(task.x, task.w->data_ptr<float16>(), task.y,
+                               k, begin, end, task.act, delta, delta_term,
+                               lora);
+      } else {
+        gemv_rows<kVectorized>(task.x, task.w->data_ptr<float>(), task.y, k,
+                               begin, end, task.act, delta, delta_term, lora);
+      }
+    }
+  });
+}
+
+template <bool kVectorized>
+Tensor matmul_impl(const Tensor &a, const Tensor &b) {
+  RV_CHECK(a.dtype() == DType::kFloat32);
+  RV_CHECK(b.shape().size() == 2);
+  auto k = b.size(0);
+  auto n = b.size(1);
+  RV_CHECK(a.shape().back() == k);
+  auto m = a.numel() / k;
+  Shape c_shape = a.shape();
+  c_shape.back() = n;
+  auto c = Tensor::Empty(c_shape, DType::kFloat32, Device::kCPU);
+  auto *a_ptr = a.data_ptr<float>();
+  auto *c_ptr = c.data_ptr<float>();
+  if (b.is_sharded) {
+    for (int64_t i = 0; i < m; i++) {
+      gemv_impl<kVectorized>({{a_ptr + i * k, &b, c_ptr + i * n}});
+    }
+    return c;
+  }
+  // not a weight, e.g. in tests
+  auto b_fp32 = cast_dtype(b, DType::kFloat32);
+  auto *b_ptr = b_fp32.data_ptr<float>();
+  memset(c_ptr, 0, c.numel() * sizeof(float));
+  for (int64_t i = 0; i < m; i++) {
+    for (int64_t j = 0; j < k; j++) {
+      for (int64_t l = 0; l < n; l++) {
+        c_ptr[i * n + l] += a_ptr[i * k + j] * b_ptr[j * n + l];
+      }
+    }
+  }
+  return c;
+}
+
+} // namespace
+
+void gemv(std::initializer_list<GemvTask> tasks) { gemv_impl<true>(tasks); }
+
+Tensor matmul(const Tensor &a, const Tensor &b) {
+  return matmul_impl<true>(a, b);
+}
+
+#ifdef FR_CPU_SIMD_NAME
+KernelRegister matmul_reg("matmul", Device::kCPU, matmul, 1,
+                          FR_CPU_SIMD_NAME);
+// not used by the model, only compared with the SIMD variant in bench_ops
+Tensor matmul_scalar(const Tensor &a, const Tensor &b) {
+  return matmul_impl<false>(a, b);
+}
+KernelRegister matmul_scalar_reg("matmul", Device::kCPU, matmul_scalar, 0,
+                                 "scalar");
+#else
+KernelRegister matmul_reg("matmul", Device::kCPU, matmul, 1, "scalar");
+#endif
+
+} // namespace cpu
+} // namespace rwkv
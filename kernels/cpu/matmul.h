@@ -0,0 +1,57 @@
+#pragma once
+
+#include <functional>
+#include <initializer_list>
+
+#include "tensor.h"
+
+namespace rwkv {
+struct WeightDelta;
+
+namespace cpu {
+
+// Repack a [K, N] weight for `gemv`: the data is stored transposed ([N, K]
+// row-major) and the rows are split into one contiguous shard per thread of
+// the ThreadPool. Every shard is written (and thus first touched) by the
+// thread that will read it in `gemv`, so it lives in that thread's NUMA node
+// and stays warm in its part of the cache. The returned tensor keeps the
+// logical shape [K, N] and has `is_sharded` set.
+Tensor shard_weight(const Tensor &w);
+
+// `w + delta` as a new sharded weight, see delta.h
+Tensor apply_delta(const Tensor &w, const WeightDelta &delta);
+
+enum class Activation {
+  kNone,
+  kSigmoid,
+  // relu(x) ** 2
+  kReluSquare,
+  // x * sigmoid(x)
+  kSilu,
+};
+
+struct GemvTask {
+  // [K], fp32
+  const float *x;
+  // sharded [K, N], fp32 or fp16
+  const Tensor *w;
+  // [N], fp32
+  float *y;
+  Activation act = Activation::kNone;
+};
+
+// y = act(x @ w) for every task. Each thread computes its own shard of every
+// task, so the only synchronization is a single barrier at the end. The
+// `delta` of `w`, if any, is added on the fly. If an
+// unmerged LoRA adapter is active (see lora.h), its low-rank term for `w` is
+// added before the activation.
+void gemv(std::initializer_list<GemvTask> tasks);
+
+// Called by `gemv` with the weight and the input of every task while set,
+// e.g. to collect the activation ranges for an int8 export. Pass nullptr to
+// unset it.
+using GemvObserver = std::function<void(const Tensor &w, const float *x)>;
+void set_gemv_observer(GemvObserver observer);
+
+} // namespace cpu
+} // namespace rwkv
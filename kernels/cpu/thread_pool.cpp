@@ -0,0 +1,179 @@
+#include "thread_pool.h"
+
+#include <cstdlib>
+#include <string>
+
+#include <pthread.h>
+
+namespace rwkv {
+namespace cpu {
+
+namespace {
+// spin for a while before sleeping, the gap between two GEMVs of one token is
+// much shorter than a futex wake-up
+const int kSpinCount = 1 << 16;
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+} // namespace
+
+namespace {
+std::mutex instance_mutex;
+std::unique_ptr<ThreadPool> instance_holder;
+// the pools replaced by SetInstanceNumThreads, kept alive since kernels may
+// still hold them
+std::vector<std::unique_ptr<ThreadPool>> retired_pools;
+// read without the lock in the hot path
+std::atomic<ThreadPool *> instance{nullptr};
+
+// The worker threads of the pools don't exist in a forked child (e.g. a
+// pipeline stage), so the child drops them (without joining the threads) and
+// creates its own instance on first use.
+void LockInstanceBeforeFork() { instance_mutex.lock(); }
+void UnlockInstanceAfterFork() { instance_mutex.unlock(); }
+void ResetInstanceInChild() {
+  instance_holder.release();
+  for (auto &pool : retired_pools) {
+    pool.release();
+  }
+  retired_pools.clear();
+  instance.store(nullptr, std::memory_order_relaxed);
+  instance_mutex.unlock();
+}
+const bool kAtForkRegistered = [] {
+  pthread_atfork(LockInstanceBeforeFork, UnlockInstanceAfterFork,
+                 ResetInstanceInChild);
+  return true;
+}();
+} // namespace
+
+int ThreadPool::DefaultNumThreads() {
+  if (const char *env = std::getenv("FR_NUM_THREADS")) {
+    return std::max(1, std::stoi(env));
+  }
+  return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+ThreadPool &ThreadPool::Instance() {
+  if (auto *pool = instance.load(std::memory_order_acquire)) {
+    return *pool;
+  }
+  std::lock_guard<std::mutex> lock(instance_mutex);
+  if (!instance_holder) {
+    instance_holder = std::make_unique<ThreadPool>(DefaultNumThreads());
+    instance.store(instance_holder.get(), std::memory_order_release);
+  }
+  return *instance_holder;
+}
+
+void ThreadPool::SetInstanceNumThreads(int num_threads) {
+  std::lock_guard<std::mutex> lock(instance_mutex);
+  if (instance_holder && instance_holder->num_threads() == num_threads) {
+    return;
+  }
+  // reuse a retired pool of that size, so that switching back and forth
+  // (e.g. in benchmarks) doesn't accumulate threads
+  auto it = std::find_if(retired_pools.begin(), retired_pools.end(),
+                         [num_threads](const auto &pool) {
+                           return pool->num_threads() == num_threads;
+                         });
+  std::unique_ptr<ThreadPool> pool;
+  if (it != retired_pools.end()) {
+    pool = std::move(*it);
+    retired_pools.erase(it);
+  } else {
+    pool = std::make_unique<ThreadPool>(num_threads);
+  }
+  if (instance_holder) {
+    retired_pools.push_back(std::move(instance_holder));
+  }
+  instance_holder = std::move(pool);
+  instance.store(instance_holder.get(), std::memory_order_release);
+}
+
+ThreadPool::ThreadPool(int num_threads) : _num_threads(num_threads) {
+  RV_CHECK(num_threads > 0);
+  for (int i = 1; i < num_threads; i++) {
+    _threads.emplace_back(&ThreadPool::WorkerMain, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+    _generation++;
+  }
+  _cv.notify_all();
+  for (auto &thread : _threads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Run(const std::function<void(int)> &fn) {
+  if (_num_threads == 1) {
+    fn(0);
+    return;
+  }
+  std::lock_guard<std::mutex> run_lock(_run_mutex);
+  _fn = &fn;
+  _error = nullptr;
+  _pending.store(_num_threads - 1, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _generation.fetch_add(1, std::memory_order_release);
+  }
+  _cv.notify_all();
+  std::exception_ptr error;
+  try {
+    fn(0);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  // the workers run `fn` until they are done, even if `fn(0)` has thrown
+  while (_pending.load(std::memory_order_acquire) != 0) {
+    cpu_relax();
+  }
+  if (!error) {
+    error = _error;
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void ThreadPool::WorkerMain(int thread_id) {
+  uint64_t seen = 0;
+  while (true) {
+    for (int spins = 0; _generation.load(std::memory_order_acquire) == seen;) {
+      if (++spins < kSpinCount) {
+        cpu_relax();
+      } else {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]() { return _generation.load() != seen; });
+      }
+    }
+    seen = _generation.load(std::memory_order_acquire);
+    if (_stop) {
+      return;
+    }
+    try {
+      (*_fn)(thread_id);
+    } catch (...) {
+      // rethrown by Run on the calling thread
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (!_error) {
+        _error = std::current_exception();
+      }
+    }
+    _pending.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+} // namespace cpu
+} // namespace rwkv
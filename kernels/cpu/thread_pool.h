@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <check.h>
+
+namespace rwkv {
+namespace cpu {
+
+// A fixed set of threads which run the same function together. Thread i
+// always gets the same `thread_id` so that it can keep working on data it has
+// touched before (see `shard_weight` in matmul.h).
+class ThreadPool {
+public:
+  // The number of threads is DefaultNumThreads(). A forked child gets a new
+  // instance on first use.
+  static ThreadPool &Instance();
+  // The FR_NUM_THREADS environment variable, or the number of hardware
+  // threads
+  static int DefaultNumThreads();
+  // Replaces the instance with one of `num_threads` threads, e.g. for
+  // benchmarks over thread counts. The replaced pool is not destroyed (its
+  // idle threads sleep), so a kernel running concurrently finishes on it.
+  // Weights sharded before are still correct, but were first touched by the
+  // threads of the old pool: set it before loading models.
+  static void SetInstanceNumThreads(int num_threads);
+
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+  FR_DISALLOW_COPY_AND_MOVE(ThreadPool);
+
+  int num_threads() const { return _num_threads; }
+
+  // Runs `fn(thread_id)` for every thread id in [0, num_threads) and returns
+  // when all of them are done. The calling thread runs `fn(0)`. Concurrent
+  // calls (e.g. models run on different threads) are serialized. If any
+  // `fn` throws, Run rethrows one of the exceptions after all of them are
+  // done.
+  void Run(const std::function<void(int)> &fn);
+
+private:
+  void WorkerMain(int thread_id);
+
+  int _num_threads;
+  std::vector<std::thread> _threads;
+  const std::function<void(int)> *_fn = nullptr;
+  std::atomic<uint64_t> _generation{0};
+  std::atomic<int> _pending{0};
+  // the first exception thrown by a worker in the current Run
+  std::exception_ptr _error;
+  bool _stop = false;
+  std::mutex _run_mutex;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+};
+
+// The rows [begin, end) of `n` rows processed by `thread_id`. Ranges are
+// multiples of `align` rows except the last non-empty one.
+inline std::pair<int64_t, int64_t> ShardRange(int64_t n, int thread_id,
+                                              int num_threads,
+                                              int64_t align = 16) {
+  int64_t per_thread = (n + num_threads - 1) / num_threads;
+  per_thread = (per_thread + align - 1) / align * align;
+  int64_t begin = std::min(n, per_thread * thread_id);
+  int64_t end = std::min(n, begin + per_thread);
+  return {begin, end};
+}
+
+} // namespace cpu
+} // namespace rwkv
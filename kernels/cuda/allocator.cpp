@@ -32,7 +32,7 @@ public:
     cudaMallocAsync(&ptr, size, stream());
     return ptr;
   }
-  void Deallocate(void *ptr) { cudaFreeAsync(ptr, stream()); }
+  void DoDeallocate(void *ptr) { cudaFreeAsync(ptr, stream()); }
   cudaStream_t stream() {
     if (stream_ == nullptr) {
       cudaStreamCreate(&stream_);
@@ -51,7 +51,8 @@ class CachingAllocator final : public Allocator {
   ~CachingAllocator();
 
   void* DoAllocate(std::size_t size) override;
-  void Deallocate(void* mem_ptr) override;
+  void DoDeallocate(void* mem_ptr) override;
+  int64_t ReservedBytes() const override;
 
  private:
   static constexpr int32_t kInvalidBinNum = -1;
@@ -136,7 +137,7 @@ class CachingAllocator final : public Allocator {
   bool DeallocateFreeBlockForGarbageCollection();
 
   const size_t alignment_;
-  ThreadLock thread_lock_;
+  mutable ThreadLock thread_lock_;
   size_t total_memory_bytes_;
   std::unordered_map<void*, Block> mem_ptr2block_;
 
@@ -399,7 +400,7 @@ void* CachingAllocator<ThreadLock>::DoAllocate(std::size_t size) {
 }
 
 template<typename ThreadLock>
-void CachingAllocator<ThreadLock>::Deallocate(void* mem_ptr) {
+void CachingAllocator<ThreadLock>::DoDeallocate(void* mem_ptr) {
   if (mem_ptr == nullptr) { return; }
   typename ThreadLock::RAIIGuard guard(thread_lock_);
 
@@ -426,6 +427,12 @@ void CachingAllocator<ThreadLock>::Deallocate(void* mem_ptr) {
   InsertPiece2Bin(last_piece_insert_to_bin);
 }
 
+template<typename ThreadLock>
+int64_t CachingAllocator<ThreadLock>::ReservedBytes() const {
+  typename ThreadLock::RAIIGuard guard(thread_lock_);
+  return total_memory_bytes_;
+}
+
 class ThreadSafeLock final {
  public:
   class RAIIGuard final {
@@ -441,8 +448,9 @@ class ThreadSafeLock final {
 };
 
 rwkv::Allocator& allocator() {
-  static CachingAllocator<ThreadSafeLock> allocator;
-  return allocator;
+  // never destroyed, see cpu::allocator
+  static auto *allocator = new CachingAllocator<ThreadSafeLock>;
+  return *allocator;
 }
 
 KernelRegister allocator_reg("allocator", Device::kCUDA, allocator);
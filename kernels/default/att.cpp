@@ -13,9 +13,11 @@ att(const Tensor &x, const Tensor &sx, const Tensor &aa, const Tensor &bb,
     const Tensor &vw, const Tensor &rw, const Tensor &ow) {
   auto xx = layernorm(x, ln_w, ln_b);
   // auto [kx, vx, rx] = time_mix()
-  auto kx = xx * k_mix + sx * (1 - k_mix);
-  auto vx = xx * v_mix + sx * (1 - v_mix);
-  auto rx = xx * r_mix + sx * (1 - r_mix);
+  // xx * mix + sx * (1 - mix), written so that all mixes share `xx - sx`
+  auto dx = xx - sx;
+  auto kx = sx + dx * k_mix;
+  auto vx = sx + dx * v_mix;
+  auto rx = sx + dx * r_mix;
 
   auto r = sigmoid(matmul(rx, rw));
   auto k = matmul(kx, kw);
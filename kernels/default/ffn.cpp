@@ -12,8 +12,10 @@ std::tuple<Tensor, Tensor> ffn(const Tensor &x, const Tensor &sx,
                                const Tensor &rw) {
   auto xx = layernorm(x, ln_w, ln_b);
   // auto [kx, rx] = channel_mix(xx, sx, k_mix, r_mix);
-  auto kx = xx * k_mix + sx * (1 - k_mix);
-  auto rx = xx * r_mix + sx * (1 - r_mix);
+  // xx * mix + sx * (1 - mix), written so that all mixes share `xx - sx`
+  auto dx = xx - sx;
+  auto kx = sx + dx * k_mix;
+  auto rx = sx + dx * r_mix;
 
   auto r = sigmoid(matmul(rx, rw));
   auto vx = relu(matmul(kx, kw));
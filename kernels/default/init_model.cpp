@@ -1,9 +1,13 @@
 #include <fstream>
+#include <sstream>
 
 #include <msgpack.hpp>
 
+#include <kernels/cpu/matmul.h>
 #include <kernels/kernels.h>
 #include <kernels/registry.h>
+#include <lora.h>
+#include <mp_tensor.h>
 #include <tensor.h>
 #define private public
 #include <model.h>
@@ -12,6 +16,29 @@
 namespace rwkv {
 namespace def {
 
+namespace {
+bool ends_with(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// the weights read by the cpu gemv, other 2-D weights (e.g. the per-head
+// time_decay of some RWKV-5 models) are not sharded
+bool is_matmul_weight(const std::string &name) {
+  if (name == "head.weight") {
+    return true;
+  }
+  for (const char *suffix : {".key.weight", ".value.weight",
+                             ".receptance.weight", ".output.weight",
+                             ".gate.weight"}) {
+    if (ends_with(name, suffix)) {
+      return true;
+    }
+  }
+  return false;
+}
+} // namespace
+
 inline void init_model(Model *model, Device device, const std::string &path,
                        const std::string &strategy) {
   std::ifstream infile;
@@ -29,23 +56,24 @@ inline void init_model(Model *model, Device device, const std::string &path,
   auto weights = map["weights"].as<std::map<std::string, msgpack::object>>();
   auto embd_weights = map["embd_weights"].as<std::vector<msgpack::object>>();
 
-  auto from_mp_dtype = [](const std::string &mp_dtype) -> DType {
-    if (mp_dtype == "torch.int8") {
-      return DType::kInt8;
-    } else if (mp_dtype == "torch.float16") {
-      return DType::kFloat16;
-    } else if (mp_dtype == "torch.float32") {
-      return DType::kFloat32;
-    } else {
-      throw std::runtime_error("unknown dtype " + mp_dtype);
-    }
-  };
-
   Device weight_device = device == Device::kCUDA ? Device::kCUDA : Device::kCPU;
 
-  auto from_mp_tensor = [from_mp_dtype,
-                         weight_device](msgpack::object mp_tensor,
-                                        const std::string &name) -> Tensor {
+  // "lora=a.lora[,b.lora...]": adapters merged into the weights
+  std::vector<LoraAdapter> merged_loras;
+  if (model->_options.count("lora")) {
+    std::istringstream paths(model->_options["lora"]);
+    std::string lora_path;
+    while (std::getline(paths, lora_path, ',')) {
+      merged_loras.emplace_back(lora_path);
+      for (auto &[name, _] : merged_loras.back().weights) {
+        RV_CHECK(weights.count(name));
+      }
+    }
+  }
+
+  auto load_tensor = [device, weight_device,
+                      &merged_loras](msgpack::object mp_tensor,
+                                     const std::string &name) -> Tensor {
     auto mp_tensor_map =
         mp_tensor.as<std::unordered_map<std::string, msgpack::object>>();
     // NOTE: `mp_tensor_data` will be destroyed after this function returns
@@ -55,18 +83,73 @@ inline void init_model(Model *model, Device device, const std::string &path,
     auto fr_cpu_tensor =
         Tensor::FromPtr(mp_tensor_data.data(), Shape(mp_tensor_shape),
                         from_mp_dtype(mp_tensor_dtype), Device::kCPU);
-    auto ret = Copy(fr_cpu_tensor, weight_device, true);
+    // the cpu gemv reads fp16 and fp32 weights only (int8 is only used by
+    // the deltas of load_delta.cpp)
+    if (device == Device::kCPU && is_matmul_weight(name) &&
+        fr_cpu_tensor.dtype() == DType::kInt8) {
+      throw std::runtime_error("the cpu device does not support int8 weights"
+                               " (" + name + "), convert the model to fp16");
+    }
+    for (auto &lora : merged_loras) {
+      fr_cpu_tensor = lora.Merge(fr_cpu_tensor, name);
+    }
+    // matmul weights on cpu are repacked for the multi-threaded gemv
+    auto ret = device == Device::kCPU && is_matmul_weight(name)
+                   ? cpu::shard_weight(fr_cpu_tensor)
+                   : Copy(fr_cpu_tensor, weight_device, true);
     ret.name = name;
     ret.is_constant = true;
     return ret;
   };
 
-  auto push_param = [model, &from_mp_tensor, &weights](const std::string &key) {
-    model->_params.push_back(from_mp_tensor(weights[key], key));
+  auto push_param = [model, device, &load_tensor,
+                     &weights](const std::string &key) {
+    auto param = load_tensor(weights[key], key);
+    // the cpu kernels compute in fp32 and only read fp16 in gemv
+    if (device == Device::kCPU && !param.is_sharded &&
+        param.dtype() != DType::kFloat32) {
+      param = cast_dtype(param, DType::kFloat32);
+      param.name = key;
+      param.is_constant = true;
+    }
+    model->_params.push_back(param);
   };
-  model->_n_layer = map["n_layer"].as<int>();
+  int n_layer = map["n_layer"].as<int>();
   model->_n_embd = map["n_embd"].as<int>();
-  for (int i = 0; i < model->_n_layer; i++) {
+  if (weights.count("blocks.0.att.ln_x.weight")) {
+    // RWKV-5.2, only the cpu kernels support it
+    RV_CHECK(device == Device::kCPU);
+    model->_version = 5;
+    if (map.count("n_head")) {
+      model->_n_head = map["n_head"].as<int>();
+    } else {
+      // time_decay is [n_head, 1, 1] or [n_head, head_size, 1] in the
+      // models converted by ChatRWKV
+      auto time_decay = weights["blocks.0.att.time_decay"]
+                            .as<std::unordered_map<std::string, msgpack::object>>();
+      model->_n_head = time_decay["shape"].as<std::vector<int64_t>>()[0];
+    }
+    RV_CHECK(model->_n_head > 0 && model->_n_embd % model->_n_head == 0);
+  }
+  // "stage=i/n": load the i-th of n contiguous ranges of blocks, used by
+  // pipeline-parallel workers (see pipeline.h)
+  int layer_begin = 0;
+  int layer_end = n_layer;
+  if (model->_options.count("stage")) {
+    auto &stage_str = model->_options["stage"];
+    auto slash_pos = stage_str.find("/");
+    RV_CHECK(slash_pos != std::string::npos);
+    int stage_id = std::stoi(stage_str.substr(0, slash_pos));
+    int n_stages = std::stoi(stage_str.substr(slash_pos + 1));
+    RV_CHECK(n_stages > 0 && n_stages <= n_layer && stage_id >= 0 &&
+             stage_id < n_stages);
+    layer_begin = n_layer * stage_id / n_stages;
+    layer_end = n_layer * (stage_id + 1) / n_stages;
+  }
+  model->_layer_begin = layer_begin;
+  model->_n_layer = layer_end - layer_begin;
+  model->_has_head = layer_end == n_layer;
+  for (int i = layer_begin; i < layer_end; i++) {
     std::string bbb_pf = "blocks." + std::to_string(i) + ".";
     std::string att_pf = "blocks." + std::to_string(i) + ".att.";
     std::string ffn_pf = "blocks." + std::to_string(i) + ".ffn.";
@@ -81,17 +164,37 @@ inline void init_model(Model *model, Device device, const std::string &path,
     //         _params[att_pf + "time_mix_r"], _params[att_pf + "time_decay"],
     //         _params[att_pf + "time_first"], kw, vw, rw, ow);
     //
-    push_param(bbb_pf + "ln1.weight");
-    push_param(bbb_pf + "ln1.bias");
-    push_param(att_pf + "time_mix_k");
-    push_param(att_pf + "time_mix_v");
-    push_param(att_pf + "time_mix_r");
-    push_param(att_pf + "time_decay");
-    push_param(att_pf + "time_first");
-    push_param(att_pf + "key.weight");
-    push_param(att_pf + "value.weight");
-    push_param(att_pf + "receptance.weight");
-    push_param(att_pf + "output.weight");
+    if (model->_version == 5) {
+      // see def::ModelForwardHidden
+      push_param(bbb_pf + "ln1.weight");
+      push_param(bbb_pf + "ln1.bias");
+      push_param(att_pf + "time_mix_k");
+      push_param(att_pf + "time_mix_v");
+      push_param(att_pf + "time_mix_r");
+      push_param(att_pf + "time_mix_g");
+      push_param(att_pf + "time_decay");
+      push_param(weights.count(att_pf + "time_first") ? att_pf + "time_first"
+                                                      : att_pf + "time_faaaa");
+      push_param(att_pf + "key.weight");
+      push_param(att_pf + "value.weight");
+      push_param(att_pf + "receptance.weight");
+      push_param(att_pf + "gate.weight");
+      push_param(att_pf + "output.weight");
+      push_param(att_pf + "ln_x.weight");
+      push_param(att_pf + "ln_x.bias");
+    } else {
+      push_param(bbb_pf + "ln1.weight");
+      push_param(bbb_pf + "ln1.bias");
+      push_param(att_pf + "time_mix_k");
+      push_param(att_pf + "time_mix_v");
+      push_param(att_pf + "time_mix_r");
+      push_param(att_pf + "time_decay");
+      push_param(att_pf + "time_first");
+      push_param(att_pf + "key.weight");
+      push_param(att_pf + "value.weight");
+      push_param(att_pf + "receptance.weight");
+      push_param(att_pf + "output.weight");
+    }
     // std::tie(x, state[offset]) =
     //     ffn(x, state[offset], _params[bbb_pf + "ln2.weight"],
     //         _params[bbb_pf + "ln2.bias"], _params[ffn_pf + "time_mix_k"],
@@ -104,17 +207,18 @@ inline void init_model(Model *model, Device device, const std::string &path,
     push_param(ffn_pf + "value.weight");
     push_param(ffn_pf + "receptance.weight");
   }
-  push_param("ln_out.weight");
-  push_param("ln_out.bias");
-  push_param("head.weight");
+  if (model->_has_head) {
+    push_param("ln_out.weight");
+    push_param("ln_out.bias");
+    push_param("head.weight");
+  }
 
-  for (int i = 0; i < embd_weights.size(); i++) {
-    auto mp_tensor = embd_weights[i];
-    model->_embd_weights.push_back(
-        from_mp_tensor(mp_tensor, std::string("embd_") + std::to_string(i)));
-    if (model->_act_device == Device::kNCNNMeta) {
-        // add embd_weights to ncnn bin
-      Copy(model->_embd_weights.back(), Device::kNCNNMeta);
+  // only the first pipeline stage looks up embeddings
+  if (layer_begin == 0) {
+    for (size_t i = 0; i < embd_weights.size(); i++) {
+      auto mp_tensor = embd_weights[i];
+      model->_embd_weights.push_back(
+          load_tensor(mp_tensor, std::string("embd_") + std::to_string(i)));
     }
   }
 }
@@ -122,6 +226,7 @@ inline void init_model(Model *model, Device device, const std::string &path,
 KernelRegister init_model_reg_1("init_model", Device::kCPU, init_model);
 KernelRegister init_model_reg_2("init_model", Device::kCUDA, init_model);
 KernelRegister init_model_reg_3("init_model", Device::kNCNNMeta, init_model);
+KernelRegister init_model_reg_4("init_model", Device::kONNXMeta, init_model);
 
 } // namespace def
 } // namespace rwkv
@@ -0,0 +1,149 @@
+#include <fstream>
+#include <iterator>
+#include <map>
+
+#include <msgpack.hpp>
+
+#include <delta.h>
+#include <kernels/cpu/matmul.h>
+#include <kernels/kernels.h>
+#include <kernels/registry.h>
+#include <mp_tensor.h>
+#include <tensor.h>
+#define private public
+#include <model.h>
+#undef private
+
+namespace rwkv {
+namespace def {
+
+namespace {
+// The delta of a [K, N] weight in the {delta, scale} (int8) or {a, b} (low
+// rank) map written by make_delta.py. The int8 delta is not sharded yet.
+WeightDelta from_mp_delta(
+    std::unordered_map<std::string, msgpack::object> &mp_delta,
+    const Shape &shape) {
+  if (mp_delta.count("delta")) {
+    auto q = from_mp_tensor(mp_delta["delta"]);
+    auto scale = from_mp_tensor(mp_delta["scale"]);
+    RV_CHECK(q.dtype() == DType::kInt8 && scale.dtype() == DType::kFloat32);
+    RV_CHECK(q.shape() == shape);
+    return {WeightDelta::Int8{q, scale}, std::nullopt};
+  }
+  // a is [K, r] and b is [r, N], kept transposed like a LoRA adapter
+  auto a_t = transposed(
+      cast_dtype(from_mp_tensor(mp_delta["a"]), DType::kFloat32));
+  auto b_t = transposed(
+      cast_dtype(from_mp_tensor(mp_delta["b"]), DType::kFloat32));
+  RV_CHECK(a_t.size(1) == shape[0] && b_t.size(0) == shape[1] &&
+           a_t.size(0) == b_t.size(1));
+  return {std::nullopt, LoraAdapter::Weight{a_t, b_t, 1.f}};
+}
+
+// `w + delta` for a [K, N] fp32 weight which is not sharded
+void add_delta(Tensor &w, const WeightDelta &delta) {
+  auto k = w.size(0);
+  auto n = w.size(1);
+  auto *w_ptr = w.data_ptr<float>();
+  if (delta.int8) {
+    auto *q_ptr = delta.int8->q.data_ptr<int8_t>();
+    auto *scale_ptr = delta.int8->scale.data_ptr<float>();
+    for (int64_t i = 0; i < w.numel(); i++) {
+      w_ptr[i] += q_ptr[i] * scale_ptr[i % n];
+    }
+    return;
+  }
+  auto &[a_t, b_t, scale] = *delta.low_rank;
+  auto rank = a_t.size(0);
+  auto *a_ptr = a_t.data_ptr<float>();
+  auto *b_ptr = b_t.data_ptr<float>();
+  for (int64_t i = 0; i < k; i++) {
+    for (int64_t j = 0; j < n; j++) {
+      float sum = 0;
+      for (int64_t l = 0; l < rank; l++) {
+        sum += a_ptr[l * k + i] * b_ptr[j * rank + l];
+      }
+      w_ptr[i * n + j] += scale * sum;
+    }
+  }
+}
+
+// `x` converted to the dtype and device of `like`
+Tensor like(const Tensor &x, const Tensor &like) {
+  auto ret = Copy(cast_dtype(x, like.dtype()), like.device(), true);
+  ret.name = like.name;
+  ret.is_constant = like.is_constant;
+  return ret;
+}
+} // namespace
+
+void load_delta(Model *model, Device device, const std::string &path,
+                bool materialize) {
+  std::ifstream infile(path, std::ios::binary);
+  RV_CHECK(infile.good());
+  std::vector<char> data((std::istreambuf_iterator<char>(infile)),
+                         std::istreambuf_iterator<char>());
+
+  auto unpacker = msgpack::unpack(data.data(), data.size());
+  auto map = unpacker.get()
+                 .as<std::unordered_map<std::string, msgpack::object>>();
+  RV_CHECK(map["n_embd"].as<int>() == model->_n_embd);
+  auto weights = map["weights"].as<std::map<std::string, msgpack::object>>();
+  auto embd_weights =
+      map["embd_weights"].as<std::map<int, msgpack::object>>();
+
+  // only the changed weights are replaced, the others keep sharing the
+  // storage of the base model
+  for (auto &param : model->_params) {
+    auto it = weights.find(param.name);
+    if (it == weights.end()) {
+      continue;
+    }
+    // make_delta.py stores the delta of a matrix as a {delta, scale} (int8)
+    // or {a, b} (low rank) map, and any other weight as a whole tensor
+    auto mp_delta =
+        it->second.as<std::unordered_map<std::string, msgpack::object>>();
+    if (mp_delta.count("delta") == 0 && mp_delta.count("a") == 0) {
+      param = like(from_mp_tensor(it->second), param);
+      model->_deltas.erase(param.name);
+      continue;
+    }
+    auto delta = from_mp_delta(mp_delta, param.shape());
+    if (device == Device::kCPU && param.is_sharded) {
+      // a delta against a variant which is itself not materialized
+      if (auto prev = model->_deltas.find(param.name);
+          prev != model->_deltas.end()) {
+        param = cpu::apply_delta(param, *prev->second);
+        model->_deltas.erase(prev);
+      }
+      if (delta.int8) {
+        delta.int8->q = cpu::shard_weight(delta.int8->q);
+      }
+      if (materialize) {
+        param = cpu::apply_delta(param, delta);
+      } else {
+        model->_deltas[param.name] =
+            std::make_shared<WeightDelta>(std::move(delta));
+      }
+    } else {
+      auto w =
+          cast_dtype(Copy(param, Device::kCPU, true), DType::kFloat32);
+      add_delta(w, delta);
+      param = like(w, param);
+    }
+  }
+
+  // later pipeline stages have no embeddings
+  if (!model->_embd_weights.empty()) {
+    for (auto &[i, mp_tensor] : embd_weights) {
+      auto &embd = model->_embd_weights.at(i);
+      embd = like(from_mp_tensor(mp_tensor), embd);
+    }
+  }
+}
+
+KernelRegister load_delta_reg_1("load_delta", Device::kCPU, load_delta);
+KernelRegister load_delta_reg_2("load_delta", Device::kCUDA, load_delta);
+
+} // namespace def
+} // namespace rwkv
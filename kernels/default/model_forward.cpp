@@ -3,7 +3,6 @@
 #include <msgpack.hpp>
 
 #include <kernels/kernels.h>
-#include <kernels/ncnn-meta/kernels.h>
 #include <kernels/registry.h>
 #include <tensor.h>
 #define private public
@@ -14,28 +13,44 @@ namespace rwkv {
 
 namespace def {
 
+Tensor ModelForwardHidden(const Model *model, Device device, const Tensor &input,
+                          std::vector<std::vector<Tensor>> &states);
+
 Tensor ModelForward(const Model *model, Device device, int id,
                     std::vector<std::vector<Tensor>> &states) {
   Tensor x = model->_embd_weights[id];
-  auto &params = model->_params;
-  if (model->_act_device == Device::kNCNNMeta) {
-    x = ncnnmeta::add_input(x.shape(), "input");
-    for (int i = 0; i < states.size(); i++) {
-      for (int j = 0; j < states[i].size(); j++) {
-        auto state_name =
-            "state_" + std::to_string(i) + "_" + std::to_string(j);
-        auto &state_tensor = states[i][j];
-        state_tensor = ncnnmeta::add_input(state_tensor.shape(), state_name);
-      }
-    }
+  if (x.dtype() != model->_act_dtype) {
+    // embeddings are kept in the file dtype
+    x = cast_dtype(x, model->_act_dtype);
   }
+  return def::ModelForwardHidden(model, device, x, states);
+}
 
+// Runs the blocks in `model` on the hidden state `input`, followed by the head
+// unless `model` is a non-last pipeline stage.
+Tensor ModelForwardHidden(const Model *model, Device device, const Tensor &input,
+                          std::vector<std::vector<Tensor>> &states) {
+  Tensor x = input;
+  auto &params = model->_params;
   int param_idx = 0;
+  // the states and logits of the exported graphs are named outputs
+  bool traced = device == Device::kNCNNMeta || device == Device::kONNXMeta;
 
-  for (int i = 0; i < states.size(); ++i) {
+  for (int i = 0; i < static_cast<int>(states.size()); ++i) {
     auto &state = states[i];
+    profiler::LayerScope layer_scope(model->_layer_begin + i, device);
+    perf::LayerScope perf_layer_scope(model->_layer_begin + i);
 
-    {
+    if (model->_version == 5) {
+      std::tie(x, state[0], state[1]) = att_v5(
+          x, state[0], state[1], params[param_idx], params[param_idx + 1],
+          params[param_idx + 2], params[param_idx + 3], params[param_idx + 4],
+          params[param_idx + 5], params[param_idx + 6], params[param_idx + 7],
+          params[param_idx + 8], params[param_idx + 9], params[param_idx + 10],
+          params[param_idx + 11], params[param_idx + 12],
+          params[param_idx + 13], params[param_idx + 14]);
+      param_idx += 15;
+    } else {
       // x, state[i*5+0], state[i*5+1], state[i*5+2], state[i*5+3] = ATT(
       //   x, state[i*5+0], state[i*5+1], state[i*5+2], state[i*5+3],
       //   w[f'{bbb}ln1.weight'], w[f'{bbb}ln1.bias'],
@@ -53,7 +68,7 @@ Tensor ModelForward(const Model *model, Device device, int id,
           params[param_idx + 4], params[param_idx + 5], params[param_idx + 6],
           params[param_idx + 7], params[param_idx + 8], params[param_idx + 9],
           params[param_idx + 10]);
-      if (device == Device::kNCNNMeta) {
+      if (traced) {
         mark_as_output(state[0], "output_state_" + std::to_string(i) + "_0");
         mark_as_output(state[1], "output_state_" + std::to_string(i) + "_1");
         mark_as_output(state[2], "output_state_" + std::to_string(i) + "_2");
@@ -62,7 +77,7 @@ Tensor ModelForward(const Model *model, Device device, int id,
       param_idx += 11;
     }
     {
-      int offset = 4;
+      int offset = model->_version == 5 ? 2 : 4;
 
       // x, state[offset] =
       //     FFN(x, state[offset], w[f '{bbb}ln2.weight'], w[f '{bbb}ln2.bias'],
@@ -72,23 +87,36 @@ Tensor ModelForward(const Model *model, Device device, int id,
           x, state[offset], params[param_idx], params[param_idx + 1],
           params[param_idx + 2], params[param_idx + 3], params[param_idx + 4],
           params[param_idx + 5], params[param_idx + 6]);
-      if (device == Device::kNCNNMeta) {
+      if (traced) {
         mark_as_output(state[offset], "output_state_" + std::to_string(i) +
                                           "_" + std::to_string(offset));
       }
       param_idx += 7;
     }
 
-    if (x.dtype() == DType::kFloat16 && (i + 1) % 6 == 0) {
+    if (x.dtype() == DType::kFloat16 &&
+        (model->_layer_begin + i + 1) % 6 == 0) {
       scalar_div_(x, 2);
     }
   }
+  if (!model->_has_head) {
+    return x;
+  }
+  if (device == Device::kNCNNMeta) {
+    // the activations are [T, C], only the logits of the last token are
+    // returned. kernels/ncnn-meta is only built with FR_ENABLE_NCNN.
+    x = KernelRegistry::Instance().Get<Tensor (*)(const Tensor &)>(
+        "last_row", device)(x);
+  }
   //             x = F.layer_norm(x, (args.n_embd,),
   //             weight=w['ln_out.weight'], bias=w['ln_out.bias'])
   x = layernorm(x, params[param_idx], params[param_idx + 1]);
 
   //                 x = x @ w['head.weight']
   x = matmul(x, params[param_idx + 2]);
+  if (traced) {
+    mark_as_output(x, "output");
+  }
   if (x.dtype() == DType::kFloat16) {
     x = cast_dtype(x, DType::kFloat32);
   }
@@ -98,8 +126,16 @@ Tensor ModelForward(const Model *model, Device device, int id,
 KernelRegister model_forward_reg_1("model_forward", Device::kCPU, ModelForward);
 KernelRegister model_forward_reg_2("model_forward", Device::kCUDA,
                                    ModelForward);
-KernelRegister model_forward_reg_3("model_forward", Device::kNCNNMeta,
-                                   ModelForward);
+KernelRegister model_forward_hidden_reg_1("model_forward_hidden", Device::kCPU,
+                                          ModelForwardHidden);
+KernelRegister model_forward_hidden_reg_2("model_forward_hidden",
+                                          Device::kCUDA, ModelForwardHidden);
+KernelRegister model_forward_hidden_reg_3("model_forward_hidden",
+                                          Device::kONNXMeta,
+                                          ModelForwardHidden);
+KernelRegister model_forward_hidden_reg_4("model_forward_hidden",
+                                          Device::kNCNNMeta,
+                                          ModelForwardHidden);
 
 } // namespace def
 } // namespace rwkv
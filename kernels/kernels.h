@@ -3,76 +3,104 @@
 #include <tensor.h>
 #include <kernels/registry.h>
 #include <kernels/allocator.h>
+#include <perf_counters.h>
+#include <profiler.h>
 
 namespace rwkv {
 //     def att_one(self, x, sx, aa, bb, pp, ln_w, ln_b, k_mix, v_mix, r_mix, t_decay, t_first, kw, vw, rw, ow, kmx, krx, kmy, kry, vmx, vrx, vmy, vry, rmx, rrx, rmy, rry, omx, orx, omy, ory):
 
 inline std::tuple<Tensor, Tensor, Tensor, Tensor, Tensor> att(const Tensor& x, const Tensor& sx, const Tensor& aa, const Tensor& bb, const Tensor& pp, const Tensor& ln_w, const Tensor& ln_b, const Tensor& k_mix, const Tensor& v_mix, const Tensor& r_mix, const Tensor& t_decay, const Tensor& t_first, const Tensor& kw, const Tensor& vw, const Tensor& rw, const Tensor& ow) {
+  profiler::OpScope scope("att", x.device(), &x.shape());
   auto tmp = KernelRegistry::Instance().Get<decltype(att)*>("att", x.device());
   return tmp(x, sx, aa, bb, pp, ln_w, ln_b, k_mix, v_mix, r_mix, t_decay, t_first, kw, vw, rw, ow);
 }
 
+// RWKV-5.2 att, returns the new wkv state ([n_head, head_size, head_size]) last,
+// `s` is not modified
+inline std::tuple<Tensor, Tensor, Tensor> att_v5(const Tensor& x, const Tensor& sx, const Tensor& s, const Tensor& ln_w, const Tensor& ln_b, const Tensor& k_mix, const Tensor& v_mix, const Tensor& r_mix, const Tensor& g_mix, const Tensor& t_decay, const Tensor& t_first, const Tensor& kw, const Tensor& vw, const Tensor& rw, const Tensor& gw, const Tensor& ow, const Tensor& lx_w, const Tensor& lx_b) {
+  profiler::OpScope scope("att_v5", x.device(), &x.shape());
+  auto tmp = KernelRegistry::Instance().Get<decltype(att_v5)*>("att_v5", x.device());
+  return tmp(x, sx, s, ln_w, ln_b, k_mix, v_mix, r_mix, g_mix, t_decay, t_first, kw, vw, rw, gw, ow, lx_w, lx_b);
+}
+
 //         def cuda_ffn_one_fp16(self, x, sx, ln_w, ln_b, k_mix, r_mix, kw, vw, rw, kmx, krx, kmy, kry, vmx, vrx, vmy, vry, rmx, rrx, rmy, rry):
 inline std::tuple<Tensor, Tensor> ffn(const Tensor& x, const Tensor& sx, const Tensor& ln_w, const Tensor& ln_b, const Tensor& k_mix, const Tensor& r_mix, const Tensor& kw, const Tensor& vw, const Tensor& rw) {
+  profiler::OpScope scope("ffn", x.device(), &x.shape());
   auto tmp = KernelRegistry::Instance().Get<decltype(ffn)*>("ffn", x.device());
   return tmp(x, sx, ln_w, ln_b, k_mix, r_mix, kw, vw, rw);
 }
 
 inline Tensor cast_dtype(const Tensor& x, DType dtype) {
+  profiler::OpScope scope("cast_dtype", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(cast_dtype)*>("cast_dtype", x.device())(x, dtype);
 }
 
 inline Tensor& fill_(Tensor& x, float val) {
+  profiler::OpScope scope("fill_", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(fill_)*>("fill_", x.device())(x, val);
 }
 
 inline Tensor& scalar_div_(Tensor& x, float val) {
+  profiler::OpScope scope("scalar_div_", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(scalar_div_)*>("scalar_div_", x.device())(x, val);
 }
 
 inline Tensor layernorm(const Tensor& x, const Tensor& weight, const Tensor& bias) {
+  profiler::OpScope scope("layernorm", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(layernorm)*>("layernorm", x.device())(x, weight, bias);
 }
 inline Tensor matmul(const Tensor& a, const Tensor& b) {
+  profiler::OpScope scope("matmul", a.device(), &a.shape());
   return KernelRegistry::Instance().Get<decltype(matmul)*>("matmul", a.device())(a, b);
 }
 
 // TODO:
 // REGISTER_KERNEL(Tensor, add, const Tensor&, x, const Tensor&, y);
 
+// `t_first + k`: the constant (kCPU) operand of the meta backends can come
+// first, so add dispatches on the other one
 inline Tensor add(const Tensor& x, const Tensor& y) {
-  return KernelRegistry::Instance().Get<decltype(add)*>("add", Device::kNCNNMeta)(x, y);
+  profiler::OpScope scope("add", x.device() == Device::kCPU ? y.device() : x.device(), &x.shape());
+  return KernelRegistry::Instance().Get<decltype(add)*>("add", x.device() == Device::kCPU ? y.device() : x.device())(x, y);
 }
 
 inline Tensor sub(float x, const Tensor& y) {
-  return KernelRegistry::Instance().Get<Tensor(*)(float, const Tensor&)>("rsub_scalar", Device::kNCNNMeta)(x, y);
+  profiler::OpScope scope("rsub_scalar", y.device(), &y.shape());
+  return KernelRegistry::Instance().Get<Tensor(*)(float, const Tensor&)>("rsub_scalar", y.device())(x, y);
 }
 
 inline Tensor sub(const Tensor& x, const Tensor& y) {
+  profiler::OpScope scope("sub", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<Tensor(*)(const Tensor&, const Tensor&)>("sub", x.device())(x, y);
 }
 
 inline Tensor mul(const Tensor& x, const Tensor& y) {
+  profiler::OpScope scope("mul", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(mul)*>("mul", x.device())(x, y);
 }
 
 inline Tensor div(const Tensor& x, const Tensor& y) {
+  profiler::OpScope scope("div", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(div)*>("div", x.device())(x, y);
 }
 
 inline Tensor exp(const Tensor& x) {
+  profiler::OpScope scope("exp", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(exp)*>("exp", x.device())(x);
 }
 
 inline Tensor relu(const Tensor& x) {
+  profiler::OpScope scope("relu", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(relu)*>("relu", x.device())(x);
 }
 
 inline Tensor sigmoid(const Tensor& x) {
+  profiler::OpScope scope("sigmoid", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(sigmoid)*>("sigmoid", x.device())(x);
 }
 
 inline Tensor maximum(const Tensor& x, const Tensor& y) {
+  profiler::OpScope scope("maximum", x.device(), &x.shape());
   return KernelRegistry::Instance().Get<decltype(maximum)*>("maximum", x.device())(x, y);
 }
 
@@ -83,13 +111,42 @@ inline Tensor mark_as_output(const Tensor& x, const std::string& name) {
 class Model;
 
 inline void init_model(Model* model, Device device, const std::string& path, const std::string& strategy) {
+  profiler::OpScope scope("init_model", device);
   KernelRegistry::Instance().Get<void(*)(Model*, Device, const std::string&, const std::string&)>("init_model", device)(model, device, path, strategy);
 }
 
+inline void load_delta(Model* model, Device device, const std::string& path, bool materialize) {
+  profiler::OpScope scope("load_delta", device);
+  KernelRegistry::Instance().Get<void(*)(Model*, Device, const std::string&, bool)>("load_delta", device)(model, device, path, materialize);
+}
+
 inline Tensor ModelForward(const Model* model, Device device, int id, std::vector<std::vector<Tensor>>& states) {
+  profiler::OpScope scope("model_forward", device);
+  perf::ForwardScope perf_scope(1);
   return KernelRegistry::Instance().Get<decltype(ModelForward)*>("model_forward", device)(model, device, id, states);
 }
 
+// `ModelForward` on all tokens of `ids`, returning the output of the last one
+inline Tensor ModelForwardSeq(const Model* model, Device device, const std::vector<int>& ids, std::vector<std::vector<Tensor>>& states) {
+  profiler::OpScope scope("model_forward_seq", device);
+  perf::ForwardScope perf_scope(ids.size());
+  return KernelRegistry::Instance().Get<decltype(ModelForwardSeq)*>("model_forward_seq", device)(model, device, ids, states);
+}
+
+// One token for each of several sessions, `ids[b]` for `*states[b]`, run as
+// a batch. Returns the [B, n_vocab] logits.
+inline Tensor ModelForwardBatch(const Model* model, Device device, const std::vector<int>& ids, const std::vector<std::vector<std::vector<Tensor>>*>& states) {
+  profiler::OpScope scope("model_forward_batch", device);
+  perf::ForwardScope perf_scope(ids.size());
+  return KernelRegistry::Instance().Get<decltype(ModelForwardBatch)*>("model_forward_batch", device)(model, device, ids, states);
+}
+
+inline Tensor ModelForwardHidden(const Model* model, Device device, const Tensor& x, std::vector<std::vector<Tensor>>& states) {
+  profiler::OpScope scope("model_forward_hidden", device, &x.shape());
+  perf::ForwardScope perf_scope(1);
+  return KernelRegistry::Instance().Get<decltype(ModelForwardHidden)*>("model_forward_hidden", device)(model, device, x, states);
+}
+
 inline Allocator& allocator(Device device) {
   return KernelRegistry::Instance().Get<Allocator&(*)()>("allocator", device)();
 }
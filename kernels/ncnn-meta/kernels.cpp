@@ -1,12 +1,20 @@
 #include <kernels/ncnn-meta/kernels.h>
 
-#include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <set>
 #include <stdio.h>
 #include <string>
+#include <tuple>
+#include <vector>
 
 #include <kernels/allocator.h>
 #include <kernels/registry.h>
+#include <model.h>
 #include <tensor.h>
 
 #define STRINGIFY(x) STRINGIFY_(x)
@@ -18,50 +26,81 @@ Tensor cast_dtype(const Tensor &x, DType dtype);
 }
 namespace ncnnmeta {
 
-int unique_layer_id() {
-  static int _unique_id = 0;
-  return _unique_id++;
-}
-
-int add_and_get_blob_num(int num) {
-  static int _blob_num = 0;
-  _blob_num += num;
-  return _blob_num;
-}
+// The traced ops are recorded as a graph and only written out in `destroy()`,
+// after the passes below have run on it:
+//   1. ops whose operands are all constants (kCPU tensors, e.g. `1 - k_mix`)
+//      are computed at export time, and a constant becomes a MemoryData layer
+//      only when a traced op consumes it,
+//   2. layers whose outputs are never used are removed together with their
+//      weights (e.g. the MemoryData of the initial states),
+//   3. `x * x` becomes a single UnaryOp square,
+//   4. a Split is inserted for every blob with more than one consumer, so
+//      kernels can use a tensor many times without splitting it by hand.
+// att and ffn are emitted as the fused RWKV* layers of kernels/ncnn/layers.h
+// around the InnerProducts of their weights. The activations are [T, C], so
+// the same graph runs a single token or a whole prompt. In batch mode (see
+// `set_batch`) the rows are the current tokens of B independent sessions
+// instead, with [B, C] states.
+struct Layer {
+  std::string type;
+  std::vector<std::string> inputs;
+  std::vector<std::string> outputs;
+  std::string params;
+  // written to the .bin file in order, with a dtype tag if the bool is true
+  std::vector<std::pair<Tensor, bool>> weights;
+};
 
-FILE *bp, *pp;
-std::string _pp_path;
+std::vector<Layer> layers;
+// blob name -> the name the runtime looks it up by
+std::map<std::string, std::string> output_names;
+// name of a constant -> the blob of its MemoryData layer
+std::map<std::string, std::string> constant_blobs;
+// name of a weight -> max |x| of its input, for the weights exported as int8
+std::map<std::string, float> int8_input_absmax;
+bool batch = false;
+std::string _bp_path, _pp_path;
 
 void init(const std::string &bp_path, const std::string &pp_path) {
-  bp = fopen(bp_path.c_str(), "wb");
-  pp = fopen(pp_path.c_str(), "wb");
+  _bp_path = bp_path;
   _pp_path = pp_path;
+  layers.clear();
+  output_names.clear();
+  constant_blobs.clear();
+  int8_input_absmax.clear();
+  batch = false;
 }
 
-void destroy() {
-  fclose(bp);
-  fclose(pp);
-  std::ifstream t(_pp_path);
-  std::stringstream buffer;
-  buffer << t.rdbuf();
-  t.close();
-  std::string pp_str = buffer.str();
-  int layer_num = unique_layer_id();
-  int blob_num = add_and_get_blob_num(0);
-  pp_str = "7767517\n" + std::to_string(layer_num) + " " +
-           std::to_string(blob_num) + "\n" + pp_str;
-  std::ofstream out(_pp_path);
-  out << pp_str;
-  out.close();
+void set_int8_input_absmax(const std::map<std::string, float> &input_absmax) {
+  int8_input_absmax = input_absmax;
 }
 
-void append_data_to_bin_file(const Tensor &tensor, bool write_tag) {
+void set_batch(bool is_batch) { batch = is_batch; }
+
+namespace {
+
+std::string format(const char *fmt, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  return buf;
+}
+
+void append_data_to_bin_file(FILE *bp, const Tensor &tensor, bool write_tag) {
   RV_CHECK(tensor.device() == Device::kCPU);
-  // RV_CHECK(tensor.is_constant);
   if (write_tag) {
     if (tensor.dtype() == DType::kFloat16) {
       unsigned int fp16_flag = 0x01306B47;
       fwrite((const char *)&fp16_flag, sizeof(fp16_flag), 1, bp);
+    } else if (tensor.dtype() == DType::kInt8) {
+      unsigned int int8_flag = 0x000D4B38;
+      fwrite((const char *)&int8_flag, sizeof(int8_flag), 1, bp);
+      // ncnn reads int8 data padded to 4 bytes
+      fwrite(tensor.data_ptr(), 1, tensor.numel(), bp);
+      static const char zeros[4] = {};
+      fwrite(zeros, 1, (4 - tensor.numel() % 4) % 4, bp);
+      return;
     } else {
       RV_CHECK(tensor.dtype() == DType::kFloat32);
       unsigned int fp32_flag = 0;
@@ -71,132 +110,226 @@ void append_data_to_bin_file(const Tensor &tensor, bool write_tag) {
   fwrite(tensor.data_ptr(), tensor.elem_size(), tensor.numel(), bp);
 }
 
-#define PRINT_OP_TYPE_AND_NAME(op_type, input_num, output_num)                 \
-  fprintf(pp, "%-16s", op_type);                                               \
-  {                                                                            \
-    std::string tmp = std::to_string(unique_layer_id());                       \
-    fprintf(pp, " %-24s", tmp.c_str());                                        \
-  }                                                                            \
-  add_and_get_blob_num(output_num);                                            \
-  fprintf(pp, " %d %d", input_num, output_num);
+std::vector<Tensor>
+add_multi_output_layer(const std::string &type,
+                       const std::vector<Tensor> &inputs,
+                       const std::vector<Shape> &output_shapes,
+                       const std::string &params,
+                       std::vector<std::pair<Tensor, bool>> weights = {}) {
+  Layer layer{type, {}, {}, params, std::move(weights)};
+  for (auto &input : inputs) {
+    RV_CHECK(input.device() == Device::kNCNNMeta);
+    layer.inputs.push_back(input.name);
+  }
+  std::vector<Tensor> outputs;
+  for (auto &shape : output_shapes) {
+    outputs.push_back(
+        Tensor::Empty(shape, DType::kFloat32, Device::kNCNNMeta));
+    layer.outputs.push_back(outputs.back().name);
+  }
+  layers.push_back(std::move(layer));
+  return outputs;
+}
+
+Tensor add_layer(const std::string &type, const std::vector<Tensor> &inputs,
+                 const Shape &output_shape, const std::string &params,
+                 std::vector<std::pair<Tensor, bool>> weights = {}) {
+  return add_multi_output_layer(type, inputs, {output_shape}, params,
+                                std::move(weights))[0];
+}
+
+bool is_constant(const Tensor &x) { return x.device() == Device::kCPU; }
+
+Tensor to_fp32(const Tensor &x) {
+  return x.dtype() == DType::kFloat32 ? x
+                                      : cpu::cast_dtype(x, DType::kFloat32);
+}
+
+// `f` applied elementwise on constants, with broadcasting of single elements
+Tensor fold(const Tensor &x, const Tensor &y,
+            const std::function<float(float, float)> &f) {
+  auto x32 = to_fp32(x);
+  auto y32 = to_fp32(y);
+  RV_CHECK(x32.numel() == y32.numel() || x32.numel() == 1 ||
+           y32.numel() == 1);
+  auto &shape = x32.numel() >= y32.numel() ? x32.shape() : y32.shape();
+  auto output = Tensor::Empty(shape, DType::kFloat32, Device::kCPU);
+  auto *x_ptr = x32.data_ptr<float>();
+  auto *y_ptr = y32.data_ptr<float>();
+  auto *out_ptr = output.data_ptr<float>();
+  int64_t x_stride = x32.numel() == 1 ? 0 : 1;
+  int64_t y_stride = y32.numel() == 1 ? 0 : 1;
+  for (int64_t i = 0; i < output.numel(); i++) {
+    out_ptr[i] = f(x_ptr[i * x_stride], y_ptr[i * y_stride]);
+  }
+  return output;
+}
+
+Tensor fold(const Tensor &x, const std::function<float(float)> &f) {
+  return fold(x, x, [&](float a, float) { return f(a); });
+}
+
+Tensor as_meta(const Tensor &x) {
+  return is_constant(x) ? MemoryData(x) : x;
+}
+
+} // namespace
 
 Tensor add_input(const Shape &shape, const std::string &name) {
-  PRINT_OP_TYPE_AND_NAME("Input", 0, 1);
-  auto output = Tensor::Empty(shape, DType::kFloat32, Device::kNCNNMeta);
-  output.name = name;
-  fprintf(pp, " %s", output.name.c_str());
+  std::string params;
   if (shape.size() == 4) {
-    fprintf(pp, " 0=%d", (int)shape[3]);
-    fprintf(pp, " 1=%d", (int)shape[2]);
-    fprintf(pp, " 2=%d", (int)shape[1]);
-    fprintf(pp, " 3=%d", (int)shape[0]);
+    params = format(" 0=%d 1=%d 2=%d 3=%d", (int)shape[3], (int)shape[2],
+                    (int)shape[1], (int)shape[0]);
   } else if (shape.size() == 3) {
-    fprintf(pp, " 0=%d", (int)shape[2]);
-    fprintf(pp, " 1=%d", (int)shape[1]);
-    fprintf(pp, " 2=%d", (int)shape[0]);
+    params = format(" 0=%d 1=%d 2=%d", (int)shape[2], (int)shape[1],
+                    (int)shape[0]);
   } else if (shape.size() == 2) {
-    fprintf(pp, " 0=%d", (int)shape[1]);
-    fprintf(pp, " 1=%d", (int)shape[0]);
+    params = format(" 0=%d 1=%d", (int)shape[1], (int)shape[0]);
   } else if (shape.size() == 1) {
-    fprintf(pp, " 0=%d", (int)shape[0]);
+    params = format(" 0=%d", (int)shape[0]);
   } else {
     RV_UNIMPLEMENTED();
   }
-  fprintf(pp, "\n");
+  auto output = add_layer("Input", {}, shape, params);
+  output.name = name;
+  layers.back().outputs[0] = name;
   return output;
 }
 
+Tensor embedding(const std::vector<Tensor> &weights,
+                 const std::string &input_name) {
+  RV_CHECK(!weights.empty());
+  int64_t n_embd = weights[0].numel();
+  int64_t n_vocab = weights.size();
+  auto input = add_input({1}, input_name);
+
+  auto table =
+      Tensor::Empty({n_vocab, n_embd}, DType::kFloat16, Device::kCPU);
+  for (int64_t i = 0; i < n_vocab; i++) {
+    RV_CHECK(weights[i].numel() == n_embd);
+    auto row = cpu::cast_dtype(weights[i], DType::kFloat16);
+    memcpy(table.data_ptr<float16>() + i * n_embd, row.data_ptr(),
+           n_embd * sizeof(float16));
+  }
+  // [T, n_embd] for T input tokens, T is only known at runtime
+  return add_layer(
+      "Embed", {input}, {1, n_embd},
+      format(" 0=%d 1=%d 2=0 3=%d", static_cast<int>(n_embd),
+             static_cast<int>(n_vocab), static_cast<int>(n_vocab * n_embd)),
+      {{table, true}});
+}
+
+Tensor last_row(const Tensor &x) {
+  if (batch) {
+    // every row is the last token of its session
+    return x;
+  }
+  return add_layer("RWKVLastRow", {x}, {x.shape().back()}, "");
+}
+
 Tensor layernorm(const Tensor &x, const Tensor &weight, const Tensor &bias) {
-  PRINT_OP_TYPE_AND_NAME("LayerNorm", 1, 1);
-  auto output = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  fprintf(pp, " %s %s", x.name.c_str(), output.name.c_str());
-
-  fprintf(pp, " 0=%d", static_cast<int>(weight.numel()));
-  fprintf(pp, " 1=%e", 1e-5f);
-  fprintf(pp, " 2=1");
-  fprintf(pp, "\n");
-  append_data_to_bin_file(cpu::cast_dtype(weight, DType::kFloat32), false);
-  append_data_to_bin_file(cpu::cast_dtype(bias, DType::kFloat32), false);
-  return output;
+  return add_layer("LayerNorm", {x}, x.shape(),
+                   format(" 0=%d 1=%e 2=1", static_cast<int>(weight.numel()),
+                          1e-5f),
+                   {{to_fp32(weight), false}, {to_fp32(bias), false}});
 }
 
 Tensor matmul(const Tensor &a, const Tensor &b) {
   RV_CHECK(a.device() == Device::kNCNNMeta);
-  auto [a_reshape, reshaped] = [&]() -> std::pair<Tensor, bool> {
-    if (a.shape().size() == 1) {
-      PRINT_OP_TYPE_AND_NAME("Reshape", 1, 1);
-      auto output =
-          Tensor::Empty({1, a.shape()[0]}, DType::kFloat32, Device::kNCNNMeta);
-      fprintf(pp, " %s %s", a.name.c_str(), output.name.c_str());
-      fprintf(pp, " 0=0 1=1\n");
-      return {output, true};
+  RV_CHECK(b.shape().size() == 2);
+  if (a.shape().size() <= 2 && is_constant(b)) {
+    // a single InnerProduct instead of Reshape + Gemm + Reshape, which is a
+    // gemm over the rows of a 2-D input. Its weight is [N, K].
+    int64_t k = b.shape()[0];
+    int64_t n = b.shape()[1];
+    Shape output_shape = a.shape();
+    output_shape.back() = n;
+    auto b32 = to_fp32(b);
+    auto *b_ptr = b32.data_ptr<float>();
+    auto params = format(" 0=%d 1=0 2=%d", static_cast<int>(n),
+                         static_cast<int>(n * k));
+    auto it = int8_input_absmax.find(b.name);
+    if (it == int8_input_absmax.end()) {
+      auto weight = Tensor::Empty({n, k}, DType::kFloat16, Device::kCPU);
+      auto *w_ptr = weight.data_ptr<float16>();
+      for (int64_t i = 0; i < k; i++) {
+        for (int64_t j = 0; j < n; j++) {
+          w_ptr[j * k + i] = static_cast<float16>(b_ptr[i * n + j]);
+        }
+      }
+      return add_layer("InnerProduct", {a}, output_shape, params,
+                       {{weight, true}});
+    }
+    // symmetric int8 with one scale per output and one for the input, ncnn
+    // computes sum(w_q * x_q) / (weight_scale * input_scale)
+    auto weight = Tensor::Empty({n, k}, DType::kInt8, Device::kCPU);
+    auto weight_scales = Tensor::Empty({n}, DType::kFloat32, Device::kCPU);
+    auto input_scale = Tensor::Empty({1}, DType::kFloat32, Device::kCPU);
+    auto *w_ptr = weight.data_ptr<int8_t>();
+    auto *scale_ptr = weight_scales.data_ptr<float>();
+    for (int64_t j = 0; j < n; j++) {
+      float absmax = 0;
+      for (int64_t i = 0; i < k; i++) {
+        absmax = std::max(absmax, std::abs(b_ptr[i * n + j]));
+      }
+      scale_ptr[j] = absmax == 0 ? 1.f : 127.f / absmax;
+      for (int64_t i = 0; i < k; i++) {
+        float q = std::round(b_ptr[i * n + j] * scale_ptr[j]);
+        w_ptr[j * k + i] = static_cast<int8_t>(std::clamp(q, -127.f, 127.f));
+      }
     }
-    return {a, false};
-  }();
-  int constantM = 0;
+    input_scale.data_ptr<float>()[0] =
+        it->second == 0 ? 1.f : 127.f / it->second;
+    return add_layer(
+        "InnerProduct", {a}, output_shape, params + " 8=2",
+        {{weight, true}, {weight_scales, false}, {input_scale, false}});
+  }
+  bool reshaped = a.shape().size() == 1;
+  Tensor a_reshape =
+      reshaped ? add_layer("Reshape", {a}, {1, a.shape()[0]}, " 0=0 1=1") : a;
+  RV_CHECK(a_reshape.shape().size() == 2);
   int constantN = 0;
   int constantK = 0;
-  RV_CHECK(a_reshape.shape().size() == 2);
-  // if (a.device() == Device::kCPU) {
-  //   append_data_to_bin_file(a, true);
-  //   constantM = a.shape()[0];
-  //   constantK = a.shape()[1];
-  // }
-  RV_CHECK(b.shape().size() == 2);
-  if (b.device() == Device::kCPU) {
-    append_data_to_bin_file(cpu::cast_dtype(b, DType::kFloat16), true);
+  std::vector<Tensor> inputs{a_reshape};
+  std::vector<std::pair<Tensor, bool>> weights;
+  if (is_constant(b)) {
+    weights.push_back({cpu::cast_dtype(b, DType::kFloat16), true});
     constantK = b.shape()[0];
     constantN = b.shape()[1];
+  } else {
+    inputs.push_back(b);
   }
-  auto output = Tensor::Empty({a_reshape.shape()[0], b.shape()[1]},
-                              DType::kFloat32, Device::kNCNNMeta);
-  int input_num = 0;
-  if (a_reshape.device() == Device::kNCNNMeta) {
-    input_num++;
-  }
-  if (b.device() == Device::kNCNNMeta) {
-    input_num++;
-  }
-  PRINT_OP_TYPE_AND_NAME("Gemm", input_num, 1);
-  if (a_reshape.device() == Device::kNCNNMeta) {
-    fprintf(pp, " %s", a_reshape.name.c_str());
-  }
-  if (b.device() == Device::kNCNNMeta) {
-    fprintf(pp, " %s", b.name.c_str());
-  }
-  fprintf(pp, " %s", output.name.c_str());
-  fprintf(pp, " 4=%d 5=%d 7=%d 8=%d 9=%d", a_reshape.device() == Device::kCPU,
-          b.device() == Device::kCPU, constantM, constantN, constantK);
-  fprintf(pp, "\n");
+  auto output =
+      add_layer("Gemm", inputs, {a_reshape.shape()[0], b.shape()[1]},
+                format(" 4=0 5=%d 7=0 8=%d 9=%d", is_constant(b), constantN,
+                       constantK),
+                std::move(weights));
   if (reshaped) {
-    PRINT_OP_TYPE_AND_NAME("Reshape", 1, 1);
-    auto squeezed =
-        Tensor::Empty({b.shape()[1]}, DType::kFloat32, Device::kNCNNMeta);
-    fprintf(pp, " %s %s", output.name.c_str(), squeezed.name.c_str());
-    fprintf(pp, " 0=-1\n");
-    return squeezed;
-  } else {
-    return output;
+    return add_layer("Reshape", {output}, {b.shape()[1]}, " 0=-1");
   }
+  return output;
 }
 
 Tensor MemoryData(const Tensor &x) {
-  RV_CHECK(x.device() == Device::kCPU);
-  PRINT_OP_TYPE_AND_NAME("MemoryData", 0, 1);
-  auto output = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  // use x's name
-  output.name = x.name;
-  fprintf(pp, " %s", output.name.c_str());
+  RV_CHECK(is_constant(x));
+  auto it = constant_blobs.find(x.name);
+  if (it != constant_blobs.end()) {
+    auto output =
+        Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
+    output.name = it->second;
+    return output;
+  }
+  std::string params;
   if (x.shape().size() == 2) {
-    fprintf(pp, " 0=%d", (int)x.shape()[1]);
-    fprintf(pp, " 1=%d", (int)x.shape()[0]);
+    params = format(" 0=%d 1=%d", (int)x.shape()[1], (int)x.shape()[0]);
   } else if (x.shape().size() == 1) {
-    fprintf(pp, " 0=%d", (int)x.shape()[0]);
+    params = format(" 0=%d", (int)x.shape()[0]);
   } else {
     RV_UNIMPLEMENTED();
   }
-  fprintf(pp, "\n");
-  append_data_to_bin_file(cpu::cast_dtype(x, DType::kFloat32), false);
+  auto output = add_layer("MemoryData", {}, x.shape(), params,
+                          {{to_fp32(x), false}});
+  constant_blobs[x.name] = output.name;
   return output;
 }
 
@@ -204,122 +337,77 @@ std::map<std::string, int> binary_op_ids{{"add", 0},     {"sub", 1},
                                          {"mul", 2},     {"div", 3},
                                          {"maximum", 4}, {"rsub", 7}};
 
-// TODO: shape inference
-#define BINARYOP(op_type_name)                                                 \
+#define BINARYOP(op_type_name, expr)                                           \
   Tensor op_type_name(const Tensor &x, const Tensor &y) {                      \
-    Tensor meta_x = x.device() == Device::kCPU ? MemoryData(x) : x;            \
-    Tensor meta_y = y.device() == Device::kCPU ? MemoryData(y) : y;            \
-    PRINT_OP_TYPE_AND_NAME("BinaryOp", 2, 1);                                  \
-    auto output =                                                              \
-        Tensor::Empty(Shape(std::max(x.shape().size(), y.shape().size()), 0),  \
-                      DType::kFloat32, Device::kNCNNMeta);                     \
-    fprintf(pp, " %s", meta_x.name.c_str());                                   \
-    fprintf(pp, " %s", meta_y.name.c_str());                                   \
-    fprintf(pp, " %s", output.name.c_str());                                   \
-    fprintf(pp, " 0=%d", binary_op_ids[STRINGIFY(op_type_name)]);              \
-    fprintf(pp, "\n");                                                         \
-    return output;                                                             \
+    if (is_constant(x) && is_constant(y)) {                                    \
+      return fold(x, y, [](float a, float b) { return expr; });                \
+    }                                                                          \
+    auto &shape = x.numel() >= y.numel() ? x.shape() : y.shape();              \
+    return add_layer(                                                          \
+        "BinaryOp", {as_meta(x), as_meta(y)}, shape,                           \
+        format(" 0=%d", binary_op_ids[STRINGIFY(op_type_name)]));              \
   }
 
-BINARYOP(add);
-BINARYOP(sub);
-BINARYOP(mul);
-BINARYOP(div);
-BINARYOP(maximum);
+BINARYOP(add, a + b);
+BINARYOP(sub, a - b);
+BINARYOP(mul, a * b);
+BINARYOP(div, a / b);
+BINARYOP(maximum, std::max(a, b));
 
 Tensor rsub_scalar(float x, const Tensor &y) {
-  Tensor meta_y = y.device() == Device::kCPU ? MemoryData(y) : y;
-  PRINT_OP_TYPE_AND_NAME("BinaryOp", 1, 1);
-  auto output = Tensor::Empty({}, DType::kFloat32, Device::kNCNNMeta);
-  fprintf(pp, " %s", meta_y.name.c_str());
-  fprintf(pp, " %s", output.name.c_str());
-  fprintf(pp, " 0=%d", binary_op_ids["rsub"]);
-  fprintf(pp, " 1=1");
-  fprintf(pp, " 2=%e", x);
-  fprintf(pp, "\n");
-  return output;
-}
-
-Tensor exp(const Tensor &x) {
-  PRINT_OP_TYPE_AND_NAME("Exp", 1, 1);
-  auto output = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  fprintf(pp, " %s", x.name.c_str());
-  fprintf(pp, " %s", output.name.c_str());
-  fprintf(pp, "\n");
-  return output;
-}
-
-Tensor relu(const Tensor &x) {
-  PRINT_OP_TYPE_AND_NAME("ReLU", 1, 1);
-  auto output = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  fprintf(pp, " %s", x.name.c_str());
-  fprintf(pp, " %s", output.name.c_str());
-  fprintf(pp, "\n");
-  return output;
-}
-
-Tensor sigmoid(const Tensor &x) {
-  PRINT_OP_TYPE_AND_NAME("Sigmoid", 1, 1);
-  auto output = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  fprintf(pp, " %s", x.name.c_str());
-  fprintf(pp, " %s", output.name.c_str());
-  fprintf(pp, "\n");
-  return output;
+  if (is_constant(y)) {
+    return fold(y, [x](float a) { return x - a; });
+  }
+  return add_layer("BinaryOp", {y}, y.shape(),
+                   format(" 0=%d 1=1 2=%e", binary_op_ids["rsub"], x));
 }
 
-Tensor mark_as_output(const Tensor &x, const std::string& name) {
-  PRINT_OP_TYPE_AND_NAME("Split", 1, 1);
-  auto output =
-      Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  output.name = name;
-  fprintf(pp, " %s", x.name.c_str());
-  fprintf(pp, " %s", output.name.c_str());
-  fprintf(pp, "\n");
-  return output;
-}
+#define UNARYOP(op_name, layer_type, expr)                                     \
+  Tensor op_name(const Tensor &x) {                                            \
+    if (is_constant(x)) {                                                      \
+      return fold(x, [](float a) { return expr; });                            \
+    }                                                                          \
+    return add_layer(layer_type, {x}, x.shape(), "");                          \
+  }
 
-std::pair<Tensor, Tensor> split2(const Tensor &x) {
-  Tensor meta_x = x.device() == Device::kCPU ? MemoryData(x) : x;
-  PRINT_OP_TYPE_AND_NAME("Split", 1, 2);
-  auto output1 =
-      Tensor::Empty(meta_x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  auto output2 =
-      Tensor::Empty(meta_x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  fprintf(pp, " %s", meta_x.name.c_str());
-  fprintf(pp, " %s", output1.name.c_str());
-  fprintf(pp, " %s", output2.name.c_str());
-  fprintf(pp, "\n");
-  return {output1, output2};
+UNARYOP(exp, "Exp", std::exp(a));
+UNARYOP(relu, "ReLU", std::max(a, 0.f));
+UNARYOP(sigmoid, "Sigmoid", 1.f / (1.f + std::exp(-a)));
+
+// The fused layers below are implemented in kernels/ncnn/layers.cpp.
+
+// the mixes and the new `sx`: the last row of `xx`, or `xx` in batch mode
+std::vector<Tensor> time_mix(const Tensor &xx, const Tensor &sx,
+                             const std::vector<Tensor> &mixes) {
+  int64_t c = xx.shape().back();
+  auto mix = Tensor::Empty({static_cast<int64_t>(mixes.size()), c},
+                           DType::kFloat32, Device::kCPU);
+  for (size_t i = 0; i < mixes.size(); i++) {
+    RV_CHECK(mixes[i].numel() == c);
+    memcpy(mix.data_ptr<float>() + i * c, to_fp32(mixes[i]).data_ptr(),
+           c * sizeof(float));
+  }
+  std::vector<Shape> output_shapes(mixes.size(), xx.shape());
+  if (!batch) {
+    output_shapes.push_back({c});
+  }
+  auto outputs = add_multi_output_layer(
+      "RWKVTimeMix", {xx, as_meta(sx)}, output_shapes,
+      format(" 0=%d 1=%d 2=%d", static_cast<int>(c),
+             static_cast<int>(mixes.size()), static_cast<int>(batch)),
+      {{mix, false}});
+  if (batch) {
+    outputs.push_back(xx);
+  }
+  return outputs;
 }
 
-std::tuple<Tensor, Tensor, Tensor> split3(const Tensor &x) {
-  Tensor meta_x = x.device() == Device::kCPU ? MemoryData(x) : x;
-  PRINT_OP_TYPE_AND_NAME("Split", 1, 3);
-  auto output1 = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  auto output2 = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  auto output3 = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  fprintf(pp, " %s", meta_x.name.c_str());
-  fprintf(pp, " %s", output1.name.c_str());
-  fprintf(pp, " %s", output2.name.c_str());
-  fprintf(pp, " %s", output3.name.c_str());
-  fprintf(pp, "\n");
-  return {output1, output2, output3};
+Tensor relu_square(const Tensor &x) {
+  return add_layer("RWKVReluSquare", {x}, x.shape(), "");
 }
 
-std::tuple<Tensor, Tensor, Tensor, Tensor> split4(const Tensor &x) {
-  Tensor meta_x = x.device() == Device::kCPU ? MemoryData(x) : x;
-  PRINT_OP_TYPE_AND_NAME("Split", 1, 4);
-  auto output1 = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  auto output2 = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  auto output3 = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  auto output4 = Tensor::Empty(x.shape(), DType::kFloat32, Device::kNCNNMeta);
-  fprintf(pp, " %s", meta_x.name.c_str());
-  fprintf(pp, " %s", output1.name.c_str());
-  fprintf(pp, " %s", output2.name.c_str());
-  fprintf(pp, " %s", output3.name.c_str());
-  fprintf(pp, " %s", output4.name.c_str());
-  fprintf(pp, "\n");
-  return {output1, output2, output3, output4};
+Tensor gated_residual(const Tensor &x, const Tensor &r, const Tensor &y) {
+  return add_layer("RWKVGatedResidual", {x, r, y}, x.shape(), "");
 }
 
 std::tuple<Tensor, Tensor, Tensor, Tensor, Tensor>
@@ -328,89 +416,197 @@ att(const Tensor &x, const Tensor &sx, const Tensor &aa, const Tensor &bb,
     const Tensor &k_mix, const Tensor &v_mix, const Tensor &r_mix,
     const Tensor &t_decay, const Tensor &t_first, const Tensor &kw,
     const Tensor &vw, const Tensor &rw, const Tensor &ow) {
-  auto [x_s1, x_s2] = split2(x);
-  auto xx = layernorm(x_s1, ln_w, ln_b);
-  auto [xx_s1, xx_s2, xx_s3, xx_s4] = split4(xx);
-  // auto [kx, vx, rx] = time_mix()
-  auto [sx_s1, sx_s2, sx_s3] = split3(sx);
-  auto [k_mix_s1, k_mix_s2] = split2(k_mix);
-  auto [v_mix_s1, v_mix_s2] = split2(v_mix);
-  auto [r_mix_s1, r_mix_s2] = split2(r_mix);
-  auto kx = xx_s1 * k_mix_s1 + sx_s1 * (1 - k_mix_s2);
-  auto vx = xx_s2 * v_mix_s1 + sx_s2 * (1 - v_mix_s2);
-  auto rx = xx_s3 * r_mix_s1 + sx_s3 * (1 - r_mix_s2);
-
-  auto r = sigmoid(matmul(rx, rw));
-  auto k = matmul(kx, kw);
-  auto [k_s1, k_s2, k_s3] = split3(k);
-  auto v = matmul(vx, vw);
-  auto [v_s1, v_s2] = split2(v);
-
-  auto ww = t_first + k_s1;
-  auto [ww_s1, ww_s2] = split2(ww);
-  auto [pp_s1, pp_s2, pp_s3] = split3(pp);
-  auto p = maximum(pp_s1, ww_s1);
-  auto [p_s1, p_s2] = split2(p);
-  auto e1 = exp(pp_s2 - p_s1);
-  auto [e1_s1, e1_s2] = split2(e1);
-  auto e2 = exp(ww_s2 - p_s2);
-  auto [e2_s1, e2_s2] = split2(e2);
-  auto [aa_s1, aa_s2] = split2(aa);
-  auto [bb_s1, bb_s2] = split2(bb);
-  auto wkv = ((e1_s1 * aa_s1 + e2_s1 * v_s1) / (e1_s2 * bb_s1 + e2_s2));
-  // if (wkv->dtype() == DType::kFloat16) ...
-  auto ww2 = t_decay + pp_s3;
-  auto [ww2_s1, ww2_s2] = split2(ww2);
-  auto p2 = maximum(ww2_s1, k_s2);
-  auto [p2_s1, p2_s2, p2_s3] = split3(p2);
-  auto e1n = exp(ww2_s2 - p2_s1);
-  auto [e1n_s1, e1n_s2] = split2(e1n);
-  auto e2n = exp(k_s3 - p2_s2);
-  auto [e2n_s1, e2n_s2] = split2(e2n);
-
-  auto out = matmul(r * wkv, ow);
-  return {x_s2 + out, xx_s4, e1n_s1 * aa_s2 + e2n_s1 * v_s2,
-          e1n_s2 * bb_s2 + e2n_s2, p2_s3};
+  auto xx = layernorm(x, ln_w, ln_b);
+  auto mixed = time_mix(xx, sx, {k_mix, v_mix, r_mix});
+  auto k = matmul(mixed[0], kw);
+  auto v = matmul(mixed[1], vw);
+  auto r = matmul(mixed[2], rw);
+  // sigmoid(r) * wkv and the new aa, bb, pp
+  int64_t c = x.shape().back();
+  Shape state_shape = batch ? k.shape() : Shape{c};
+  auto wkv = add_multi_output_layer(
+      "RWKVWkv", {k, v, r, as_meta(aa), as_meta(bb), as_meta(pp)},
+      {k.shape(), state_shape, state_shape, state_shape},
+      format(" 0=%d 1=%d", static_cast<int>(c), static_cast<int>(batch)),
+      {{to_fp32(t_first), false}, {to_fp32(t_decay), false}});
+  auto out = matmul(wkv[0], ow);
+  return {x + out, mixed[3], wkv[1], wkv[2], wkv[3]};
 }
 
-KernelRegister att_reg("att", Device::kNCNNMeta, att);
-
 std::tuple<Tensor, Tensor> ffn(const Tensor &x, const Tensor &sx,
                                const Tensor &ln_w, const Tensor &ln_b,
                                const Tensor &k_mix, const Tensor &r_mix,
                                const Tensor &kw, const Tensor &vw,
                                const Tensor &rw) {
-  auto [x_s1, x_s2] = split2(x);
-  auto xx = layernorm(x_s1, ln_w, ln_b);
-  auto [xx_s1, xx_s2, xx_s3] = split3(xx);
-  auto [sx_s1, sx_s2] = split2(sx);
-  auto [k_mix_s1, k_mix_s2] = split2(k_mix);
-  auto [r_mix_s1, r_mix_s2] = split2(r_mix);
-  // auto [kx, rx] = channel_mix(xx, sx, k_mix, r_mix);
-  auto kx = xx_s1 * k_mix_s1 + sx_s1 * (1 - k_mix_s2);
-  auto rx = xx_s2 * r_mix_s1 + sx_s2 * (1 - r_mix_s2);
-
-  auto r = sigmoid(matmul(rx, rw));
-  auto vx = relu(matmul(kx, kw));
-  vx = vx * vx;
-  auto out = r * matmul(vx, vw);
-  return {x_s2 + out, xx_s3};
+  auto xx = layernorm(x, ln_w, ln_b);
+  auto mixed = time_mix(xx, sx, {k_mix, r_mix});
+  auto r = matmul(mixed[1], rw);
+  auto vx = relu_square(matmul(mixed[0], kw));
+  return {gated_residual(x, r, matmul(vx, vw)), mixed[2]};
 }
 
-KernelRegister ffn_reg("ffn", Device::kNCNNMeta, ffn);
+Tensor mark_as_output(const Tensor &x, const std::string &name) {
+  auto meta_x = as_meta(x);
+  RV_CHECK(output_names.count(meta_x.name) == 0);
+  output_names[meta_x.name] = name;
+  return meta_x;
+}
+
+void destroy() {
+  // dead layer elimination. Inputs are kept as the runtime feeds all of them.
+  std::set<std::string> used_blobs;
+  for (auto &[blob, _] : output_names) {
+    used_blobs.insert(blob);
+  }
+  std::vector<bool> alive(layers.size());
+  for (int i = layers.size() - 1; i >= 0; i--) {
+    auto &layer = layers[i];
+    alive[i] = layer.type == "Input" ||
+               std::any_of(layer.outputs.begin(), layer.outputs.end(),
+                           [&](auto &x) { return used_blobs.count(x); });
+    if (alive[i]) {
+      used_blobs.insert(layer.inputs.begin(), layer.inputs.end());
+    }
+  }
+
+  std::vector<Layer> optimized;
+  for (size_t i = 0; i < layers.size(); i++) {
+    if (!alive[i]) {
+      continue;
+    }
+    auto &layer = layers[i];
+    if (layer.type == "BinaryOp" && layer.params == " 0=2" &&
+        layer.inputs.size() == 2 && layer.inputs[0] == layer.inputs[1]) {
+      optimized.push_back(
+          {"UnaryOp", {layer.inputs[0]}, layer.outputs, " 0=4", {}});
+    } else {
+      optimized.push_back(std::move(layer));
+    }
+  }
+
+  // a graph output counts as a consumer of its blob
+  std::map<std::string, int> consumer_num;
+  for (auto &layer : optimized) {
+    for (auto &input : layer.inputs) {
+      consumer_num[input]++;
+    }
+  }
+  for (auto &[blob, _] : output_names) {
+    consumer_num[blob]++;
+  }
+
+  // the blob names left for the next consumers of a split blob
+  std::map<std::string, std::vector<std::string>> split_blobs;
+  std::vector<Layer> emitted;
+  for (auto &layer : optimized) {
+    for (auto &input : layer.inputs) {
+      auto it = split_blobs.find(input);
+      if (it != split_blobs.end()) {
+        input = it->second.back();
+        it->second.pop_back();
+      }
+    }
+    std::vector<Layer> splits;
+    for (auto &output : layer.outputs) {
+      auto n = consumer_num[output];
+      bool is_output = output_names.count(output);
+      if (n <= 1) {
+        if (is_output) {
+          output = output_names[output];
+        }
+        continue;
+      }
+      std::vector<std::string> branches;
+      for (int j = 0; j < n; j++) {
+        branches.push_back(output + "_s" + std::to_string(j));
+      }
+      if (is_output) {
+        branches[0] = output_names[output];
+      }
+      // consumers pop from the back
+      split_blobs[output] = std::vector<std::string>(
+          branches.rbegin(), branches.rend() - (is_output ? 1 : 0));
+      splits.push_back({"Split", {output}, branches, "", {}});
+    }
+    emitted.push_back(std::move(layer));
+    for (auto &split : splits) {
+      emitted.push_back(std::move(split));
+    }
+  }
+
+  FILE *bp = fopen(_bp_path.c_str(), "wb");
+  FILE *pp = fopen(_pp_path.c_str(), "wb");
+  RV_CHECK(bp && pp);
+  int blob_num = 0;
+  for (auto &layer : emitted) {
+    blob_num += layer.outputs.size();
+  }
+  fprintf(pp, "7767517\n%d %d\n", static_cast<int>(emitted.size()), blob_num);
+  for (size_t i = 0; i < emitted.size(); i++) {
+    auto &layer = emitted[i];
+    fprintf(pp, "%-16s %-24s %d %d", layer.type.c_str(),
+            std::to_string(i).c_str(), static_cast<int>(layer.inputs.size()),
+            static_cast<int>(layer.outputs.size()));
+    for (auto &input : layer.inputs) {
+      fprintf(pp, " %s", input.c_str());
+    }
+    for (auto &output : layer.outputs) {
+      fprintf(pp, " %s", output.c_str());
+    }
+    fprintf(pp, "%s\n", layer.params.c_str());
+    for (auto &[weight, write_tag] : layer.weights) {
+      append_data_to_bin_file(bp, weight, write_tag);
+    }
+  }
+  fclose(bp);
+  fclose(pp);
+
+  // the settings of the export which the graph does not tell, as `key=value`
+  // lines read by kernels/ncnn/init_model.cpp
+  auto config_path =
+      _pp_path.substr(0, _pp_path.rfind(".param")) + ".config";
+  FILE *cp = fopen(config_path.c_str(), "w");
+  RV_CHECK(cp);
+  fprintf(cp, "batch=%d\n", static_cast<int>(batch));
+  fclose(cp);
+  layers.clear();
+}
+
+// The token ids and the states are Inputs of the graph
+Tensor ModelForward(const Model *model, Device device, int /*id*/,
+                    std::vector<std::vector<Tensor>> &states) {
+  auto x = embedding(model->_embd_weights, "input");
+  for (size_t i = 0; i < states.size(); i++) {
+    for (size_t j = 0; j < states[i].size(); j++) {
+      states[i][j] =
+          add_input(states[i][j].shape(), "state_" + std::to_string(i) + "_" +
+                                              std::to_string(j));
+    }
+  }
+  // not through kernels/kernels.h, whose ops would be ambiguous with the ones
+  // of this file
+  return KernelRegistry::Instance()
+      .Get<Tensor (*)(const Model *, Device, const Tensor &,
+                      std::vector<std::vector<Tensor>> &)>(
+          "model_forward_hidden", device)(model, device, x, states);
+}
 
 class NullAllocator : public rwkv::Allocator {
 public:
   void *DoAllocate(size_t size) { return nullptr; }
-  void Deallocate(void *ptr) {}
+  void DoDeallocate(void *ptr) {}
 };
 
 rwkv::Allocator &allocator() {
-  static NullAllocator allocator;
-  return allocator;
+  static auto *allocator = new NullAllocator;
+  return *allocator;
 }
 
 KernelRegister allocator_reg("allocator", Device::kNCNNMeta, allocator);
+KernelRegister constant_reg("constant", Device::kNCNNMeta, MemoryData);
+KernelRegister last_row_reg("last_row", Device::kNCNNMeta, last_row);
+KernelRegister model_forward_reg("model_forward", Device::kNCNNMeta,
+                                 ModelForward);
 
 KernelRegister layernorm_reg("layernorm", Device::kNCNNMeta, layernorm);
 KernelRegister matmul_reg("matmul", Device::kNCNNMeta, matmul);
@@ -424,6 +620,8 @@ KernelRegister exp_reg("exp", Device::kNCNNMeta, exp);
 KernelRegister relu_reg("relu", Device::kNCNNMeta, relu);
 KernelRegister sigmoid_reg("sigmoid", Device::kNCNNMeta, sigmoid);
 KernelRegister mark_as_output_reg("mark_as_output", Device::kNCNNMeta, mark_as_output);
+KernelRegister att_reg("att", Device::kNCNNMeta, att);
+KernelRegister ffn_reg("ffn", Device::kNCNNMeta, ffn);
 
 } // namespace ncnnmeta
 } // namespace rwkv
@@ -1,8 +1,27 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
 #include <tensor.h>
 
 namespace rwkv {
 namespace ncnnmeta {
 Tensor add_input(const Shape &shape, const std::string &name);
+// The [T, C] embeddings of the T token ids fed to the int Input
+// `input_name`, as a single ncnn Embed layer holding all rows of `weights`.
+Tensor embedding(const std::vector<Tensor> &weights,
+                 const std::string &input_name);
+// the last row of a [T, C] activation, or all rows in batch mode
+Tensor last_row(const Tensor &x);
 Tensor MemoryData(const Tensor &x);
+// The 1-D matmuls with the weights in `input_absmax` are exported as int8
+// InnerProducts, with the input scale derived from the given max |input|.
+void set_int8_input_absmax(const std::map<std::string, float> &input_absmax);
+// In batch mode the graph runs one token of each of B sessions, the rows of
+// the input, with [B, C] states, instead of T tokens of one session.
+// Both settings are reset by init(), set them after it.
+void set_batch(bool batch);
 }
 }
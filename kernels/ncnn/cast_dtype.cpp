@@ -4,6 +4,8 @@
 #include <mat.h>
 
 #include <tensor.h>
+#include <kernels/ncnn/helper_layer.h>
+#include <kernels/ncnn/options.h>
 #include <kernels/registry.h>
 
 namespace rwkv {
@@ -11,33 +13,32 @@ namespace rwkv {
 namespace {
 static int ncnn_cast(const ncnn::Mat &a, ncnn::Mat &b, int type_from,
                      int type_to) {
-  ncnn::ParamDict pd;
-  pd.set(0, type_from);
-  pd.set(1, type_to);
-
-  std::vector<ncnn::Mat> weights(0);
-
-  ncnn::Option opt;
-  opt.num_threads = 1;
+  // the threads etc. of the model, see options.h
+  ncnn::Option opt = _ncnn::helper_option();
   opt.use_vulkan_compute = false;
   opt.use_int8_inference = false;
-  opt.use_packing_layout = false;
 
-  ncnn::Layer *op = ncnn::create_layer("Cast");
+  auto key =
+      "Cast " + std::to_string(type_from) + " " + std::to_string(type_to);
+  auto *op = _ncnn::cached_helper_layer(key, opt, [&]() {
+    ncnn::ParamDict pd;
+    pd.set(0, type_from);
+    pd.set(1, type_to);
 
-  op->load_param(pd);
+    std::vector<ncnn::Mat> weights(0);
 
-  ncnn::ModelBinFromMatArray mb(weights.data());
+    ncnn::Layer *op = ncnn::create_layer("Cast");
 
-  op->load_model(mb);
+    op->load_param(pd);
 
-  op->create_pipeline(opt);
+    ncnn::ModelBinFromMatArray mb(weights.data());
 
-  ((ncnn::Cast *)op)->ncnn::Cast::forward(a, b, opt);
+    op->load_model(mb);
 
-  op->destroy_pipeline(opt);
+    return op;
+  });
 
-  delete op;
+  ((const ncnn::Cast *)op)->ncnn::Cast::forward(a, b, opt);
 
   return 0;
 }
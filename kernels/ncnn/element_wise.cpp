@@ -1,7 +1,12 @@
+#include <cstdint>
+#include <cstring>
+
 #include <layer.h>
 #include <layer/binaryop.h>
 #include <mat.h>
 
+#include <kernels/ncnn/helper_layer.h>
+#include <kernels/ncnn/options.h>
 #include <kernels/registry.h>
 #include <tensor.h>
 
@@ -9,39 +14,45 @@ namespace rwkv {
 namespace {
 
 static int ncnn_scalar_div(ncnn::Mat &a, float b) {
-  ncnn::ParamDict pd;
-  pd.set(0, ncnn::BinaryOp::Operation_DIV);
-  pd.set(1, 1); // with_scalar
-  pd.set(2, b); // b
-
-  std::vector<ncnn::Mat> weights;
-
-  ncnn::Layer *op = ncnn::create_layer("BinaryOp");
-
-  op->load_param(pd);
-
-  ncnn::Option opt;
-  opt.num_threads = 1;
+  // the threads etc. of the model, see options.h
+  ncnn::Option opt = _ncnn::helper_option();
   opt.use_vulkan_compute = false;
   opt.use_int8_inference = false;
-  opt.use_packing_layout = false;
   if (a.elemsize == 2) {
-    RV_CHECK(op->support_fp16_storage);
     opt.use_fp16_arithmetic = true;
     opt.use_fp16_storage = true;
   }
 
-  ncnn::ModelBinFromMatArray mb(weights.data());
+  // the exact bits of `b`, std::to_string rounds to 6 decimals and would
+  // share a layer between close divisors
+  uint32_t b_bits;
+  std::memcpy(&b_bits, &b, sizeof(b));
+  auto key = "BinaryOp div " + std::to_string(b_bits) + " " +
+             std::to_string(a.elemsize);
+  auto *op = _ncnn::cached_helper_layer(key, opt, [&]() {
+    ncnn::ParamDict pd;
+    pd.set(0, ncnn::BinaryOp::Operation_DIV);
+    pd.set(1, 1); // with_scalar
+    pd.set(2, b); // b
+
+    std::vector<ncnn::Mat> weights;
+
+    ncnn::Layer *op = ncnn::create_layer("BinaryOp");
+
+    op->load_param(pd);
 
-  op->load_model(mb);
+    if (a.elemsize == 2) {
+      RV_CHECK(op->support_fp16_storage);
+    }
 
-  op->create_pipeline(opt);
+    ncnn::ModelBinFromMatArray mb(weights.data());
 
-  ((ncnn::BinaryOp *)op)->ncnn::BinaryOp::forward_inplace(a, opt);
+    op->load_model(mb);
 
-  op->destroy_pipeline(opt);
+    return op;
+  });
 
-  delete op;
+  ((const ncnn::BinaryOp *)op)->ncnn::BinaryOp::forward_inplace(a, opt);
 
   return 0;
 }
@@ -1,9 +1,8 @@
 #include <memory>
+#include <mutex>
 #include <vector>
 
-namespace ncnn {
-class Net;
-};
+#include <net.h>
 
 struct NcnnExtra {
   std::shared_ptr<ncnn::Net> net;
@@ -11,6 +10,27 @@ struct NcnnExtra {
   std::vector<std::vector<int>> state_ids;
   int output_blob_id;
   std::vector<std::vector<int>> output_state_ids;
+  // true if the input is the token id, fed to an Embed layer. Models
+  // exported before that have one MemoryData blob per token instead.
+  bool input_is_token_id = false;
+  // true if the graph takes T token ids at once and has [T, C] activations,
+  // see ModelForwardSeq
+  bool input_is_sequence = false;
+  // true if the graph runs one token of each of B sessions, with [B, C]
+  // states, see ModelForwardBatch
+  bool input_is_batch = false;
+  // Output states and logits are returned as views of the ncnn Mats (see
+  // _ncnn::ModelForward), so their buffers return to this pool when a state
+  // is replaced by the state of the next token. It outlives the model if the
+  // states do, and is locked since states can be released on any thread.
+  std::shared_ptr<ncnn::PoolAllocator> blob_allocator =
+      std::make_shared<ncnn::PoolAllocator>();
+  // The workspace allocators not in use by a forward. A forward takes one
+  // (or creates one if all are in use) and puts it back when it is done, so
+  // concurrent forwards don't share an unlocked pool, and the pools keep their
+  // buffers between tokens.
+  std::vector<std::unique_ptr<ncnn::UnlockedPoolAllocator>> free_workspaces;
+  std::mutex workspaces_mutex;
   NcnnExtra(const std::shared_ptr<ncnn::Net> &net, int input_blob_id,
             const std::vector<std::vector<int>> &state_ids, int output_blob_id,
             const std::vector<std::vector<int>> &output_state_ids)
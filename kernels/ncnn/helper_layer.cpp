@@ -0,0 +1,46 @@
+#include "helper_layer.h"
+
+#include <memory>
+#include <unordered_map>
+
+#include <check.h>
+#include "options.h"
+
+namespace rwkv {
+namespace _ncnn {
+
+namespace {
+struct CachedLayer {
+  std::unique_ptr<ncnn::Layer> layer;
+  ncnn::Option opt;
+
+  CachedLayer(ncnn::Layer *layer, const ncnn::Option &opt)
+      : layer(layer), opt(opt) {
+    RV_CHECK(!this->layer->create_pipeline(opt));
+  }
+  ~CachedLayer() { layer->destroy_pipeline(opt); }
+};
+
+struct LayerCache {
+  int option_version = -1;
+  std::unordered_map<std::string, std::unique_ptr<CachedLayer>> layers;
+};
+} // namespace
+
+const ncnn::Layer *cached_helper_layer(
+    const std::string &key, const ncnn::Option &opt,
+    const std::function<ncnn::Layer *()> &create) {
+  thread_local LayerCache cache;
+  if (cache.option_version != helper_option_version()) {
+    cache.layers.clear();
+    cache.option_version = helper_option_version();
+  }
+  auto &cached = cache.layers[key];
+  if (!cached) {
+    cached = std::make_unique<CachedLayer>(create(), opt);
+  }
+  return cached->layer.get();
+}
+
+} // namespace _ncnn
+} // namespace rwkv
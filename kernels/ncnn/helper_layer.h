@@ -0,0 +1,21 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include <layer.h>
+
+namespace rwkv {
+namespace _ncnn {
+// Returns the ncnn layer of a helper kernel (cast_dtype, scalar_div_) for
+// `key`, which identifies its type, params and dtype. The layer is created by
+// `create` (with its params and weights loaded) and gets its pipeline for
+// `opt` on the first call for `key` in the calling thread, and is reused by
+// later calls, so that a helper call only costs its forward. The cached
+// layers of a thread are dropped when the helper options change, i.e. when a
+// model is loaded.
+const ncnn::Layer *cached_helper_layer(
+    const std::string &key, const ncnn::Option &opt,
+    const std::function<ncnn::Layer *()> &create);
+} // namespace _ncnn
+} // namespace rwkv
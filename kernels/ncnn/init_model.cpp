@@ -1,13 +1,14 @@
 #include <fstream>
 #include <iostream>
 
-#include <cpu.h>
 #include <net.h>
 
 #include <kernels/kernels.h>
 #include <kernels/registry.h>
 #include <tensor.h>
 #include "extra.h"
+#include "layers.h"
+#include "options.h"
 #define private public
 #include <model.h>
 #undef private
@@ -17,17 +18,31 @@ namespace _ncnn {
 
 void init_model(Model *model, Device device, const std::string &path,
                 const std::string &strategy) {
-  // use all big cores
-  ncnn::set_cpu_powersave(2);
-  
   auto param_path = path + ".param";
   auto bin_path = path + ".bin";
 
+  bool input_is_token_id = false;
+  bool input_is_sequence = false;
+  bool input_is_batch = false;
+  {
+    // written by ncnn-meta with the graph, missing in older exports
+    std::ifstream config_file(path + ".config");
+    for (std::string line; std::getline(config_file, line);) {
+      if (line == "batch=1") {
+        input_is_batch = true;
+      }
+    }
+  }
   {
     auto n_layer = 0;
     std::ifstream param_file(param_path);
-    int i;
-    for (std::string line; std::getline(param_file, line); i++) {
+    for (std::string line; std::getline(param_file, line);) {
+      if (line.find("Embed ") == 0) {
+        input_is_token_id = true;
+      }
+      if (line.find("RWKVLastRow ") == 0) {
+        input_is_sequence = true;
+      }
       if (line.find("Input") == 0 && line.find("state_") != std::string::npos) {
         auto tmp = line.substr(line.find("state_"));
         auto name = tmp.substr(0, tmp.find(" "));
@@ -39,18 +54,9 @@ void init_model(Model *model, Device device, const std::string &path,
     model->_n_layer = n_layer;
   }
   auto net = std::make_shared<ncnn::Net>();
-  if (model->_act_dtype == DType::kFloat16) {
-    net->opt.use_fp16_packed = false;
-    net->opt.use_fp16_arithmetic = false;
-    net->opt.use_fp16_storage = false;
-    net->opt.use_bf16_storage = true;
-  } else {
-    RV_CHECK(model->_act_dtype == DType::kFloat32);
-    net->opt.use_fp16_packed = false;
-    net->opt.use_fp16_arithmetic = false;
-    net->opt.use_fp16_storage = false;
-    net->opt.use_bf16_storage = false;
-  }
+  net->opt = make_option(model->_act_dtype, model->_options);
+  set_helper_option(net->opt);
+  register_custom_layers(net.get());
   RV_CHECK(!net->load_param(param_path.c_str()));
   RV_CHECK(!net->load_model(bin_path.c_str()));
   int input_blob_id;
@@ -80,7 +86,11 @@ void init_model(Model *model, Device device, const std::string &path,
     }
   }
 
-  model->_extra = std::make_shared<NcnnExtra>(net, input_blob_id, state_ids, output_blob_id, output_state_ids);
+  auto extra = std::make_shared<NcnnExtra>(net, input_blob_id, state_ids, output_blob_id, output_state_ids);
+  extra->input_is_token_id = input_is_token_id;
+  extra->input_is_sequence = input_is_sequence;
+  extra->input_is_batch = input_is_batch;
+  model->_extra = extra;
 }
 
 KernelRegister init_model_reg("init_model", Device::kNCNN, init_model);
@@ -0,0 +1,256 @@
+#include "layers.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <layer.h>
+
+namespace rwkv {
+namespace _ncnn {
+
+namespace {
+
+inline float sigmoid(float x) { return 1.f / (1.f + std::exp(-x)); }
+
+// xx ([T, C] or [C]), sx -> sx_t + (xx_t - sx_t) * mix_i for each of the n
+// mixes, where sx_t is xx_{t-1} and sx_0 is `sx`. An extra output, if any,
+// is the last row of xx, i.e. sx of the next token.
+// In batch mode the rows of xx are independent sessions and sx_t is row t of
+// sx ([B, C]).
+// 0=c 1=n 2=batch, weights: n * c mixes
+class RWKVTimeMix : public ncnn::Layer {
+public:
+  RWKVTimeMix() { one_blob_only = false; }
+
+  int load_param(const ncnn::ParamDict &pd) override {
+    c = pd.get(0, 0);
+    n = pd.get(1, 0);
+    batch = pd.get(2, 0);
+    return 0;
+  }
+
+  int load_model(const ncnn::ModelBin &mb) override {
+    mix = mb.load(c * n, 1);
+    return mix.empty() ? -100 : 0;
+  }
+
+  int forward(const std::vector<ncnn::Mat> &bottom_blobs,
+              std::vector<ncnn::Mat> &top_blobs,
+              const ncnn::Option &opt) const override {
+    const ncnn::Mat &xx_mat = bottom_blobs[0];
+    int t_num = xx_mat.total() / c;
+    if (bottom_blobs[1].total() != (batch ? xx_mat.total() : c)) {
+      return -1;
+    }
+    const float *xx = xx_mat;
+    const float *sx = bottom_blobs[1];
+    const float *mix_ptr = mix;
+    for (int i = 0; i < n; i++) {
+      top_blobs[i].create_like(xx_mat, opt.blob_allocator);
+      if (top_blobs[i].empty()) {
+        return -100;
+      }
+      const float *m = mix_ptr + i * c;
+      float *out = top_blobs[i];
+      // one token has only c elements, so the tokens and channels are split
+      // together
+      const int size = t_num * c;
+      #pragma omp parallel for num_threads(opt.num_threads)
+      for (int idx = 0; idx < size; idx++) {
+        int t = idx / c;
+        int j = idx - t * c;
+        const float *sx_t = batch ? sx + t * c : t == 0 ? sx : xx + (t - 1) * c;
+        out[idx] = sx_t[j] + (xx[idx] - sx_t[j]) * m[j];
+      }
+    }
+    if (top_blobs.size() > static_cast<size_t>(n)) {
+      top_blobs[n].create(c, 4u, opt.blob_allocator);
+      if (top_blobs[n].empty()) {
+        return -100;
+      }
+      std::copy_n(xx + (t_num - 1) * c, c,
+                  static_cast<float *>(top_blobs[n]));
+    }
+    return 0;
+  }
+
+private:
+  int c;
+  int n;
+  int batch;
+  ncnn::Mat mix;
+};
+
+// k, v, r ([T, C] or [C]), aa, bb, pp -> sigmoid(r) * wkv of every token and
+// aa, bb, pp after the last one.
+// In batch mode the rows are independent sessions, each with its row of the
+// [B, C] aa, bb and pp.
+// 0=c 1=batch, weights: time_first, time_decay
+class RWKVWkv : public ncnn::Layer {
+public:
+  RWKVWkv() { one_blob_only = false; }
+
+  int load_param(const ncnn::ParamDict &pd) override {
+    c = pd.get(0, 0);
+    batch = pd.get(1, 0);
+    return 0;
+  }
+
+  int load_model(const ncnn::ModelBin &mb) override {
+    time_first = mb.load(c, 1);
+    time_decay = mb.load(c, 1);
+    return time_first.empty() || time_decay.empty() ? -100 : 0;
+  }
+
+  int forward(const std::vector<ncnn::Mat> &bottom_blobs,
+              std::vector<ncnn::Mat> &top_blobs,
+              const ncnn::Option &opt) const override {
+    int t_num = bottom_blobs[0].total() / c;
+    top_blobs[0].create_like(bottom_blobs[0], opt.blob_allocator);
+    for (int i = 1; i < 4; i++) {
+      top_blobs[i].create_like(bottom_blobs[i + 2], opt.blob_allocator);
+    }
+    for (auto &top : top_blobs) {
+      if (top.empty()) {
+        return -100;
+      }
+    }
+    int state_size = bottom_blobs[3].total();
+    if (state_size != (batch ? t_num * c : c)) {
+      return -1;
+    }
+    std::copy_n(static_cast<const float *>(bottom_blobs[3]), state_size,
+                static_cast<float *>(top_blobs[1]));
+    std::copy_n(static_cast<const float *>(bottom_blobs[4]), state_size,
+                static_cast<float *>(top_blobs[2]));
+    std::copy_n(static_cast<const float *>(bottom_blobs[5]), state_size,
+                static_cast<float *>(top_blobs[3]));
+    const float *u = time_first;
+    const float *w = time_decay;
+    // the channels are independent, only the tokens of a channel are
+    // sequential
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int i = 0; i < c; i++) {
+      for (int t = 0; t < t_num; t++) {
+        const float *k = static_cast<const float *>(bottom_blobs[0]) + t * c;
+        const float *v = static_cast<const float *>(bottom_blobs[1]) + t * c;
+        const float *r = static_cast<const float *>(bottom_blobs[2]) + t * c;
+        float *out = static_cast<float *>(top_blobs[0]) + t * c;
+        int state_offset = batch ? t * c : 0;
+        float *new_aa = static_cast<float *>(top_blobs[1]) + state_offset;
+        float *new_bb = static_cast<float *>(top_blobs[2]) + state_offset;
+        float *new_pp = static_cast<float *>(top_blobs[3]) + state_offset;
+        float aa = new_aa[i];
+        float bb = new_bb[i];
+        float pp = new_pp[i];
+        float ww = u[i] + k[i];
+        float p = std::max(pp, ww);
+        float e1 = std::exp(pp - p);
+        float e2 = std::exp(ww - p);
+        out[i] = sigmoid(r[i]) * (e1 * aa + e2 * v[i]) / (e1 * bb + e2);
+
+        ww = w[i] + pp;
+        p = std::max(ww, k[i]);
+        e1 = std::exp(ww - p);
+        e2 = std::exp(k[i] - p);
+        new_aa[i] = e1 * aa + e2 * v[i];
+        new_bb[i] = e1 * bb + e2;
+        new_pp[i] = p;
+      }
+    }
+    return 0;
+  }
+
+private:
+  int c;
+  int batch;
+  ncnn::Mat time_first;
+  ncnn::Mat time_decay;
+};
+
+// x -> relu(x)^2
+class RWKVReluSquare : public ncnn::Layer {
+public:
+  RWKVReluSquare() { one_blob_only = true; }
+
+  int forward(const ncnn::Mat &bottom_blob, ncnn::Mat &top_blob,
+              const ncnn::Option &opt) const override {
+    int size = bottom_blob.total();
+    top_blob.create_like(bottom_blob, opt.blob_allocator);
+    if (top_blob.empty()) {
+      return -100;
+    }
+    const float *x = bottom_blob;
+    float *y = top_blob;
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int i = 0; i < size; i++) {
+      float t = std::max(x[i], 0.f);
+      y[i] = t * t;
+    }
+    return 0;
+  }
+};
+
+// x, r, y -> x + sigmoid(r) * y
+class RWKVGatedResidual : public ncnn::Layer {
+public:
+  RWKVGatedResidual() { one_blob_only = false; }
+
+  int forward(const std::vector<ncnn::Mat> &bottom_blobs,
+              std::vector<ncnn::Mat> &top_blobs,
+              const ncnn::Option &opt) const override {
+    int size = bottom_blobs[0].total();
+    top_blobs[0].create_like(bottom_blobs[0], opt.blob_allocator);
+    if (top_blobs[0].empty()) {
+      return -100;
+    }
+    const float *x = bottom_blobs[0];
+    const float *r = bottom_blobs[1];
+    const float *y = bottom_blobs[2];
+    float *out = top_blobs[0];
+    #pragma omp parallel for num_threads(opt.num_threads)
+    for (int i = 0; i < size; i++) {
+      out[i] = x[i] + sigmoid(r[i]) * y[i];
+    }
+    return 0;
+  }
+};
+
+// [T, C] -> the last row
+class RWKVLastRow : public ncnn::Layer {
+public:
+  RWKVLastRow() { one_blob_only = true; }
+
+  int forward(const ncnn::Mat &bottom_blob, ncnn::Mat &top_blob,
+              const ncnn::Option &opt) const override {
+    int c = bottom_blob.w;
+    top_blob.create(c, 4u, opt.blob_allocator);
+    if (top_blob.empty()) {
+      return -100;
+    }
+    const float *x = bottom_blob;
+    std::copy_n(x + (bottom_blob.total() / c - 1) * c, c,
+                static_cast<float *>(top_blob));
+    return 0;
+  }
+};
+
+DEFINE_LAYER_CREATOR(RWKVTimeMix)
+DEFINE_LAYER_CREATOR(RWKVWkv)
+DEFINE_LAYER_CREATOR(RWKVReluSquare)
+DEFINE_LAYER_CREATOR(RWKVGatedResidual)
+DEFINE_LAYER_CREATOR(RWKVLastRow)
+
+} // namespace
+
+void register_custom_layers(ncnn::Net *net) {
+  net->register_custom_layer("RWKVTimeMix", RWKVTimeMix_layer_creator);
+  net->register_custom_layer("RWKVWkv", RWKVWkv_layer_creator);
+  net->register_custom_layer("RWKVReluSquare", RWKVReluSquare_layer_creator);
+  net->register_custom_layer("RWKVGatedResidual",
+                             RWKVGatedResidual_layer_creator);
+  net->register_custom_layer("RWKVLastRow", RWKVLastRow_layer_creator);
+}
+
+} // namespace _ncnn
+} // namespace rwkv
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <net.h>
+
+namespace rwkv {
+namespace _ncnn {
+// Registers the fused RWKV layers emitted by ncnn-meta (RWKVTimeMix,
+// RWKVWkv, RWKVReluSquare, RWKVGatedResidual and RWKVLastRow). It must be
+// called before the param file is loaded. The activations of their inputs
+// are [T, C] for T tokens, or [C].
+void register_custom_layers(ncnn::Net *net);
+} // namespace _ncnn
+} // namespace rwkv
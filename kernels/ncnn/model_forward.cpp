@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
@@ -14,53 +15,199 @@
 namespace rwkv {
 namespace _ncnn {
 
-Tensor ModelForward(const Model *model, Device device, int id,
-                    std::vector<std::vector<Tensor>> &states) {
+namespace {
+// a view of `shape` at `data`, in the buffer of `mat`, which keeps the buffer
+// of `mat` (and its allocator) alive
+Tensor view_of(const ncnn::Mat &mat, const float *data, const Shape &shape,
+               const std::shared_ptr<ncnn::PoolAllocator> &allocator) {
+  RV_CHECK(mat.c == 1 && mat.d == 1);
+  RV_CHECK(mat.elemsize == sizeof(float));
+  if (mat.refcount == nullptr) {
+    // not allocated by ncnn (e.g. an input blob modified inplace), the
+    // buffer is not ours to keep
+    return Copy(Tensor::FromPtr(const_cast<float *>(data), shape,
+                                DType::kFloat32, Device::kCPU),
+                Device::kCPU, true);
+  }
+  auto owner = std::shared_ptr<ncnn::Mat>(
+      new ncnn::Mat(mat), [allocator](ncnn::Mat *p) { delete p; });
+  return Tensor::FromPtr(const_cast<float *>(data), shape, DType::kFloat32,
+                         Device::kCPU, owner);
+}
 
-  auto &extra = *std::any_cast<std::shared_ptr<NcnnExtra>>(model->_extra);
-  auto &net = *extra.net;
+Tensor view_of(const ncnn::Mat &mat,
+               const std::shared_ptr<ncnn::PoolAllocator> &allocator) {
+  RV_CHECK(mat.h == 1);
+  return view_of(mat, mat, {mat.w}, allocator);
+}
+
+// A workspace allocator of `extra` owned by one forward
+class Workspace {
+public:
+  explicit Workspace(NcnnExtra &extra) : _extra(extra) {
+    std::lock_guard<std::mutex> lock(extra.workspaces_mutex);
+    if (extra.free_workspaces.empty()) {
+      _allocator = std::make_unique<ncnn::UnlockedPoolAllocator>();
+    } else {
+      _allocator = std::move(extra.free_workspaces.back());
+      extra.free_workspaces.pop_back();
+    }
+  }
+  ~Workspace() {
+    std::lock_guard<std::mutex> lock(_extra.workspaces_mutex);
+    _extra.free_workspaces.push_back(std::move(_allocator));
+  }
+  Workspace(const Workspace &) = delete;
+  Workspace &operator=(const Workspace &) = delete;
+
+  ncnn::Allocator *get() const { return _allocator.get(); }
+
+private:
+  NcnnExtra &_extra;
+  std::unique_ptr<ncnn::UnlockedPoolAllocator> _allocator;
+};
+
+// NOTE: ncnn has no way to reset an Extractor for the next input, so a new
+// one is created per forward. It only holds the blob list, all buffers come
+// from the persistent pools in `extra`. Extractors of one net can run
+// concurrently.
+ncnn::Extractor create_extractor(NcnnExtra &extra,
+                                 const Workspace &workspace) {
+  ncnn::Extractor ex = extra.net->create_extractor();
+  ex.set_blob_allocator(extra.blob_allocator.get());
+  ex.set_workspace_allocator(workspace.get());
+  return ex;
+}
+
+// Runs the `n` tokens in `ids` at once if the model takes sequences, else
+// `n` must be 1
+Tensor forward(NcnnExtra &extra, const int *ids, int n,
+               std::vector<std::vector<Tensor>> &states) {
   auto input_blob_id = extra.input_blob_id;
   auto &state_ids = extra.state_ids;
   auto output_blob_id = extra.output_blob_id;
   auto &output_state_ids = extra.output_state_ids;
-  ncnn::Extractor ex = net.create_extractor();
+  Workspace workspace(extra);
+  ncnn::Extractor ex = create_extractor(extra, workspace);
   ncnn::Mat input;
-  // In ncnn model we generated, blob with id `n` is the embedding weights for
-  // token with id `n`
-  ex.extract(id, input);
+  if (extra.input_is_token_id) {
+    input.create(n, sizeof(int), extra.blob_allocator.get());
+    std::copy_n(ids, n, static_cast<int *>(input.data));
+  } else {
+    // In ncnn models exported without an Embed layer, blob with id `n` is
+    // the embedding weights for token with id `n`
+    RV_CHECK(n == 1);
+    ex.extract(ids[0], input);
+  }
   ex.input(input_blob_id, input);
   RV_CHECK(!states.empty());
+  // the initial states of fp16 models are partly fp16, and the layers take
+  // fp32 blobs. The casts are kept alive until the extracts below.
+  std::vector<Tensor> input_states;
   for (int i = 0; i < states.size(); i++) {
     for (int j = 0; j < states[i].size(); j++) {
-      auto &state_tensor = states[i][j];
+      auto state_tensor = cast_dtype(states[i][j], DType::kFloat32);
       RV_CHECK(state_tensor.shape().size() == 1);
       RV_CHECK(state_tensor.device() == Device::kCPU);
       ncnn::Mat state_mat(state_tensor.numel(), state_tensor.data_ptr(),
                           state_tensor.elem_size());
       ex.input(state_ids[i][j], state_mat);
+      input_states.push_back(state_tensor);
     }
   }
   ncnn::Mat output;
   ex.extract(output_blob_id, output);
+  // the output states are not copied, they become the input states of the
+  // next token, and the buffers of the current input states go back to the
+  // pool once they are replaced here
   for (int i = 0; i < states.size(); i++) {
     for (int j = 0; j < states[i].size(); j++) {
       ncnn::Mat output_state;
       ex.extract(output_state_ids[i][j], output_state);
-      auto output_state_tensor =
-          Copy(Tensor::FromPtr(output_state.data, {output_state.w},
-                               DType::kFloat32, Device::kCPU),
-               Device::kCPU, true);
-      states[i][j] = output_state_tensor;
+      states[i][j] = view_of(output_state, extra.blob_allocator);
+    }
+  }
+  return view_of(output, extra.blob_allocator);
+}
+} // namespace
+
+Tensor ModelForward(const Model *model, Device device, int id,
+                    std::vector<std::vector<Tensor>> &states) {
+  auto &extra = *std::any_cast<std::shared_ptr<NcnnExtra>>(model->_extra);
+  return forward(extra, &id, 1, states);
+}
+
+Tensor ModelForwardSeq(const Model *model, Device device,
+                       const std::vector<int> &ids,
+                       std::vector<std::vector<Tensor>> &states) {
+  RV_CHECK(!ids.empty());
+  auto &extra = *std::any_cast<std::shared_ptr<NcnnExtra>>(model->_extra);
+  // the [T, C] activations (and [T, 4C] in ffn) of a long prompt are
+  // bounded by running it in chunks
+  const int max_chunk_size = extra.input_is_sequence ? 128 : 1;
+  for (int begin = 0;; begin += max_chunk_size) {
+    int n = std::min<int>(max_chunk_size, ids.size() - begin);
+    auto output = forward(extra, ids.data() + begin, n, states);
+    if (begin + n == static_cast<int>(ids.size())) {
+      return output;
+    }
+  }
+}
+
+Tensor ModelForwardBatch(
+    const Model *model, Device device, const std::vector<int> &ids,
+    const std::vector<std::vector<std::vector<Tensor>> *> &states) {
+  auto &extra = *std::any_cast<std::shared_ptr<NcnnExtra>>(model->_extra);
+  RV_CHECK(extra.input_is_batch);
+  RV_CHECK(!ids.empty() && ids.size() == states.size());
+  const int batch_size = ids.size();
+  const int n_embd = model->_n_embd;
+  Workspace workspace(extra);
+  ncnn::Extractor ex = create_extractor(extra, workspace);
+  ncnn::Mat input;
+  input.create(batch_size, sizeof(int), extra.blob_allocator.get());
+  std::copy_n(ids.data(), batch_size, static_cast<int *>(input.data));
+  ex.input(extra.input_blob_id, input);
+  // gather the states of all sessions into [B, C] blobs
+  for (int i = 0; i < extra.state_ids.size(); i++) {
+    for (int j = 0; j < extra.state_ids[i].size(); j++) {
+      ncnn::Mat state_mat;
+      state_mat.create(n_embd, batch_size, 4u, extra.blob_allocator.get());
+      for (int b = 0; b < batch_size; b++) {
+        // the initial states of fp16 models are partly fp16
+        auto state_tensor = cast_dtype((*states[b])[i][j], DType::kFloat32);
+        RV_CHECK(state_tensor.numel() == n_embd);
+        RV_CHECK(state_tensor.device() == Device::kCPU);
+        std::copy_n(state_tensor.data_ptr<float>(), n_embd,
+                    state_mat.row(b));
+      }
+      ex.input(extra.state_ids[i][j], state_mat);
+    }
+  }
+  ncnn::Mat output;
+  ex.extract(extra.output_blob_id, output);
+  // and scatter the output states back, as views of the rows of the [B, C]
+  // output blobs
+  for (int i = 0; i < extra.output_state_ids.size(); i++) {
+    for (int j = 0; j < extra.output_state_ids[i].size(); j++) {
+      ncnn::Mat output_state;
+      ex.extract(extra.output_state_ids[i][j], output_state);
+      RV_CHECK(output_state.w == n_embd && output_state.h == batch_size);
+      for (int b = 0; b < batch_size; b++) {
+        (*states[b])[i][j] = view_of(output_state, output_state.row(b),
+                                     {n_embd}, extra.blob_allocator);
+      }
     }
   }
-  RV_CHECK(output.c == 1 && output.d == 1 && output.h == 1);
-  auto ret = Copy(
-      Tensor::FromPtr(output.data, {output.w}, DType::kFloat32, Device::kCPU),
-      Device::kCPU, true);
-  return ret;
+  RV_CHECK(output.h == batch_size);
+  return view_of(output, output, {batch_size, output.w}, extra.blob_allocator);
 }
 
 KernelRegister model_forward_reg("model_forward", Device::kNCNN, ModelForward);
+KernelRegister model_forward_seq_reg("model_forward_seq", Device::kNCNN,
+                                     ModelForwardSeq);
+KernelRegister model_forward_batch_reg("model_forward_batch", Device::kNCNN,
+                                       ModelForwardBatch);
 
 } // namespace _ncnn
 } // namespace rwkv
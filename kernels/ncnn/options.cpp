@@ -0,0 +1,80 @@
+#include "options.h"
+
+#include <atomic>
+#include <mutex>
+
+#include <cpu.h>
+
+#include <check.h>
+
+namespace rwkv {
+namespace _ncnn {
+
+namespace {
+int get_int(const std::map<std::string, std::string> &options,
+            const std::string &key, int default_value) {
+  auto it = options.find(key);
+  return it == options.end() ? default_value : std::stoi(it->second);
+}
+
+bool get_bool(const std::map<std::string, std::string> &options,
+              const std::string &key, bool default_value) {
+  int value = get_int(options, key, default_value);
+  RV_CHECK(value == 0 || value == 1);
+  return value;
+}
+
+// guards helper_opt, which is set by model loads while kernels of other
+// models copy it
+std::mutex helper_option_mutex;
+ncnn::Option helper_opt;
+std::atomic<int> option_version{0};
+} // namespace
+
+ncnn::Option make_option(DType act_dtype,
+                         const std::map<std::string, std::string> &options) {
+  RV_CHECK(act_dtype == DType::kFloat32 || act_dtype == DType::kFloat16);
+  int powersave = get_int(options, "powersave", 2);
+  RV_CHECK(powersave >= 0 && powersave <= 2);
+  ncnn::set_cpu_powersave(powersave);
+  int default_threads = powersave == 0   ? ncnn::get_cpu_count()
+                        : powersave == 1 ? ncnn::get_little_cpu_count()
+                                         : ncnn::get_big_cpu_count();
+
+  ncnn::Option opt;
+  opt.num_threads = get_int(options, "threads", default_threads);
+  RV_CHECK(opt.num_threads > 0);
+  opt.use_packing_layout = get_bool(options, "packing", true);
+  opt.lightmode = get_bool(options, "lightmode", true);
+  opt.use_winograd_convolution = get_bool(options, "winograd", true);
+  opt.use_sgemm_convolution = get_bool(options, "sgemm", true);
+
+  // The residual stream of the exported graphs is not rescaled and can
+  // overflow fp16 blobs, so fp16 is opt-in. fp16 models keep the fp32 range
+  // with bf16 storage by default instead. fp16 arithmetic is only used by
+  // ncnn on armv8.2+, other cpus only get the fp16 storage.
+  bool fp16 = get_bool(options, "fp16", false);
+  bool bf16 = get_bool(options, "bf16", act_dtype == DType::kFloat16 && !fp16);
+  RV_CHECK(!(fp16 && bf16));
+  opt.use_fp16_packed = fp16;
+  opt.use_fp16_storage = fp16;
+  opt.use_fp16_arithmetic = fp16 && ncnn::cpu_support_arm_asimdhp();
+  opt.use_bf16_storage = bf16;
+  return opt;
+}
+
+ncnn::Option helper_option() {
+  std::lock_guard<std::mutex> lock(helper_option_mutex);
+  return helper_opt;
+}
+
+void set_helper_option(const ncnn::Option &opt) {
+  std::lock_guard<std::mutex> lock(helper_option_mutex);
+  helper_opt = opt;
+  option_version++;
+}
+
+int helper_option_version() { return option_version.load(); }
+
+} // namespace _ncnn
+} // namespace rwkv
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include <net.h>
+
+#include <tensor.h>
+
+namespace rwkv {
+namespace _ncnn {
+// The ncnn options for a model with activations in `act_dtype`: defaults for
+// the host cpu, overridden by the `key=value` options of the strategy:
+//   threads=N       number of threads (default: the big cores, or all cores
+//                   with powersave=0)
+//   packing=0|1     packed (SIMD-width) blob layout (default 1)
+//   fp16=0|1        fp16 storage, and fp16 arithmetic on armv8.2+ (default 0)
+//   bf16=0|1        bf16 storage (default 1 for fp16 models if fp16=0)
+//   lightmode=0|1   release intermediate blobs early (default 1)
+//   winograd=0|1, sgemm=0|1
+//                   convolution algorithms (default 1)
+//   powersave=0|1|2 cores to run on: all, little or big (default 2), see
+//                   ncnn::set_cpu_powersave. It is global to the process and
+//                   is applied by `make_option`.
+ncnn::Option make_option(DType act_dtype,
+                         const std::map<std::string, std::string> &options);
+
+// The options of the last loaded model, used by the ncnn helper kernels
+// (cast_dtype, scalar_div_) which are not bound to a model. Returns a copy,
+// models may be loaded concurrently.
+ncnn::Option helper_option();
+void set_helper_option(const ncnn::Option &opt);
+// Incremented by `set_helper_option`, see cached_helper_layer
+int helper_option_version();
+} // namespace _ncnn
+} // namespace rwkv
@@ -1,52 +1,499 @@
+#include <kernels/onnx-meta/kernels.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <onnx/checker.h>
+#include <onnx/onnx_pb.h>
+
+#include <kernels/allocator.h>
+#include <kernels/kernels.h>
 #include <kernels/registry.h>
+#include <model.h>
 #include <tensor.h>
 
 namespace rwkv {
+namespace cpu {
+Tensor cast_dtype(const Tensor &x, DType dtype);
+}
 namespace onnxmeta {
 
-Tensor layernorm(const Tensor& x, const Tensor& weight, const Tensor& bias) {
-  return KernelRegistry::Instance().Get<decltype(layernorm)*>("layernorm", x.device())(x, weight, bias);
+// The graph runs one token: the token id and the states are inputs, the
+// logits and the new states are outputs. The activations are fp32.
+// Like ncnn-meta, ops whose operands are all constants (kCPU tensors) are
+// computed at export time, and a constant becomes an initializer only when a
+// node consumes it. The matmul weights are fp16 initializers followed by a
+// Cast (which onnxruntime folds at load time, so only the file is halved),
+// or int8 DequantizeLinear-ed initializers whose input goes through a
+// QuantizeLinear/DequantizeLinear pair (QDQ), which onnxruntime fuses into an
+// int8 matmul.
+onnx::ModelProto model;
+// name of a constant -> the constant, as written to the initializer
+std::map<std::string, Tensor> initializers;
+// blob name -> the graph output it is renamed to
+std::map<std::string, std::string> output_names;
+std::map<std::string, Shape> output_shapes;
+std::set<std::string> graph_input_names;
+// name of a weight -> max |x| of its input, for the weights exported as int8
+std::map<std::string, float> int8_input_absmax;
+std::string _path;
+
+// protobuf messages are limited to 2GB, so larger models keep their
+// initializers in an external data file next to the model
+constexpr size_t kMaxInlineInitializerBytes = 1ull << 30;
+
+void init(const std::string &path) {
+  _path = path;
+  model.Clear();
+  initializers.clear();
+  output_names.clear();
+  output_shapes.clear();
+  graph_input_names.clear();
+  int8_input_absmax.clear();
+}
+
+void set_int8_input_absmax(const std::map<std::string, float> &input_absmax) {
+  int8_input_absmax = input_absmax;
+}
+
+namespace {
+
+onnx::GraphProto &graph() { return *model.mutable_graph(); }
+
+int onnx_dtype(DType dtype) {
+  switch (dtype) {
+  case DType::kFloat32:
+    return onnx::TensorProto::FLOAT;
+  case DType::kFloat16:
+    return onnx::TensorProto::FLOAT16;
+  case DType::kInt8:
+    return onnx::TensorProto::INT8;
+  default:
+    RV_UNIMPLEMENTED();
+  }
+}
+
+void set_value_info(onnx::ValueInfoProto *info, const std::string &name,
+                    int elem_type, const Shape &shape) {
+  info->set_name(name);
+  auto *tensor_type = info->mutable_type()->mutable_tensor_type();
+  tensor_type->set_elem_type(elem_type);
+  // an empty shape is a scalar
+  auto *onnx_shape = tensor_type->mutable_shape();
+  for (auto dim : shape) {
+    onnx_shape->add_dim()->set_dim_value(dim);
+  }
+}
+
+onnx::NodeProto *add_node(const std::string &op_type,
+                          const std::vector<std::string> &inputs,
+                          const std::vector<std::string> &outputs) {
+  auto *node = graph().add_node();
+  node->set_op_type(op_type);
+  node->set_name(op_type + "_" + std::to_string(graph().node_size()));
+  for (auto &input : inputs) {
+    node->add_input(input);
+  }
+  for (auto &output : outputs) {
+    node->add_output(output);
+  }
+  return node;
+}
+
+void set_attribute(onnx::NodeProto *node, const std::string &name,
+                   int64_t value) {
+  auto *attr = node->add_attribute();
+  attr->set_name(name);
+  attr->set_type(onnx::AttributeProto::INT);
+  attr->set_i(value);
+}
+
+void set_attribute(onnx::NodeProto *node, const std::string &name,
+                   float value) {
+  auto *attr = node->add_attribute();
+  attr->set_name(name);
+  attr->set_type(onnx::AttributeProto::FLOAT);
+  attr->set_f(value);
+}
+
+bool is_constant(const Tensor &x) { return x.device() == Device::kCPU; }
+
+Tensor to_fp32(const Tensor &x) {
+  return x.dtype() == DType::kFloat32 ? x
+                                      : cpu::cast_dtype(x, DType::kFloat32);
+}
+
+// `f` applied elementwise on constants, with broadcasting of single elements
+Tensor fold(const Tensor &x, const Tensor &y,
+            const std::function<float(float, float)> &f) {
+  auto x32 = to_fp32(x);
+  auto y32 = to_fp32(y);
+  RV_CHECK(x32.numel() == y32.numel() || x32.numel() == 1 ||
+           y32.numel() == 1);
+  auto &shape = x32.numel() >= y32.numel() ? x32.shape() : y32.shape();
+  auto output = Tensor::Empty(shape, DType::kFloat32, Device::kCPU);
+  auto *x_ptr = x32.data_ptr<float>();
+  auto *y_ptr = y32.data_ptr<float>();
+  auto *out_ptr = output.data_ptr<float>();
+  int64_t x_stride = x32.numel() == 1 ? 0 : 1;
+  int64_t y_stride = y32.numel() == 1 ? 0 : 1;
+  for (int64_t i = 0; i < output.numel(); i++) {
+    out_ptr[i] = f(x_ptr[i * x_stride], y_ptr[i * y_stride]);
+  }
+  return output;
+}
+
+Tensor fold(const Tensor &x, const std::function<float(float)> &f) {
+  return fold(x, x, [&](float a, float) { return f(a); });
+}
+
+// the name of the initializer of constant `x`, stored as is
+std::string add_initializer(const Tensor &x, const std::string &name) {
+  RV_CHECK(is_constant(x));
+  initializers.emplace(name, x);
+  return name;
+}
+
+Tensor constant(const Tensor &x) {
+  auto output = Tensor::Empty(x.shape(), DType::kFloat32, Device::kONNXMeta);
+  output.name = add_initializer(to_fp32(x), x.name);
+  return output;
+}
+
+// the name `x` is consumed by, constants are fp32 initializers
+std::string input_name(const Tensor &x) {
+  if (is_constant(x)) {
+    return constant(x).name;
+  }
+  RV_CHECK(x.device() == Device::kONNXMeta);
+  return x.name;
 }
 
-Tensor matmul(const Tensor& a, const Tensor& b) {
-  return KernelRegistry::Instance().Get<decltype(matmul)*>("matmul", a.device())(a, b);
+Tensor add_op(const std::string &op_type, const std::vector<Tensor> &inputs,
+              const Shape &output_shape,
+              const std::function<void(onnx::NodeProto *)> &set_attributes =
+                  nullptr) {
+  auto output =
+      Tensor::Empty(output_shape, DType::kFloat32, Device::kONNXMeta);
+  std::vector<std::string> input_names;
+  for (auto &input : inputs) {
+    input_names.push_back(input_name(input));
+  }
+  auto *node = add_node(op_type, input_names, {output.name});
+  if (set_attributes) {
+    set_attributes(node);
+  }
+  return output;
 }
 
-Tensor add(const Tensor& x, const Tensor& y) {
-  return KernelRegistry::Instance().Get<decltype(add)*>("add", x.device())(x, y);
+// a rank-0 constant
+Tensor scalar(float x) {
+  auto output = Tensor::Empty({}, DType::kFloat32, Device::kCPU);
+  output.data_ptr<float>()[0] = x;
+  return output;
 }
 
-Tensor rsub_scalar(float x, const Tensor& y) {
-  return KernelRegistry::Instance().Get<Tensor(*)(float, const Tensor&)>("rsub_scalar", y.device())(x, y);
+} // namespace
+
+Tensor add_input(const Shape &shape, const std::string &name) {
+  set_value_info(graph().add_input(), name, onnx::TensorProto::FLOAT, shape);
+  graph_input_names.insert(name);
+  auto output = Tensor::Empty(shape, DType::kFloat32, Device::kONNXMeta);
+  output.name = name;
+  return output;
 }
 
-Tensor sub(const Tensor& x, const Tensor& y) {
-  return KernelRegistry::Instance().Get<Tensor(*)(const Tensor&, const Tensor&)>("sub", y.device())(x, y);
+Tensor embedding(const std::vector<Tensor> &weights,
+                 const std::string &input_name) {
+  RV_CHECK(!weights.empty());
+  int64_t n_embd = weights[0].numel();
+  int64_t n_vocab = weights.size();
+  set_value_info(graph().add_input(), input_name, onnx::TensorProto::INT64,
+                 {});
+  graph_input_names.insert(input_name);
+
+  auto table =
+      Tensor::Empty({n_vocab, n_embd}, DType::kFloat16, Device::kCPU);
+  for (int64_t i = 0; i < n_vocab; i++) {
+    RV_CHECK(weights[i].numel() == n_embd);
+    auto row = cpu::cast_dtype(weights[i], DType::kFloat16);
+    memcpy(table.data_ptr<float16>() + i * n_embd, row.data_ptr(),
+           n_embd * sizeof(float16));
+  }
+  // only the gathered row is cast to fp32
+  auto row = Tensor::Empty({n_embd}, DType::kFloat16, Device::kONNXMeta);
+  set_attribute(add_node("Gather",
+                         {add_initializer(table, "emb.weight"), input_name},
+                         {row.name}),
+                "axis", static_cast<int64_t>(0));
+  auto output = Tensor::Empty({n_embd}, DType::kFloat32, Device::kONNXMeta);
+  set_attribute(add_node("Cast", {row.name}, {output.name}), "to",
+                static_cast<int64_t>(onnx::TensorProto::FLOAT));
+  return output;
 }
 
-Tensor mul(const Tensor& x, const Tensor& y) {
-  return KernelRegistry::Instance().Get<decltype(mul)*>("mul", x.device())(x, y);
+Tensor layernorm(const Tensor &x, const Tensor &weight, const Tensor &bias) {
+  return add_op("LayerNormalization", {x, weight, bias}, x.shape(),
+                [](onnx::NodeProto *node) {
+                  set_attribute(node, "axis", static_cast<int64_t>(-1));
+                  set_attribute(node, "epsilon", 1e-5f);
+                });
 }
 
-Tensor div(const Tensor& x, const Tensor& y) {
-  return KernelRegistry::Instance().Get<decltype(div)*>("div", x.device())(x, y);
+Tensor matmul(const Tensor &a, const Tensor &b) {
+  RV_CHECK(a.device() == Device::kONNXMeta);
+  RV_CHECK(b.shape().size() == 2);
+  Shape output_shape = a.shape();
+  output_shape.back() = b.shape()[1];
+  if (!is_constant(b)) {
+    return add_op("MatMul", {a, b}, output_shape);
+  }
+  // the weights are [K, N]
+  int64_t k = b.shape()[0];
+  int64_t n = b.shape()[1];
+  auto weight =
+      Tensor::Empty({k, n}, DType::kFloat32, Device::kONNXMeta);
+  auto it = int8_input_absmax.find(b.name);
+  if (it == int8_input_absmax.end()) {
+    auto weight_fp16 = add_initializer(
+        b.dtype() == DType::kFloat16 ? b : cpu::cast_dtype(b, DType::kFloat16),
+        b.name);
+    set_attribute(add_node("Cast", {weight_fp16}, {weight.name}), "to",
+                  static_cast<int64_t>(onnx::TensorProto::FLOAT));
+    return add_op("MatMul", {a, weight}, output_shape);
+  }
+  // symmetric int8 with one scale per output column, x = x_q * scale
+  auto b32 = to_fp32(b);
+  auto *b_ptr = b32.data_ptr<float>();
+  auto weight_q = Tensor::Empty({k, n}, DType::kInt8, Device::kCPU);
+  auto weight_scales = Tensor::Empty({n}, DType::kFloat32, Device::kCPU);
+  auto weight_zero_points = Tensor::Empty({n}, DType::kInt8, Device::kCPU);
+  auto *w_ptr = weight_q.data_ptr<int8_t>();
+  auto *scale_ptr = weight_scales.data_ptr<float>();
+  std::fill_n(weight_zero_points.data_ptr<int8_t>(), n, 0);
+  for (int64_t j = 0; j < n; j++) {
+    float absmax = 0;
+    for (int64_t i = 0; i < k; i++) {
+      absmax = std::max(absmax, std::abs(b_ptr[i * n + j]));
+    }
+    scale_ptr[j] = absmax == 0 ? 1.f : absmax / 127.f;
+    for (int64_t i = 0; i < k; i++) {
+      float q = std::round(b_ptr[i * n + j] / scale_ptr[j]);
+      w_ptr[i * n + j] = static_cast<int8_t>(std::clamp(q, -127.f, 127.f));
+    }
+  }
+  set_attribute(add_node("DequantizeLinear",
+                         {add_initializer(weight_q, b.name),
+                          add_initializer(weight_scales, b.name + ".scale"),
+                          add_initializer(weight_zero_points,
+                                          b.name + ".zero_point")},
+                         {weight.name}),
+                "axis", static_cast<int64_t>(1));
+
+  auto input_scale = scalar(it->second == 0 ? 1.f : it->second / 127.f);
+  auto input_zero_point = Tensor::Empty({}, DType::kInt8, Device::kCPU);
+  input_zero_point.data_ptr<int8_t>()[0] = 0;
+  auto input_scale_name =
+      add_initializer(input_scale, b.name + ".input_scale");
+  auto input_zero_point_name =
+      add_initializer(input_zero_point, b.name + ".input_zero_point");
+  auto a_q = Tensor::Empty(a.shape(), DType::kInt8, Device::kONNXMeta);
+  add_node("QuantizeLinear",
+           {a.name, input_scale_name, input_zero_point_name}, {a_q.name});
+  auto a_dq = Tensor::Empty(a.shape(), DType::kFloat32, Device::kONNXMeta);
+  add_node("DequantizeLinear",
+           {a_q.name, input_scale_name, input_zero_point_name}, {a_dq.name});
+  return add_op("MatMul", {a_dq, weight}, output_shape);
 }
 
-Tensor exp(const Tensor& x) {
-  return KernelRegistry::Instance().Get<decltype(exp)*>("exp", x.device())(x);
+#define BINARYOP(op_name, node_type, expr)                                     \
+  Tensor op_name(const Tensor &x, const Tensor &y) {                           \
+    if (is_constant(x) && is_constant(y)) {                                    \
+      return fold(x, y, [](float a, float b) { return expr; });                \
+    }                                                                          \
+    auto &shape = x.numel() >= y.numel() ? x.shape() : y.shape();              \
+    return add_op(node_type, {x, y}, shape);                                   \
+  }
+
+BINARYOP(add, "Add", a + b);
+BINARYOP(sub, "Sub", a - b);
+BINARYOP(mul, "Mul", a * b);
+BINARYOP(div, "Div", a / b);
+BINARYOP(maximum, "Max", std::max(a, b));
+
+Tensor rsub_scalar(float x, const Tensor &y) {
+  if (is_constant(y)) {
+    return fold(y, [x](float a) { return x - a; });
+  }
+  return add_op("Sub", {scalar(x), y}, y.shape());
 }
 
-Tensor relu(const Tensor& x) {
-  return KernelRegistry::Instance().Get<decltype(relu)*>("relu", x.device())(x);
+#define UNARYOP(op_name, node_type, expr)                                      \
+  Tensor op_name(const Tensor &x) {                                            \
+    if (is_constant(x)) {                                                      \
+      return fold(x, [](float a) { return expr; });                            \
+    }                                                                          \
+    return add_op(node_type, {x}, x.shape());                                  \
+  }
+
+UNARYOP(exp, "Exp", std::exp(a));
+UNARYOP(relu, "Relu", std::max(a, 0.f));
+UNARYOP(sigmoid, "Sigmoid", 1.f / (1.f + std::exp(-a)));
+
+Tensor mark_as_output(const Tensor &x, const std::string &name) {
+  RV_CHECK(output_shapes.count(name) == 0);
+  output_shapes[name] = x.shape();
+  auto source = input_name(x);
+  if (is_constant(x) || graph_input_names.count(source) ||
+      output_names.count(source)) {
+    // graph inputs and initializers can't be renamed, and a node output can
+    // only be renamed once
+    add_node("Identity", {source}, {name});
+  } else {
+    output_names[source] = name;
+  }
+  return x;
 }
 
-Tensor sigmoid(const Tensor& x) {
-  return KernelRegistry::Instance().Get<decltype(sigmoid)*>("sigmoid", x.device())(x);
+Tensor ModelForward(const Model *model, Device device, int id,
+                    std::vector<std::vector<Tensor>> &states) {
+  auto x = embedding(model->_embd_weights, "input");
+  for (int i = 0; i < states.size(); i++) {
+    for (int j = 0; j < states[i].size(); j++) {
+      states[i][j] =
+          add_input(states[i][j].shape(), "state_" + std::to_string(i) + "_" +
+                                              std::to_string(j));
+    }
+  }
+  return ModelForwardHidden(model, device, x, states);
 }
 
-Tensor maximum(const Tensor& x, const Tensor& y) {
-  return KernelRegistry::Instance().Get<decltype(maximum)*>("maximum", x.device())(x, y);
+void destroy() {
+  model.set_ir_version(8);
+  model.set_producer_name("faster-rwkv");
+  auto *opset = model.add_opset_import();
+  opset->set_domain("");
+  // LayerNormalization
+  opset->set_version(17);
+  graph().set_name("rwkv");
+
+  std::set<std::string> used;
+  for (auto &node : *graph().mutable_node()) {
+    for (auto &input : *node.mutable_input()) {
+      used.insert(input);
+      auto it = output_names.find(input);
+      if (it != output_names.end()) {
+        input = it->second;
+      }
+    }
+    for (auto &output : *node.mutable_output()) {
+      auto it = output_names.find(output);
+      if (it != output_names.end()) {
+        output = it->second;
+      }
+    }
+  }
+  for (auto &[name, shape] : output_shapes) {
+    set_value_info(graph().add_output(), name, onnx::TensorProto::FLOAT,
+                   shape);
+  }
+
+  size_t initializer_bytes = 0;
+  for (auto &[name, tensor] : initializers) {
+    if (used.count(name)) {
+      initializer_bytes += tensor.numel() * tensor.elem_size();
+    }
+  }
+  bool external = initializer_bytes > kMaxInlineInitializerBytes;
+  auto data_path = _path + ".data";
+  std::ofstream data_file;
+  if (external) {
+    data_file.open(data_path, std::ios::binary);
+    RV_CHECK(data_file.good());
+  }
+  size_t offset = 0;
+  for (auto &[name, tensor] : initializers) {
+    if (!used.count(name)) {
+      continue;
+    }
+    auto *initializer = graph().add_initializer();
+    initializer->set_name(name);
+    initializer->set_data_type(onnx_dtype(tensor.dtype()));
+    for (auto dim : tensor.shape()) {
+      initializer->add_dims(dim);
+    }
+    size_t nbytes = tensor.numel() * tensor.elem_size();
+    auto *data = static_cast<const char *>(tensor.data_ptr());
+    if (!external) {
+      initializer->set_raw_data(data, nbytes);
+      continue;
+    }
+    data_file.write(data, nbytes);
+    initializer->set_data_location(onnx::TensorProto::EXTERNAL);
+    // the location is relative to the model file
+    auto location = data_path.substr(data_path.find_last_of('/') + 1);
+    for (auto &[key, value] :
+         std::vector<std::pair<std::string, std::string>>{
+             {"location", location},
+             {"offset", std::to_string(offset)},
+             {"length", std::to_string(nbytes)}}) {
+      auto *entry = initializer->add_external_data();
+      entry->set_key(key);
+      entry->set_value(value);
+    }
+    offset += nbytes;
+  }
+  if (external) {
+    data_file.close();
+    RV_CHECK(data_file.good());
+  }
+
+  std::ofstream model_file(_path, std::ios::binary);
+  RV_CHECK(model.SerializeToOstream(&model_file));
+  init(_path);
 }
 
+void check_model(const std::string &path) {
+  // the path overload resolves the external data file next to the model
+  onnx::checker::check_model(path, /*full_check=*/true);
 }
+
+class NullAllocator : public rwkv::Allocator {
+public:
+  void *DoAllocate(size_t size) { return nullptr; }
+  void DoDeallocate(void *ptr) {}
+};
+
+rwkv::Allocator &allocator() {
+  static auto *allocator = new NullAllocator;
+  return *allocator;
 }
+
+KernelRegister allocator_reg("allocator", Device::kONNXMeta, allocator);
+KernelRegister constant_reg("constant", Device::kONNXMeta, constant);
+
+KernelRegister layernorm_reg("layernorm", Device::kONNXMeta, layernorm);
+KernelRegister matmul_reg("matmul", Device::kONNXMeta, matmul);
+KernelRegister add_reg("add", Device::kONNXMeta, add);
+KernelRegister sub_reg("sub", Device::kONNXMeta, sub);
+KernelRegister mul_reg("mul", Device::kONNXMeta, mul);
+KernelRegister div_reg("div", Device::kONNXMeta, div);
+KernelRegister maximum_reg("maximum", Device::kONNXMeta, maximum);
+KernelRegister rsub_reg("rsub_scalar", Device::kONNXMeta, rsub_scalar);
+KernelRegister exp_reg("exp", Device::kONNXMeta, exp);
+KernelRegister relu_reg("relu", Device::kONNXMeta, relu);
+KernelRegister sigmoid_reg("sigmoid", Device::kONNXMeta, sigmoid);
+KernelRegister mark_as_output_reg("mark_as_output", Device::kONNXMeta,
+                                  mark_as_output);
+KernelRegister model_forward_reg("model_forward", Device::kONNXMeta,
+                                 ModelForward);
+
+} // namespace onnxmeta
+} // namespace rwkv
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <tensor.h>
+
+namespace rwkv {
+namespace onnxmeta {
+// The ops run on kONNXMeta tensors are recorded as an ONNX graph, which is
+// written to `path` by `destroy()`.
+void init(const std::string &path);
+void destroy();
+Tensor add_input(const Shape &shape, const std::string &name);
+// The embedding of the token id fed to the scalar int64 input `input_name`,
+// as a Gather from all rows of `weights`.
+Tensor embedding(const std::vector<Tensor> &weights,
+                 const std::string &input_name);
+// The matmuls with the weights in `input_absmax` are exported as int8 QDQ,
+// with the input scale derived from the given max |input|. The other weights
+// are exported as fp16. Reset by init(), set it after it.
+void set_int8_input_absmax(const std::map<std::string, float> &input_absmax);
+// Runs the ONNX checker, with shape inference, on the model written to `path`
+// by `destroy()`. Throws if the model is invalid.
+void check_model(const std::string &path);
+} // namespace onnxmeta
+} // namespace rwkv
@@ -6,6 +6,7 @@
 #include <string>
 #include <tensor.h>
 #include <utility>
+#include <vector>
 
 namespace rwkv {
 class KernelRegistry {
@@ -14,8 +15,18 @@ public:
     static KernelRegistry instance;
     return instance;
   }
-  void Register(const std::string &name, Device device, std::any kernel, int priority) {
-    _kernels[std::make_pair(name, device)] = kernel;
+  // `Get` returns the kernel of the highest priority, the last registered of
+  // them on ties. The others stay available as variants, e.g. for bench_ops.
+  void Register(const std::string &name, Device device, std::any kernel,
+                int priority, const std::string &variant = "") {
+    auto key = std::make_pair(name, device);
+    auto &variants = _variants[key];
+    if (variants.empty() || priority >= _priorities[key]) {
+      _kernels[key] = kernel;
+      _priorities[key] = priority;
+    }
+    variants.push_back(
+        {variant.empty() ? std::to_string(variants.size()) : variant, kernel});
   }
   template <typename T> T Get(const std::string &name, Device device) {
     if (_kernels.find(std::make_pair(name, device)) == _kernels.end()) {
@@ -23,14 +34,42 @@ public:
     }
     return std::any_cast<T>(_kernels[std::make_pair(name, device)]);
   }
+  // all registered (name, device)
+  std::vector<std::pair<std::string, Device>> Keys() const {
+    std::vector<std::pair<std::string, Device>> keys;
+    for (auto &[key, _] : _kernels) {
+      keys.push_back(key);
+    }
+    return keys;
+  }
+  // all kernels registered for (name, device) with their variant names, in
+  // registration order
+  template <typename T>
+  std::vector<std::pair<std::string, T>> Variants(const std::string &name,
+                                                  Device device) const {
+    std::vector<std::pair<std::string, T>> ret;
+    auto it = _variants.find(std::make_pair(name, device));
+    if (it != _variants.end()) {
+      for (auto &[variant, kernel] : it->second) {
+        ret.emplace_back(variant, std::any_cast<T>(kernel));
+      }
+    }
+    return ret;
+  }
 
 private:
   std::map<std::pair<std::string, Device>, std::any> _kernels;
+  std::map<std::pair<std::string, Device>, int> _priorities;
+  std::map<std::pair<std::string, Device>,
+           std::vector<std::pair<std::string, std::any>>>
+      _variants;
 };
 
 struct KernelRegister {
-  KernelRegister(const std::string &name, Device device, std::any kernel, int priority = 1) {
-    KernelRegistry::Instance().Register(name, device, kernel, priority);
+  KernelRegister(const std::string &name, Device device, std::any kernel,
+                 int priority = 1, const std::string &variant = "") {
+    KernelRegistry::Instance().Register(name, device, kernel, priority,
+                                        variant);
   }
 };
 
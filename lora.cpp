@@ -0,0 +1,83 @@
+#include "lora.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <vector>
+
+#include <msgpack.hpp>
+
+#include <kernels/kernels.h>
+#include <mp_tensor.h>
+
+namespace rwkv {
+
+namespace {
+thread_local const LoraAdapter *active_lora = nullptr;
+} // namespace
+
+LoraAdapter::LoraAdapter(const std::string &path) {
+  ScopedAllocTag alloc_tag(AllocTag::kWeights);
+  std::ifstream infile(path, std::ios::binary);
+  RV_CHECK(infile.good());
+  std::vector<char> data((std::istreambuf_iterator<char>(infile)),
+                         std::istreambuf_iterator<char>());
+
+  auto unpacker = msgpack::unpack(data.data(), data.size());
+  auto map = unpacker.get()
+                 .as<std::unordered_map<std::string, msgpack::object>>();
+  auto alpha = map["alpha"].as<float>();
+  auto mp_weights =
+      map["weights"].as<std::map<std::string, msgpack::object>>();
+  for (auto &[name, mp_weight] : mp_weights) {
+    auto ab = mp_weight.as<std::unordered_map<std::string, msgpack::object>>();
+    auto a_t =
+        transposed(cast_dtype(from_mp_tensor(ab["a"]), DType::kFloat32));
+    auto b_t =
+        transposed(cast_dtype(from_mp_tensor(ab["b"]), DType::kFloat32));
+    auto rank = a_t.size(0);
+    RV_CHECK(b_t.size(1) == rank);
+    weights.emplace(name, Weight{a_t, b_t, alpha / rank});
+  }
+}
+
+Tensor LoraAdapter::Merge(const Tensor &w, const std::string &name) const {
+  auto it = weights.find(name);
+  if (it == weights.end()) {
+    return w;
+  }
+  auto &[a_t, b_t, scale] = it->second;
+  RV_CHECK(w.device() == Device::kCPU && w.shape().size() == 2);
+  auto k = w.size(0);
+  auto n = w.size(1);
+  auto rank = a_t.size(0);
+  RV_CHECK(a_t.size(1) == k && b_t.size(0) == n);
+
+  auto merged = Tensor::Empty(w.shape(), DType::kFloat32, Device::kCPU);
+  auto w_fp32 = cast_dtype(w, DType::kFloat32);
+  std::copy_n(w_fp32.data_ptr<float>(), w.numel(), merged.data_ptr<float>());
+  auto *m_ptr = merged.data_ptr<float>();
+  auto *a_ptr = a_t.data_ptr<float>();
+  auto *b_ptr = b_t.data_ptr<float>();
+  for (int64_t i = 0; i < k; i++) {
+    for (int64_t j = 0; j < n; j++) {
+      float sum = 0;
+      for (int64_t l = 0; l < rank; l++) {
+        sum += a_ptr[l * k + i] * b_ptr[j * rank + l];
+      }
+      m_ptr[i * n + j] += scale * sum;
+    }
+  }
+  return cast_dtype(merged, w.dtype());
+}
+
+const LoraAdapter *ActiveLora() { return active_lora; }
+
+ScopedLora::ScopedLora(const LoraAdapter *lora) : _prev(active_lora) {
+  active_lora = lora;
+}
+
+ScopedLora::~ScopedLora() { active_lora = _prev; }
+
+} // namespace rwkv
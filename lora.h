@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include "tensor.h"
+
+namespace rwkv {
+
+// A LoRA adapter converted by tools/convert_lora.py. For a weight `w` of
+// shape [K, N] the adapted weight is `w + scale * a @ b`, where `a` is [K, r]
+// and `b` is [r, N].
+//
+// An adapter can be merged into the weights when the model is loaded
+// (`lora=path` in the strategy), or kept unmerged and passed to `Model::Run`,
+// so that many adapters share one base model.
+struct LoraAdapter {
+  explicit LoraAdapter(const std::string &path);
+
+  struct Weight {
+    // a transposed, [r, K], fp32
+    Tensor a_t;
+    // b transposed, [N, r], fp32
+    Tensor b_t;
+    float scale;
+  };
+  // keyed by the name of the adapted weight, e.g. "blocks.0.att.key.weight"
+  std::unordered_map<std::string, Weight> weights;
+
+  // Returns `w + scale * a @ b` in the dtype of `w`, or `w` itself if this
+  // adapter does not touch `w`. `w` is a [K, N] kCPU tensor.
+  Tensor Merge(const Tensor &w, const std::string &name) const;
+};
+
+// The unmerged adapter applied by the cpu kernels on the current thread, or
+// nullptr.
+const LoraAdapter *ActiveLora();
+
+class ScopedLora {
+public:
+  explicit ScopedLora(const LoraAdapter *lora);
+  ~ScopedLora();
+  FR_DISALLOW_COPY_AND_MOVE(ScopedLora);
+
+private:
+  const LoraAdapter *_prev;
+};
+
+} // namespace rwkv
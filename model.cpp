@@ -1,20 +1,51 @@
 #include "model.h"
 
 #include "kernels/kernels.h"
+#include <lora.h>
 #include <tensor.h>
 
 #ifdef FR_ENABLE_CUDA
 #include <cuda_runtime.h>
 #endif
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <msgpack.hpp>
+#include <sstream>
 #include <string>
 
 namespace rwkv {
 
+namespace {
+// the device of the states and of the tensors returned to the user
+Device HostedDevice(Device act_device) {
+  return act_device == Device::kNCNN ? Device::kCPU : act_device;
+}
+
+// The states replaced during a forward are allocated as activations, account
+// them as states from now on
+void FinishForward(Device act_device,
+                   std::vector<std::vector<Tensor>> &states) {
+  allocator(HostedDevice(act_device)).CountForward();
+  for (auto &layer_states : states) {
+    for (auto &state : layer_states) {
+      state.set_alloc_tag(AllocTag::kStates);
+    }
+  }
+}
+} // namespace
+
 Model::Model(const std::string &path, const std::string &strategy) {
-  auto dev_str = strategy.substr(0, strategy.find(" "));
+  // strategy: "<device> <dtype> [key=value ...]", e.g. "cpu fp32 stage=0/2"
+  std::istringstream strategy_stream(strategy);
+  std::string dev_str;
+  std::string atype_str;
+  strategy_stream >> dev_str >> atype_str;
+  for (std::string option; strategy_stream >> option;) {
+    auto eq_pos = option.find("=");
+    RV_CHECK(eq_pos != std::string::npos);
+    _options[option.substr(0, eq_pos)] = option.substr(eq_pos + 1);
+  }
   Device act_device = [&]() {
     if (dev_str == "ncnn-meta") {
       return Device::kNCNNMeta;
@@ -31,7 +62,6 @@ Model::Model(const std::string &path, const std::string &strategy) {
     }
   }();
   _act_device = act_device;
-  std::string atype_str = strategy.substr(strategy.find(" ") + 1);
   DType atype = [&]() {
     if (atype_str == "fp16") {
       return DType::kFloat16;
@@ -42,17 +72,46 @@ Model::Model(const std::string &path, const std::string &strategy) {
     }
   }();
   _act_dtype = atype;
+  // the cpu kernels compute in fp32 (the weights can still be fp16)
+  if (act_device == Device::kCPU && atype != DType::kFloat32) {
+    throw std::runtime_error("the cpu device only supports fp32 activations, "
+                             "use \"cpu fp32\"");
+  }
 
-  init_model(this, act_device, path, strategy);
+  {
+    ScopedAllocTag alloc_tag(AllocTag::kWeights);
+    init_model(this, act_device, path, strategy);
+  }
   RV_CHECK(_n_layer > 0);
   RV_CHECK(_n_embd > 0);
 }
 
+Model::Model(const Model &base, const std::string &delta_path,
+             bool materialize)
+    : Model(base) {
+  RV_CHECK(_act_device == Device::kCPU || _act_device == Device::kCUDA);
+  ScopedAllocTag alloc_tag(AllocTag::kWeights);
+  load_delta(this, _act_device, delta_path, materialize);
+}
+
 std::vector<std::vector<Tensor>> Model::CreateInitialStates() const {
-  auto device = _act_device == Device::kNCNN ? Device::kCPU : _act_device;
+  auto device = HostedDevice(_act_device);
+  ScopedAllocTag alloc_tag(AllocTag::kStates);
   std::vector<std::vector<Tensor>> states;
   for (int i = 0; i < _n_layer; i++) {
     states.push_back({});
+    if (_version == 5) {
+      // att sx, [n_head, head_size, head_size] wkv state, ffn sx
+      auto s1 = Tensor::Empty(Shape{_n_embd}, _act_dtype, Device::kCPU);
+      states.back().push_back(Copy(fill_(s1, 0), device));
+      auto s2 = Tensor::Empty(
+          Shape{_n_head, _n_embd / _n_head, _n_embd / _n_head},
+          DType::kFloat32, Device::kCPU);
+      states.back().push_back(Copy(fill_(s2, 0), device));
+      auto s3 = Tensor::Empty(Shape{_n_embd}, _act_dtype, Device::kCPU);
+      states.back().push_back(Copy(fill_(s3, 0), device));
+      continue;
+    }
     auto s1 = Tensor::Empty(Shape{_n_embd}, _act_dtype, Device::kCPU);
     states.back().push_back(Copy(fill_(s1, 0), device));
     auto s2 = Tensor::Empty(Shape{_n_embd}, DType::kFloat32, Device::kCPU);
@@ -67,8 +126,29 @@ std::vector<std::vector<Tensor>> Model::CreateInitialStates() const {
   return states;
 }
 
+AllocatorStats Model::MemoryStats() const {
+  return allocator(HostedDevice(_act_device)).stats();
+}
+
+int Model::n_vocab() const {
+  RV_CHECK(_has_head);
+  // head.weight is [n_embd, n_vocab]
+  return _params.back().size(1);
+}
+
+void Model::ResetPeakMemoryStats() const {
+  allocator(HostedDevice(_act_device)).ResetPeakStats();
+}
+
 Tensor Model::Run(const std::vector<int>& ids, std::vector<std::vector<Tensor>>& states) const {
-  for (int i = 0; i < ids.size(); ++i) {
+  // ncnn graphs take a whole prompt at once
+  if (_act_device == Device::kNCNN) {
+    RV_CHECK(_layer_begin == 0);
+    auto out = ModelForwardSeq(this, _act_device, ids, states);
+    FinishForward(_act_device, states);
+    return out;
+  }
+  for (size_t i = 0; i < ids.size(); ++i) {
     auto id = ids[i];
     auto out = Run(id, states);
     if (i == ids.size() - 1) {
@@ -79,7 +159,58 @@ Tensor Model::Run(const std::vector<int>& ids, std::vector<std::vector<Tensor>>&
 }
 
 Tensor Model::Run(int id, std::vector<std::vector<Tensor>>& states) const {
-  return ModelForward(this, this->_act_device, id, states);
+  RV_CHECK(_layer_begin == 0);
+  ScopedDeltas scoped_deltas(&_deltas);
+  auto out = ModelForward(this, this->_act_device, id, states);
+  FinishForward(_act_device, states);
+  return out;
+}
+
+Tensor Model::Run(const std::vector<int>& ids, std::vector<std::vector<Tensor>>& states, const LoraAdapter& lora) const {
+  RV_CHECK(_act_device == Device::kCPU);
+  ScopedLora scoped_lora(&lora);
+  return Run(ids, states);
+}
+
+Tensor Model::Run(int id, std::vector<std::vector<Tensor>>& states, const LoraAdapter& lora) const {
+  RV_CHECK(_act_device == Device::kCPU);
+  ScopedLora scoped_lora(&lora);
+  return Run(id, states);
+}
+
+Tensor Model::RunBatch(const std::vector<int>& ids, const std::vector<std::vector<std::vector<Tensor>>*>& states, const std::vector<const LoraAdapter*>& loras) const {
+  RV_CHECK(ids.size() == states.size());
+  RV_CHECK(loras.empty() || loras.size() == ids.size());
+  if (_act_device == Device::kNCNN) {
+    // the exported graphs have no LoRA terms
+    for (auto *lora : loras) {
+      RV_CHECK(lora == nullptr);
+    }
+    auto out = ModelForwardBatch(this, _act_device, ids, states);
+    for (auto *session_states : states) {
+      FinishForward(_act_device, *session_states);
+    }
+    return out;
+  }
+  RV_CHECK(_act_device == Device::kCPU);
+  const int n_vocab = this->n_vocab();
+  auto out = Tensor::Empty({static_cast<int64_t>(ids.size()), n_vocab},
+                           DType::kFloat32, Device::kCPU);
+  for (size_t b = 0; b < ids.size(); ++b) {
+    ScopedLora scoped_lora(loras.empty() ? nullptr : loras[b]);
+    auto logits = Run(ids[b], *states[b]);
+    std::copy_n(logits.data_ptr<float>(), n_vocab,
+                out.data_ptr<float>() + b * n_vocab);
+  }
+  return out;
+}
+
+Tensor Model::RunHidden(const Tensor& x, std::vector<std::vector<Tensor>>& states) const {
+  ScopedDeltas scoped_deltas(&_deltas);
+  auto out = ModelForwardHidden(this, this->_act_device, Copy(x, _act_device),
+                                states);
+  FinishForward(_act_device, states);
+  return out;
 }
 
 } // namespace rwkv
@@ -6,26 +6,75 @@
 #include <unordered_map>
 #include <vector>
 #include <any>
+#include <map>
 
+#include "delta.h"
 #include "tensor.h"
 
 namespace rwkv {
+struct LoraAdapter;
+
 struct Model {
   Model(const std::string &path, const std::string &strategy);
+  // A fine-tuned variant of `base` stored as a delta against it (see
+  // tools/make_delta.py). The weights not changed by the fine-tune are shared
+  // with `base`. On cpu the deltas of the matmul weights are added on the fly
+  // unless `materialize` is true, on other devices the changed weights are
+  // always materialized. A dense int8 delta of every matmul weight takes about
+  // half of an fp16 base model, a low-rank delta (see delta.h) a few percent,
+  // e.g. five low-rank variants take about 1.15 times the memory of the base
+  // model.
+  Model(const Model &base, const std::string &delta_path, bool materialize = false);
   Tensor Run(const std::vector<int>& id, std::vector<std::vector<Tensor>>& states) const;
   Tensor Run(int id, std::vector<std::vector<Tensor>>& states) const;
+  // Run with the unmerged LoRA adapter `lora` (cpu only). Sessions with
+  // different adapters can share this model, e.g. one adapter per tenant,
+  // see also RunBatch.
+  Tensor Run(const std::vector<int>& id, std::vector<std::vector<Tensor>>& states, const LoraAdapter& lora) const;
+  Tensor Run(int id, std::vector<std::vector<Tensor>>& states, const LoraAdapter& lora) const;
+  // Run one token for each of several sessions at once, `ids[b]` for the
+  // states `*states[b]`, and return the [B, n_vocab] logits. ncnn models
+  // exported with `--batch` run the sessions in one graph, without LoRA
+  // adapters. cpu models run them one after another, each with the unmerged
+  // adapter `*loras[b]` if `loras` is not empty and `loras[b]` is not null.
+  Tensor RunBatch(const std::vector<int>& ids, const std::vector<std::vector<std::vector<Tensor>>*>& states, const std::vector<const LoraAdapter*>& loras = {}) const;
+  // Run the blocks loaded by this model on the hidden state `x` (and the head
+  // if this model is the last pipeline stage). See `stage=` in the strategy.
+  Tensor RunHidden(const Tensor& x, std::vector<std::vector<Tensor>>& states) const;
   std::vector<std::vector<Tensor>> CreateInitialStates() const;
+  // The memory stats of the device of this model (of kCPU for ncnn models,
+  // whose activations are in ncnn's own pools). They are per device, i.e.
+  // shared with the other models on it.
+  AllocatorStats MemoryStats() const;
+  // Sets the peaks of MemoryStats() to the current values, e.g. after loading
+  // to get the peak of the runs only
+  void ResetPeakMemoryStats() const;
+  int n_embd() const { return _n_embd; }
+  DType act_dtype() const { return _act_dtype; }
+  // only for models with the head, i.e. not for the earlier pipeline stages
+  int n_vocab() const;
 
   std::vector<Tensor> _embd_weights;
 private:
   // std::unordered_map<std::string, Tensor> _params;
   // _params is not a map because we know the exact order of the parameters
   std::vector<Tensor> _params;
+  // the on-the-fly deltas of a variant model (cpu only), see delta.h
+  WeightDeltas _deltas;
   Device _act_device;
   DType _act_dtype;
+  // `key=value` pairs following the device and dtype in the strategy
+  std::map<std::string, std::string> _options;
   // inited in `init_model` and checked in constructor
   int _n_layer = 0;
   int _n_embd = 0;
+  // 4 or 5, RWKV-5 models have multi-head matrix-valued wkv states
+  int _version = 4;
+  int _n_head = 0;
+  // index of the first loaded block, non-zero for later pipeline stages
+  int _layer_begin = 0;
+  // false for all pipeline stages except the last one
+  bool _has_head = true;
   std::any _extra;
 };
 } // namespace rwkv
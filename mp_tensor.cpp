@@ -0,0 +1,47 @@
+#include "mp_tensor.h"
+
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace rwkv {
+
+DType from_mp_dtype(const std::string &mp_dtype) {
+  if (mp_dtype == "torch.int8") {
+    return DType::kInt8;
+  } else if (mp_dtype == "torch.float16") {
+    return DType::kFloat16;
+  } else if (mp_dtype == "torch.float32") {
+    return DType::kFloat32;
+  } else {
+    throw std::runtime_error("unknown dtype " + mp_dtype);
+  }
+}
+
+Tensor from_mp_tensor(const msgpack::object &mp_tensor) {
+  auto mp_tensor_map =
+      mp_tensor.as<std::unordered_map<std::string, msgpack::object>>();
+  auto data = mp_tensor_map["data"].as<std::vector<char>>();
+  auto shape = mp_tensor_map["shape"].as<std::vector<int64_t>>();
+  auto dtype = from_mp_dtype(mp_tensor_map["dtype"].as<std::string>());
+  return Copy(Tensor::FromPtr(data.data(), Shape(shape), dtype, Device::kCPU),
+              Device::kCPU, true);
+}
+
+Tensor transposed(const Tensor &x) {
+  RV_CHECK(x.shape().size() == 2 && x.dtype() == DType::kFloat32 &&
+           x.device() == Device::kCPU);
+  auto rows = x.size(0);
+  auto cols = x.size(1);
+  auto y = Tensor::Empty({cols, rows}, DType::kFloat32, Device::kCPU);
+  auto *x_ptr = x.data_ptr<float>();
+  auto *y_ptr = y.data_ptr<float>();
+  for (int64_t i = 0; i < rows; i++) {
+    for (int64_t j = 0; j < cols; j++) {
+      y_ptr[j * rows + i] = x_ptr[i * cols + j];
+    }
+  }
+  return y;
+}
+
+} // namespace rwkv
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+#include <msgpack.hpp>
+
+#include "tensor.h"
+
+// The tensors of the msgpack files read by faster-rwkv: the weights (.fr),
+// the deltas (.frd, see delta.h) and the LoRA adapters (.lora, see lora.h).
+// Every tensor is a {data, shape, dtype} map, `dtype` being the name of a
+// torch dtype. Only for the sources of faster_rwkv, which link msgpack.
+
+namespace rwkv {
+// e.g. "torch.float16" -> DType::kFloat16
+DType from_mp_dtype(const std::string &mp_dtype);
+
+// A kCPU tensor with a copy of the data of `mp_tensor`
+Tensor from_mp_tensor(const msgpack::object &mp_tensor);
+
+// A [rows, cols] fp32 kCPU tensor transposed to [cols, rows]
+Tensor transposed(const Tensor &x);
+} // namespace rwkv
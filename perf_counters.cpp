@@ -0,0 +1,473 @@
+#include "perf_counters.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "kernels/cpu/thread_pool.h"
+
+namespace rwkv {
+namespace perf {
+
+namespace {
+
+enum Counter {
+  kTaskClock,
+  kCycles,
+  kInstructions,
+  kLLCMisses,
+  kDTLBMisses,
+  kNumCounters,
+};
+static_assert(kNumCounters <= detail::Reading::kMaxCounters);
+
+// bytes per LLC miss and per memory controller access
+constexpr double kCacheLineSize = 64;
+
+struct Totals {
+  double values[kNumCounters] = {};
+  double dram_bytes = 0;
+  double time_ns = 0;
+  int64_t count = 0;
+  int64_t tokens = 0;
+
+  void Add(const detail::Reading &begin, const detail::Reading &end,
+           int num_tokens) {
+    for (int i = 0; i < kNumCounters; i++) {
+      values[i] += end.values[i] - begin.values[i];
+    }
+    dram_bytes += end.dram_bytes - begin.dram_bytes;
+    time_ns += end.time_ns - begin.time_ns;
+    count++;
+    tokens += num_tokens;
+  }
+};
+
+#ifdef __linux__
+long PerfEventOpen(perf_event_attr *attr, pid_t pid, int cpu, int group_fd) {
+  return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, 0);
+}
+
+perf_event_attr Attr(Counter counter) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  switch (counter) {
+  case kTaskClock:
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    break;
+  case kCycles:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case kInstructions:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case kLLCMisses:
+    // the last level cache on most cpus
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    break;
+  case kDTLBMisses:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  default:
+    break;
+  }
+  // user space only, which perf_event_paranoid <= 2 allows
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return attr;
+}
+
+std::string ReadFile(const std::string &path) {
+  std::ifstream file(path);
+  std::string content;
+  std::getline(file, content);
+  return content;
+}
+
+// The config of an uncore event like "event=0x04,umask=0x03", placed by the
+// "config:<lo>-<hi>" format files of its pmu
+bool UncoreConfig(const std::string &pmu, const std::string &event,
+                  uint64_t *config) {
+  std::string spec = ReadFile(pmu + "/events/" + event);
+  if (spec.empty()) {
+    return false;
+  }
+  *config = 0;
+  std::istringstream terms(spec);
+  for (std::string term; std::getline(terms, term, ',');) {
+    auto eq = term.find('=');
+    if (eq == std::string::npos) {
+      return false;
+    }
+    std::string format = ReadFile(pmu + "/format/" + term.substr(0, eq));
+    int lo = 0;
+    if (std::sscanf(format.c_str(), "config:%d", &lo) != 1) {
+      return false;
+    }
+    *config |= std::stoull(term.substr(eq + 1), nullptr, 0) << lo;
+  }
+  return true;
+}
+
+// The counters of every thread of the process, in a group per thread led by
+// the task clock (a software event, so that the group can be opened without
+// hardware counters), and of the memory controllers.
+class Counters {
+public:
+  // Opens the counters of the threads started since the last call
+  void OpenNewThreads() {
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == nullptr) {
+      return;
+    }
+    while (auto *entry = readdir(dir)) {
+      pid_t tid = std::atoi(entry->d_name);
+      if (tid <= 0 || _threads.count(tid) > 0) {
+        continue;
+      }
+      auto &thread = _threads[tid];
+      for (int i = 0; i < kNumCounters; i++) {
+        auto attr = Attr(static_cast<Counter>(i));
+        int fd = PerfEventOpen(&attr, tid, -1, thread.fds.empty() ? -1
+                                                  : thread.fds[0]);
+        if (fd < 0) {
+          if (i == kTaskClock) {
+            break;
+          }
+          continue;
+        }
+        thread.fds.push_back(fd);
+        thread.counters.push_back(static_cast<Counter>(i));
+        _available[i] = true;
+      }
+    }
+    closedir(dir);
+  }
+
+  // CAS (64 byte) reads and writes of all memory controllers
+  void OpenMemoryControllers() {
+    const std::string root = "/sys/bus/event_source/devices";
+    DIR *dir = opendir(root.c_str());
+    if (dir == nullptr) {
+      return;
+    }
+    while (auto *entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name.rfind("uncore_imc", 0) != 0) {
+        continue;
+      }
+      std::string pmu = root + "/" + name;
+      // uncore events are counted per socket, on the first cpu of each
+      std::string cpumask = ReadFile(pmu + "/cpumask");
+      int type = std::atoi(ReadFile(pmu + "/type").c_str());
+      std::istringstream cpus(cpumask);
+      for (std::string cpu; std::getline(cpus, cpu, ',');) {
+        for (auto *event : {"cas_count_read", "cas_count_write"}) {
+          perf_event_attr attr;
+          std::memset(&attr, 0, sizeof(attr));
+          attr.size = sizeof(attr);
+          attr.type = type;
+          uint64_t config;
+          if (!UncoreConfig(pmu, event, &config)) {
+            continue;
+          }
+          attr.config = config;
+          int fd = PerfEventOpen(&attr, -1, std::atoi(cpu.c_str()), -1);
+          if (fd >= 0) {
+            _memory_controller_fds.push_back(fd);
+          }
+        }
+      }
+    }
+    closedir(dir);
+  }
+
+  void Read(detail::Reading *reading) {
+    std::fill(reading->values, reading->values + kNumCounters, 0.);
+    uint64_t buffer[3 + kNumCounters];
+    for (auto &[tid, thread] : _threads) {
+      if (thread.fds.empty()) {
+        continue;
+      }
+      // {nr, time_enabled, time_running, values[nr]}, the values are scaled
+      // up if the counters were multiplexed
+      ssize_t n = read(thread.fds[0], buffer, sizeof(buffer));
+      if (n < static_cast<ssize_t>(3 * sizeof(uint64_t)) || buffer[2] == 0) {
+        continue;
+      }
+      double scale = static_cast<double>(buffer[1]) / buffer[2];
+      for (size_t i = 0; i < buffer[0] && i < thread.counters.size(); i++) {
+        reading->values[thread.counters[i]] += buffer[3 + i] * scale;
+      }
+    }
+    if (!_memory_controller_fds.empty()) {
+      reading->dram_bytes = 0;
+      for (int fd : _memory_controller_fds) {
+        uint64_t count = 0;
+        if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+          reading->dram_bytes += count * kCacheLineSize;
+        }
+      }
+    } else {
+      reading->dram_bytes = reading->values[kLLCMisses] * kCacheLineSize;
+    }
+  }
+
+  bool available(Counter counter) const { return _available[counter]; }
+  bool has_memory_controllers() const {
+    return !_memory_controller_fds.empty();
+  }
+
+private:
+  struct ThreadCounters {
+    // fds[0] is the group leader
+    std::vector<int> fds;
+    std::vector<Counter> counters;
+  };
+  std::map<pid_t, ThreadCounters> _threads;
+  std::vector<int> _memory_controller_fds;
+  bool _available[kNumCounters] = {};
+};
+#else
+class Counters {
+public:
+  void OpenNewThreads() {}
+  void OpenMemoryControllers() {}
+  void Read(detail::Reading *reading) {
+    std::fill(reading->values, reading->values + kNumCounters, 0.);
+    reading->dram_bytes = 0;
+  }
+  bool available(Counter) const { return false; }
+  bool has_memory_controllers() const { return false; }
+};
+#endif
+
+struct State {
+  std::mutex mutex;
+  Counters counters;
+  Totals forwards;
+  std::map<int, Totals> layers;
+  // bytes per second
+  double peak_bandwidth = 0;
+  bool peak_bandwidth_measured = false;
+};
+
+// never destroyed, so that it outlives the report at exit
+State &GetState() {
+  static auto *state = new State;
+  return *state;
+}
+
+int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// The best of 3 reads of 256 MB by the cpu thread pool, in bytes per second
+double MeasureReadBandwidth() {
+  const int64_t n = (256 << 20) / sizeof(uint64_t);
+  std::vector<uint64_t> data(n, 1);
+  auto &pool = cpu::ThreadPool::Instance();
+  std::vector<uint64_t> sums(pool.num_threads());
+  double best = 0;
+  for (int i = 0; i < 3; i++) {
+    int64_t start = Now();
+    pool.Run([&](int thread_id) {
+      auto [begin, end] = cpu::ShardRange(n, thread_id, pool.num_threads());
+      uint64_t sum = 0;
+      for (int64_t j = begin; j < end; j++) {
+        sum += data[j];
+      }
+      sums[thread_id] = sum;
+    });
+    best = std::max(best, n * sizeof(uint64_t) * 1e9 / (Now() - start));
+  }
+  return best;
+}
+
+void ReportAtExit() { WriteReport(std::cerr); }
+
+} // namespace
+
+namespace detail {
+
+bool ReadEnabled() {
+  if (std::getenv("FR_PERF_COUNTERS") == nullptr) {
+    return false;
+  }
+#ifndef __linux__
+  std::cerr << "FR_PERF_COUNTERS is only supported on Linux" << std::endl;
+  return false;
+#else
+  auto &state = GetState();
+  if (const char *peak = std::getenv("FR_PEAK_BANDWIDTH")) {
+    state.peak_bandwidth = std::atof(peak) * 1e9;
+  } else {
+    state.peak_bandwidth = MeasureReadBandwidth();
+    state.peak_bandwidth_measured = true;
+  }
+  state.counters.OpenMemoryControllers();
+  std::atexit(ReportAtExit);
+  return true;
+#endif
+}
+
+int &CurrentTokens() {
+  thread_local int tokens = 0;
+  return tokens;
+}
+
+void OpenNewThreads() {
+  auto &state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.counters.OpenNewThreads();
+}
+
+void Begin(Reading *reading) {
+  auto &state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.counters.Read(reading);
+  reading->time_ns = Now();
+}
+
+void EndForward(const Reading &begin, int num_tokens) {
+  Reading end;
+  auto &state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  end.time_ns = Now();
+  state.counters.Read(&end);
+  state.forwards.Add(begin, end, num_tokens);
+}
+
+void EndLayer(const Reading &begin, int layer) {
+  Reading end;
+  auto &state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  end.time_ns = Now();
+  state.counters.Read(&end);
+  state.layers[layer].Add(begin, end, CurrentTokens());
+}
+
+} // namespace detail
+
+void WriteReport(std::ostream &os) {
+  auto &state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  auto &counters = state.counters;
+  const bool has_ipc =
+      counters.available(kCycles) && counters.available(kInstructions);
+  const bool has_bytes =
+      counters.has_memory_controllers() || counters.available(kLLCMisses);
+  auto per_token = [](const Totals &t, double value) {
+    return t.tokens == 0 ? 0 : value / t.tokens;
+  };
+  // a value, or n/a if its counter is not available
+  auto value = [](std::ostream &out, bool available, double v, int width,
+                  int precision) -> std::ostream & {
+    out << std::setw(width);
+    if (available) {
+      out << std::fixed << std::setprecision(precision) << v;
+    } else {
+      out << "n/a";
+    }
+    return out;
+  };
+
+  std::ostringstream out;
+  const auto &f = state.forwards;
+  if (f.tokens == 0) {
+    out << "perf counters: no forwards\n";
+    os << out.str() << std::flush;
+    return;
+  }
+  const double ipc = f.values[kInstructions] / f.values[kCycles];
+  const double bandwidth = f.dram_bytes * 1e9 / f.time_ns;
+  out << "perf counters: " << f.count << " forwards of " << f.tokens
+      << " tokens, " << std::fixed << std::setprecision(3)
+      << per_token(f, f.time_ns) / 1e6 << " ms per token, ";
+  value(out, counters.available(kTaskClock),
+        per_token(f, f.values[kTaskClock]) / 1e6, 0, 3)
+      << " cpu ms per token (all threads)\n";
+  out << "  IPC ";
+  value(out, has_ipc, ipc, 0, 2) << ", ";
+  value(out, has_bytes, per_token(f, f.dram_bytes) / 1e6, 0, 2)
+      << " MB per token"
+      << (counters.has_memory_controllers() ? " (memory controllers), "
+                                            : " (LLC misses x 64), ");
+  value(out, has_bytes, bandwidth / 1e9, 0, 2)
+      << " GB/s of " << std::setprecision(2) << state.peak_bandwidth / 1e9
+      << " GB/s peak (" << (state.peak_bandwidth_measured ? "measured" : "set")
+      << ")\n";
+  const double dtlb_mpki =
+      f.values[kDTLBMisses] * 1000 / f.values[kInstructions];
+  out << "  dTLB misses per 1000 instructions: ";
+  value(out,
+        counters.available(kDTLBMisses) && counters.available(kInstructions),
+        dtlb_mpki, 0, 3)
+      << "\n";
+  // rough thresholds, to be read with the numbers above
+  out << "  likely bound by: ";
+  if (has_bytes && bandwidth >= 0.6 * state.peak_bandwidth) {
+    out << "memory bandwidth\n";
+  } else if (counters.available(kDTLBMisses) &&
+             counters.available(kInstructions) && dtlb_mpki >= 1) {
+    out << "dTLB (try huge pages)\n";
+  } else if (has_ipc) {
+    out << "compute\n";
+  } else {
+    out << "n/a, no hardware counters\n";
+  }
+
+  out << std::left << std::setw(8) << "layer" << std::right << std::setw(12)
+      << "ms/token" << std::setw(14) << "cycles/token" << std::setw(14)
+      << "instr/token" << std::setw(8) << "IPC" << std::setw(14)
+      << "LLC-miss/tok" << std::setw(14) << "dTLB-miss/tok" << std::setw(12)
+      << "MB/token" << std::setw(10) << "GB/s" << "\n";
+  for (auto &[layer, t] : state.layers) {
+    out << std::left << std::setw(8) << layer << std::right;
+    value(out, true, per_token(t, t.time_ns) / 1e6, 12, 4);
+    value(out, counters.available(kCycles), per_token(t, t.values[kCycles]),
+          14, 0);
+    value(out, counters.available(kInstructions),
+          per_token(t, t.values[kInstructions]), 14, 0);
+    value(out, has_ipc, t.values[kInstructions] / t.values[kCycles], 8, 2);
+    value(out, counters.available(kLLCMisses),
+          per_token(t, t.values[kLLCMisses]), 14, 0);
+    value(out, counters.available(kDTLBMisses),
+          per_token(t, t.values[kDTLBMisses]), 14, 0);
+    value(out, has_bytes, per_token(t, t.dram_bytes) / 1e6, 12, 2);
+    value(out, has_bytes, t.dram_bytes / t.time_ns, 10, 2) << "\n";
+  }
+  os << out.str() << std::flush;
+}
+
+} // namespace perf
+} // namespace rwkv
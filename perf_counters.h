@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+namespace rwkv {
+namespace perf {
+
+// Hardware performance counters (Linux perf_event_open) read around every
+// forward and every layer of ModelForward, to tell whether decoding is bound
+// by the memory bandwidth, the TLB or the compute on a machine. Enabled by the
+// FR_PERF_COUNTERS environment variable; a report is printed to stderr at
+// exit.
+//
+// The counters (cycles, instructions, LLC misses, dTLB misses, task clock)
+// are opened for every thread of the process, including the cpu thread pool,
+// and summed. The DRAM traffic is read from the uncore memory controllers
+// (uncore_imc, system wide) when they can be opened, and estimated as 64
+// bytes per LLC miss otherwise. The peak bandwidth is FR_PEAK_BANDWIDTH (in
+// GB/s) if set, and measured by a read of 256 MB otherwise. Counters which
+// cannot be opened (e.g. in a VM, or with a high perf_event_paranoid) are
+// reported as n/a. Forwards run concurrently, e.g. by pipeline stages, are
+// counted in each other's readings.
+
+namespace detail {
+// the counter values at a point in time
+struct Reading {
+  static constexpr int kMaxCounters = 8;
+  double values[kMaxCounters];
+  double dram_bytes;
+  int64_t time_ns;
+};
+
+bool ReadEnabled();
+int &CurrentTokens();
+void OpenNewThreads();
+void Begin(Reading *reading);
+void EndForward(const Reading &begin, int num_tokens);
+void EndLayer(const Reading &begin, int layer);
+} // namespace detail
+
+inline bool Enabled() {
+  static const bool enabled = detail::ReadEnabled();
+  return enabled;
+}
+
+// Counts a forward of `num_tokens` tokens
+class ForwardScope {
+public:
+  explicit ForwardScope(int num_tokens) {
+    if (Enabled()) {
+      _active = true;
+      _num_tokens = num_tokens;
+      _prev_tokens = detail::CurrentTokens();
+      detail::CurrentTokens() = num_tokens;
+      detail::OpenNewThreads();
+      detail::Begin(&_begin);
+    }
+  }
+  ~ForwardScope() {
+    if (_active) {
+      detail::EndForward(_begin, _num_tokens);
+      detail::CurrentTokens() = _prev_tokens;
+    }
+  }
+  ForwardScope(const ForwardScope &) = delete;
+  ForwardScope &operator=(const ForwardScope &) = delete;
+
+private:
+  bool _active = false;
+  int _num_tokens = 0;
+  int _prev_tokens = 0;
+  detail::Reading _begin;
+};
+
+class LayerScope {
+public:
+  explicit LayerScope(int layer) {
+    if (Enabled()) {
+      _active = true;
+      _layer = layer;
+      detail::Begin(&_begin);
+    }
+  }
+  ~LayerScope() {
+    if (_active) {
+      detail::EndLayer(_begin, _layer);
+    }
+  }
+  LayerScope(const LayerScope &) = delete;
+  LayerScope &operator=(const LayerScope &) = delete;
+
+private:
+  bool _active = false;
+  int _layer = 0;
+  detail::Reading _begin;
+};
+
+// The totals so far: IPC, bytes per token, bandwidth against the peak, and
+// per layer
+void WriteReport(std::ostream &os);
+
+} // namespace perf
+} // namespace rwkv
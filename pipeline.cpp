@@ -0,0 +1,490 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <new>
+#include <sched.h>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "model.h"
+#include "kernels/cpu/thread_pool.h"
+#include "lora.h"
+
+namespace rwkv {
+
+namespace {
+
+enum class Op : int32_t {
+  kForward,
+  kRelease,
+  // the payload is the path of a LoRA adapter to load, see lora.h
+  kLoadAdapter,
+  kStop,
+};
+
+struct Message {
+  Op op;
+  int32_t session;
+  // token id, only used by the first stage
+  int32_t id;
+  // index of an adapter loaded by kLoadAdapter, or -1
+  int32_t adapter;
+  DType dtype;
+  // number of elements in the payload
+  int64_t numel;
+};
+
+// Single-producer single-consumer ring buffer living in shared memory. Every
+// process maps the memory itself and wraps it in its own `Ring`.
+class Ring {
+public:
+  static const int kNumSlots = 16;
+
+  static size_t Bytes(size_t payload_bytes) {
+    return sizeof(Header) + kNumSlots * SlotBytes(payload_bytes);
+  }
+
+  Ring(void *mem, size_t payload_bytes, bool init)
+      : _header(static_cast<Header *>(mem)),
+        _slots(static_cast<char *>(mem) + sizeof(Header)),
+        _payload_bytes(payload_bytes) {
+    if (init) {
+      new (_header) Header();
+    }
+  }
+
+  bool TryPush(const Message &msg, const void *payload) {
+    auto head = _header->head.load(std::memory_order_relaxed);
+    if (head - _header->tail.load(std::memory_order_acquire) == kNumSlots) {
+      return false;
+    }
+    char *slot = Slot(head);
+    memcpy(slot, &msg, sizeof(Message));
+    if (msg.numel > 0 && payload != nullptr) {
+      size_t nbytes = msg.numel * elem_size(msg.dtype);
+      RV_CHECK(nbytes <= _payload_bytes);
+      memcpy(slot + sizeof(Message), payload, nbytes);
+    }
+    _header->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns the oldest message, or nullptr if the ring is empty. The message
+  // and its payload stay valid until `Pop()`.
+  const Message *Front() const {
+    auto tail = _header->tail.load(std::memory_order_relaxed);
+    if (_header->head.load(std::memory_order_acquire) == tail) {
+      return nullptr;
+    }
+    return reinterpret_cast<const Message *>(Slot(tail));
+  }
+
+  void *FrontPayload() const {
+    return Slot(_header->tail.load(std::memory_order_relaxed)) +
+           sizeof(Message);
+  }
+
+  void Pop() {
+    auto tail = _header->tail.load(std::memory_order_relaxed);
+    _header->tail.store(tail + 1, std::memory_order_release);
+  }
+
+private:
+  struct Header {
+    // written only by the producer
+    alignas(64) std::atomic<uint64_t> head{0};
+    // written only by the consumer
+    alignas(64) std::atomic<uint64_t> tail{0};
+  };
+
+  static size_t SlotBytes(size_t payload_bytes) {
+    return (sizeof(Message) + payload_bytes + 63) / 64 * 64;
+  }
+
+  char *Slot(uint64_t idx) const {
+    return _slots + (idx % kNumSlots) * SlotBytes(_payload_bytes);
+  }
+
+  Header *_header;
+  char *_slots;
+  size_t _payload_bytes;
+};
+
+// Placed in an anonymous shared mapping created before forking
+struct Control {
+  std::atomic<int> n_loaded{0};
+  std::atomic<int> n_attached{0};
+  std::atomic<int> rings_ready{0};
+  std::atomic<int> failed{0};
+  // written by the first and the last stage before `n_loaded` is increased
+  int n_embd = 0;
+  int n_vocab = 0;
+  DType act_dtype = DType::kFloat32;
+};
+
+void Backoff(int &spins) {
+  if (++spins < 1024) {
+    sched_yield();
+  } else {
+    usleep(50);
+  }
+}
+
+} // namespace
+
+struct PipelineShared {
+  Control *control = nullptr;
+  // ring i feeds stage i, the last ring carries the logits back to the driver
+  std::vector<std::string> ring_names;
+  std::vector<std::pair<void *, size_t>> ring_mems;
+  std::vector<Ring> rings;
+  // the stage processes, only known to the driver; -1 once reaped
+  std::vector<pid_t> pids;
+
+  size_t PayloadBytes() const {
+    return std::max<size_t>(control->n_embd * elem_size(control->act_dtype),
+                            control->n_vocab * sizeof(float));
+  }
+
+  void MapRings(bool create) {
+    auto nbytes = Ring::Bytes(PayloadBytes());
+    for (auto &name : ring_names) {
+      int fd = shm_open(name.c_str(),
+                        create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+      RV_CHECK(fd >= 0);
+      if (create) {
+        RV_CHECK(ftruncate(fd, nbytes) == 0);
+      }
+      void *mem =
+          mmap(nullptr, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      RV_CHECK(mem != MAP_FAILED);
+      ring_mems.emplace_back(mem, nbytes);
+      rings.emplace_back(mem, PayloadBytes(), create);
+    }
+  }
+
+  // Throws if any stage has failed. In the driver, a stage which has exited
+  // without reporting it (e.g. killed by a signal) fails the pipeline too.
+  void CheckAlive() {
+    RV_CHECK(!control->failed.load());
+    for (size_t i = 0; i < pids.size(); i++) {
+      if (pids[i] < 0) {
+        continue;
+      }
+      int status;
+      if (waitpid(pids[i], &status, WNOHANG) == pids[i]) {
+        pids[i] = -1;
+        control->failed = 1;
+        throw std::runtime_error(
+            "pipeline stage " + std::to_string(i) +
+            (WIFSIGNALED(status)
+                 ? " was killed by signal " + std::to_string(WTERMSIG(status))
+                 : " exited with status " +
+                       std::to_string(WEXITSTATUS(status))));
+      }
+    }
+  }
+
+  // Called when a wait makes no progress
+  void Wait(int &spins) {
+    // waitpid is a syscall, so it isn't polled on every spin
+    if (spins % 64 == 0) {
+      CheckAlive();
+    } else {
+      RV_CHECK(!control->failed.load());
+    }
+    Backoff(spins);
+  }
+
+  void PushBlocking(Ring &ring, const Message &msg, const void *payload) {
+    for (int spins = 0; !ring.TryPush(msg, payload);) {
+      Wait(spins);
+    }
+  }
+
+  const Message &FrontBlocking(Ring &ring) {
+    const Message *msg;
+    for (int spins = 0; (msg = ring.Front()) == nullptr;) {
+      Wait(spins);
+    }
+    return *msg;
+  }
+
+  // Blocks until `cond` holds. Throws if any stage has failed.
+  template <typename F> void WaitUntil(F cond) {
+    for (int spins = 0; !cond();) {
+      Wait(spins);
+    }
+  }
+
+  void KillStages() {
+    for (auto pid : pids) {
+      if (pid > 0) {
+        kill(pid, SIGKILL);
+      }
+    }
+  }
+
+  void ReapStages() {
+    for (auto &pid : pids) {
+      if (pid > 0) {
+        waitpid(pid, nullptr, 0);
+        pid = -1;
+      }
+    }
+  }
+
+  ~PipelineShared() {
+    for (auto &[mem, nbytes] : ring_mems) {
+      munmap(mem, nbytes);
+    }
+    if (control) {
+      control->~Control();
+      munmap(control, sizeof(Control));
+    }
+  }
+};
+
+namespace {
+
+[[noreturn]] void StageMain(PipelineShared &shared, const std::string &path,
+                            const std::string &strategy, int stage_id,
+                            int n_stages) {
+  // don't outlive the driver
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  // the earlier stages are not children of this one
+  shared.pids.clear();
+  auto &control = *shared.control;
+  try {
+    // the stages run concurrently, so they share the cpu threads
+    cpu::ThreadPool::SetInstanceNumThreads(
+        std::max(1, cpu::ThreadPool::DefaultNumThreads() / n_stages));
+    Model model(path, strategy + " stage=" + std::to_string(stage_id) + "/" +
+                          std::to_string(n_stages));
+    if (stage_id == 0) {
+      control.n_embd = model.n_embd();
+      control.act_dtype = model.act_dtype();
+    }
+    if (stage_id == n_stages - 1) {
+      control.n_vocab = model.n_vocab();
+    }
+    control.n_loaded++;
+    shared.WaitUntil([&]() { return control.rings_ready.load(); });
+    shared.MapRings(false);
+    control.n_attached++;
+
+    bool is_last = stage_id == n_stages - 1;
+    auto &in = shared.rings[stage_id];
+    auto &out = shared.rings[stage_id + 1];
+    std::unordered_map<int, std::vector<std::vector<Tensor>>> sessions;
+    std::vector<LoraAdapter> adapters;
+    while (true) {
+      Message msg = shared.FrontBlocking(in);
+      if (msg.op == Op::kForward) {
+        auto it = sessions.find(msg.session);
+        if (it == sessions.end()) {
+          it = sessions.emplace(msg.session, model.CreateInitialStates()).first;
+        }
+        const LoraAdapter *adapter =
+            msg.adapter >= 0 ? &adapters[msg.adapter] : nullptr;
+        auto forward = [&]() {
+          if (stage_id == 0) {
+            // the adapter overload checks that the device supports adapters,
+            // the other stages have the same device
+            return adapter ? model.Run(msg.id, it->second, *adapter)
+                           : model.Run(msg.id, it->second);
+          }
+          ScopedLora scoped_lora(adapter);
+          return model.RunHidden(Tensor::FromPtr(in.FrontPayload(),
+                                                 {msg.numel}, msg.dtype,
+                                                 Device::kCPU),
+                                 it->second);
+        };
+        Tensor output = Copy(forward(), Device::kCPU);
+        msg.dtype = output.dtype();
+        msg.numel = output.numel();
+        shared.PushBlocking(out, msg, output.data_ptr());
+        in.Pop();
+        continue;
+      }
+      if (msg.op == Op::kLoadAdapter) {
+        adapters.emplace_back(std::string(
+            static_cast<const char *>(in.FrontPayload()), msg.numel));
+        // the last stage acknowledges it to the driver, without the path
+        shared.PushBlocking(out, msg, is_last ? nullptr : in.FrontPayload());
+        in.Pop();
+        continue;
+      }
+      in.Pop();
+      if (msg.op == Op::kRelease) {
+        sessions.erase(msg.session);
+      }
+      // the driver only reads logits from the last ring
+      if (!is_last) {
+        shared.PushBlocking(out, msg, nullptr);
+      }
+      if (msg.op == Op::kStop) {
+        break;
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "pipeline stage " << stage_id << " failed: " << e.what()
+              << std::endl;
+    control.failed = 1;
+    _exit(1);
+  }
+  _exit(0);
+}
+
+int unique_pipeline_id() {
+  static int _unique_id = 0;
+  return _unique_id++;
+}
+
+} // namespace
+
+PipelineModel::PipelineModel(const std::string &path,
+                             const std::string &strategy, int n_stages)
+    : _shared(new PipelineShared), _n_stages(n_stages) {
+  RV_CHECK(n_stages > 0);
+  void *control_mem = mmap(nullptr, sizeof(Control), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  RV_CHECK(control_mem != MAP_FAILED);
+  _shared->control = new (control_mem) Control();
+  auto name_prefix = "/fr_pipeline_" + std::to_string(getpid()) + "_" +
+                     std::to_string(unique_pipeline_id()) + "_";
+  for (int i = 0; i <= n_stages; i++) {
+    _shared->ring_names.push_back(name_prefix + std::to_string(i));
+  }
+
+  try {
+    for (int i = 0; i < n_stages; i++) {
+      // workers load their own model after forking, so that no device context
+      // (e.g. CUDA) is inherited from the driver
+      pid_t pid = fork();
+      RV_CHECK(pid >= 0);
+      if (pid == 0) {
+        StageMain(*_shared, path, strategy, i, n_stages);
+      }
+      _shared->pids.push_back(pid);
+    }
+    auto &control = *_shared->control;
+    // the size of ring slots is only known after the models are loaded
+    _shared->WaitUntil([&]() { return control.n_loaded.load() == n_stages; });
+    _shared->MapRings(true);
+    control.rings_ready = 1;
+    _shared->WaitUntil(
+        [&]() { return control.n_attached.load() == n_stages; });
+  } catch (...) {
+    _shared->KillStages();
+    _shared->ReapStages();
+    for (auto &name : _shared->ring_names) {
+      shm_unlink(name.c_str());
+    }
+    delete _shared;
+    throw;
+  }
+  // every process has mapped the rings, so the names are no longer needed
+  for (auto &name : _shared->ring_names) {
+    shm_unlink(name.c_str());
+  }
+}
+
+PipelineModel::~PipelineModel() {
+  try {
+    _shared->PushBlocking(_shared->rings.front(),
+                          Message{Op::kStop, 0, 0, -1, DType::kFloat32, 0},
+                          nullptr);
+  } catch (const std::exception &) {
+    _shared->KillStages();
+  }
+  _shared->ReapStages();
+  delete _shared;
+}
+
+int PipelineModel::CreateSession() { return _next_session++; }
+
+void PipelineModel::ReleaseSession(int session) {
+  _shared->PushBlocking(
+      _shared->rings.front(),
+      Message{Op::kRelease, session, 0, -1, DType::kFloat32, 0}, nullptr);
+}
+
+int PipelineModel::LoadAdapter(const std::string &path) {
+  // the path is the payload, it has to fit in a ring slot
+  _shared->PushBlocking(_shared->rings.front(),
+                        Message{Op::kLoadAdapter, 0, 0, -1, DType::kInt8,
+                                static_cast<int64_t>(path.size())},
+                        path.data());
+  // errors of the stages are thrown here rather than by the next Run
+  auto &last = _shared->rings.back();
+  RV_CHECK(_shared->FrontBlocking(last).op == Op::kLoadAdapter);
+  last.Pop();
+  return _n_adapters++;
+}
+
+std::vector<Tensor> PipelineModel::Run(const std::vector<int> &sessions,
+                                       const std::vector<int> &ids,
+                                       const std::vector<int> &adapters) {
+  RV_CHECK(sessions.size() == ids.size());
+  RV_CHECK(adapters.empty() || adapters.size() == ids.size());
+  for (int adapter : adapters) {
+    RV_CHECK(adapter >= -1 && adapter < _n_adapters);
+  }
+  auto &first = _shared->rings.front();
+  auto &last = _shared->rings.back();
+  std::vector<Tensor> outputs;
+  size_t n_pushed = 0;
+  int spins = 0;
+  // keep feeding the first stage while draining the last one, otherwise the
+  // rings fill up and the pipeline deadlocks when the batch is large
+  while (outputs.size() < ids.size()) {
+    bool progress = false;
+    if (n_pushed < ids.size() &&
+        first.TryPush(Message{Op::kForward, sessions[n_pushed], ids[n_pushed],
+                              adapters.empty() ? -1 : adapters[n_pushed],
+                              DType::kFloat32, 0},
+                      nullptr)) {
+      n_pushed++;
+      progress = true;
+    }
+    if (auto *msg = last.Front()) {
+      auto output = Tensor::Empty({msg->numel}, msg->dtype, Device::kCPU);
+      memcpy(output.data_ptr(), last.FrontPayload(),
+             msg->numel * elem_size(msg->dtype));
+      last.Pop();
+      outputs.push_back(output);
+      progress = true;
+    }
+    if (progress) {
+      spins = 0;
+    } else {
+      _shared->Wait(spins);
+    }
+  }
+  return outputs;
+}
+
+Tensor PipelineModel::Run(int session, int id) {
+  return Run(std::vector<int>{session}, std::vector<int>{id})[0];
+}
+
+Tensor PipelineModel::Run(int session, const std::vector<int> &ids) {
+  RV_CHECK(!ids.empty());
+  // tokens of one session pipeline too: stage i only needs its own states
+  // from the previous token
+  return Run(std::vector<int>(ids.size(), session), ids).back();
+}
+
+} // namespace rwkv
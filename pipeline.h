@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tensor.h"
+
+namespace rwkv {
+struct PipelineShared;
+
+// Pipeline-parallel inference on one Linux machine. The blocks are split into
+// `n_stages` contiguous ranges, each owned by a forked worker process which
+// loads only its own weights and keeps the states of its blocks for every
+// session. Hidden states flow between stages through shared-memory ring
+// buffers, so when several sessions are run in one batch, stage i works on
+// session j while stage i + 1 works on session j - 1.
+class PipelineModel {
+public:
+  PipelineModel(const std::string &path, const std::string &strategy,
+                int n_stages);
+  ~PipelineModel();
+  FR_DISALLOW_COPY_AND_MOVE(PipelineModel);
+
+  int CreateSession();
+  void ReleaseSession(int session);
+  // Loads the LoRA adapter `path` (see lora.h) in every stage, unmerged, and
+  // returns its index for Run. cpu only.
+  int LoadAdapter(const std::string &path);
+  // Feed `ids[i]` to `sessions[i]` and return the logits of every session.
+  // `adapters[i]` is the adapter of `sessions[i]` in this run, or -1 for
+  // none; an empty `adapters` runs every session without an adapter.
+  std::vector<Tensor> Run(const std::vector<int> &sessions,
+                          const std::vector<int> &ids,
+                          const std::vector<int> &adapters = {});
+  Tensor Run(int session, int id);
+  Tensor Run(int session, const std::vector<int> &ids);
+
+private:
+  PipelineShared *_shared;
+  int _n_stages;
+  int _next_session = 0;
+  int _n_adapters = 0;
+};
+} // namespace rwkv
@@ -0,0 +1,230 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "check.h"
+
+namespace rwkv {
+namespace profiler {
+
+namespace {
+
+constexpr int kMaxDims = 4;
+
+struct Event {
+  const char *name;
+  int64_t start_ns;
+  int64_t end_ns;
+  int64_t allocated;
+  Device device;
+  int layer;
+  int ndim;
+  LengthType dims[kMaxDims];
+};
+
+// written only by its thread, read at exit
+struct Buffer {
+  int tid;
+  std::vector<Event> events;
+  std::atomic<uint64_t> count{0};
+};
+
+struct Buffers {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
+// never destroyed, so that it outlives the dump at exit
+Buffers &AllBuffers() {
+  static auto *buffers = new Buffers;
+  return *buffers;
+}
+
+Buffer &ThreadBuffer() {
+  thread_local Buffer *buffer = [] {
+    auto &all = AllBuffers();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    all.buffers.push_back(std::make_unique<Buffer>());
+    auto *b = all.buffers.back().get();
+    b->tid = all.buffers.size() - 1;
+    b->events.resize(kEventsPerThread);
+    return b;
+  }();
+  return *buffer;
+}
+
+const auto kStartTime = std::chrono::steady_clock::now();
+
+std::string EventName(const Event &event) {
+  if (event.layer >= 0 && std::string(event.name) == "layer") {
+    return "layer " + std::to_string(event.layer);
+  }
+  return event.name;
+}
+
+std::string ShapeString(const Event &event) {
+  std::string str = "[";
+  for (int i = 0; i < event.ndim; i++) {
+    str += (i > 0 ? ", " : "") + std::to_string(event.dims[i]);
+  }
+  if (event.ndim == kMaxDims + 1) {
+    str += ", ...";
+  }
+  return str + "]";
+}
+
+// Calls `fn(tid, event)` on the events kept in all buffers, in the order they
+// were recorded in each buffer. Returns the number of dropped events.
+template <typename Fn> uint64_t ForEachEvent(Fn fn) {
+  auto &all = AllBuffers();
+  std::lock_guard<std::mutex> lock(all.mutex);
+  uint64_t dropped = 0;
+  for (auto &buffer : all.buffers) {
+    uint64_t count = buffer->count.load(std::memory_order_acquire);
+    uint64_t begin = count > kEventsPerThread ? count - kEventsPerThread : 0;
+    dropped += begin;
+    for (uint64_t i = begin; i < count; i++) {
+      fn(buffer->tid, buffer->events[i % kEventsPerThread]);
+    }
+  }
+  return dropped;
+}
+
+void DumpAtExit() {
+  const char *path = std::getenv("FR_PROFILE");
+  std::ofstream trace(path);
+  WriteTrace(trace);
+  if (!trace.good()) {
+    std::cerr << "failed to write the profile to " << path << std::endl;
+  }
+  WriteSummary(std::cerr);
+}
+
+} // namespace
+
+namespace detail {
+
+bool ReadEnabled() {
+  const char *path = std::getenv("FR_PROFILE");
+  if (path == nullptr || *path == '\0') {
+    return false;
+  }
+  std::atexit(DumpAtExit);
+  return true;
+}
+
+int64_t &AllocatedBytes() {
+  thread_local int64_t allocated = 0;
+  return allocated;
+}
+
+int &CurrentLayer() {
+  thread_local int layer = -1;
+  return layer;
+}
+
+int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - kStartTime)
+      .count();
+}
+
+void Record(const char *name, Device device, const Shape *shape,
+            int64_t start_ns, int64_t allocated_before) {
+  int64_t end_ns = Now();
+  auto &buffer = ThreadBuffer();
+  uint64_t count = buffer.count.load(std::memory_order_relaxed);
+  auto &event = buffer.events[count % kEventsPerThread];
+  event.name = name;
+  event.start_ns = start_ns;
+  event.end_ns = end_ns;
+  event.allocated = AllocatedBytes() - allocated_before;
+  event.device = device;
+  event.layer = CurrentLayer();
+  event.ndim = 0;
+  if (shape != nullptr) {
+    // one more than kMaxDims means truncated
+    event.ndim = std::min<int>(shape->size(), kMaxDims + 1);
+    std::copy_n(shape->begin(), std::min(event.ndim, kMaxDims), event.dims);
+  }
+  buffer.count.store(count + 1, std::memory_order_release);
+}
+
+} // namespace detail
+
+void WriteTrace(std::ostream &os) {
+  os << "{\"traceEvents\":[";
+  bool first = true;
+  ForEachEvent([&](int tid, const Event &event) {
+    os << (first ? "\n" : ",\n");
+    first = false;
+    // complete events, timestamps in microseconds
+    os << "{\"name\":\"" << EventName(event) << "\",\"cat\":\""
+       << (std::string(event.name) == "layer" ? "layer" : "op")
+       << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+       << ",\"ts\":" << std::fixed << std::setprecision(3)
+       << event.start_ns / 1e3 << ",\"dur\":"
+       << (event.end_ns - event.start_ns) / 1e3 << ",\"args\":{\"device\":\""
+       << DeviceName(event.device) << "\",\"layer\":" << event.layer
+       << ",\"shape\":\"" << ShapeString(event)
+       << "\",\"allocated_bytes\":" << event.allocated << "}}";
+  });
+  os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+void WriteSummary(std::ostream &os) {
+  struct Stats {
+    int64_t count = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+    int64_t allocated = 0;
+  };
+  std::map<std::pair<std::string, std::string>, Stats> stats;
+  uint64_t dropped = ForEachEvent([&](int, const Event &event) {
+    auto &s = stats[{EventName(event), DeviceName(event.device)}];
+    int64_t ns = event.end_ns - event.start_ns;
+    s.count++;
+    s.total_ns += ns;
+    s.max_ns = std::max(s.max_ns, ns);
+    s.allocated += event.allocated;
+  });
+  std::vector<std::pair<std::pair<std::string, std::string>, Stats>> rows(
+      stats.begin(), stats.end());
+  std::sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) {
+    return a.second.total_ns > b.second.total_ns;
+  });
+
+  std::ostringstream table;
+  table << std::left << std::setw(24) << "op" << std::setw(12) << "device"
+        << std::right << std::setw(10) << "count" << std::setw(14)
+        << "total (ms)" << std::setw(14) << "mean (us)" << std::setw(14)
+        << "max (us)" << std::setw(16) << "allocated (MB)" << "\n";
+  table << std::fixed;
+  for (auto &[key, s] : rows) {
+    table << std::left << std::setw(24) << key.first << std::setw(12)
+          << key.second << std::right << std::setw(10) << s.count
+          << std::setprecision(3) << std::setw(14) << s.total_ns / 1e6
+          << std::setprecision(1) << std::setw(14)
+          << s.total_ns / 1e3 / s.count << std::setw(14) << s.max_ns / 1e3
+          << std::setprecision(2) << std::setw(16)
+          << s.allocated / 1024. / 1024. << "\n";
+  }
+  if (dropped > 0) {
+    table << dropped << " older events were dropped (" << kEventsPerThread
+          << " are kept per thread)\n";
+  }
+  os << table.str() << std::flush;
+}
+
+} // namespace profiler
+} // namespace rwkv
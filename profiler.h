@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <string>
+
+#include <tensor.h>
+
+namespace rwkv {
+namespace profiler {
+
+// An opt-in profiler of the kernels dispatched by kernels.h and of the layers
+// of ModelForward. It is enabled by the FR_PROFILE environment variable, whose
+// value is the path of the Chrome trace (chrome://tracing, ui.perfetto.dev)
+// written at exit, next to an aggregated table on stderr. When it is not set,
+// every hook is a branch on a flag read once.
+//
+// Each thread records into its own ring buffer of kEventsPerThread events, so
+// recording takes no lock; only the last events of a long run are kept.
+constexpr int kEventsPerThread = 1 << 16;
+
+namespace detail {
+bool ReadEnabled();
+int64_t &AllocatedBytes();
+void Record(const char *name, Device device, const Shape *shape,
+            int64_t start_ns, int64_t allocated_before);
+int &CurrentLayer();
+int64_t Now();
+} // namespace detail
+
+inline bool Enabled() {
+  static const bool enabled = detail::ReadEnabled();
+  return enabled;
+}
+
+// Counts the bytes allocated by the calling thread, see TensorStorage
+inline void OnAllocate(size_t nbytes) {
+  if (Enabled()) {
+    detail::AllocatedBytes() += nbytes;
+  }
+}
+
+// Records an op from construction to destruction. `shape` (e.g. of the first
+// input) must outlive the scope.
+class OpScope {
+public:
+  OpScope(const char *name, Device device, const Shape *shape = nullptr) {
+    if (Enabled()) {
+      _name = name;
+      _device = device;
+      _shape = shape;
+      _allocated = detail::AllocatedBytes();
+      _start = detail::Now();
+    }
+  }
+  ~OpScope() {
+    if (_name != nullptr) {
+      detail::Record(_name, _device, _shape, _start, _allocated);
+    }
+  }
+  OpScope(const OpScope &) = delete;
+  OpScope &operator=(const OpScope &) = delete;
+
+private:
+  const char *_name = nullptr;
+  Device _device = Device::kCPU;
+  const Shape *_shape = nullptr;
+  int64_t _allocated = 0;
+  int64_t _start = 0;
+};
+
+// Records a layer, and tags the ops run in it with its index
+class LayerScope {
+public:
+  LayerScope(int layer, Device device) {
+    if (Enabled()) {
+      _active = true;
+      _device = device;
+      _prev = detail::CurrentLayer();
+      detail::CurrentLayer() = layer;
+      _allocated = detail::AllocatedBytes();
+      _start = detail::Now();
+    }
+  }
+  ~LayerScope() {
+    if (_active) {
+      detail::Record("layer", _device, nullptr, _start, _allocated);
+      detail::CurrentLayer() = _prev;
+    }
+  }
+  LayerScope(const LayerScope &) = delete;
+  LayerScope &operator=(const LayerScope &) = delete;
+
+private:
+  bool _active = false;
+  Device _device = Device::kCPU;
+  int _prev = -1;
+  int64_t _allocated = 0;
+  int64_t _start = 0;
+};
+
+// The events recorded so far, as Chrome trace JSON
+void WriteTrace(std::ostream &os);
+// The total time, count and allocated bytes of each (op, device)
+void WriteSummary(std::ostream &os);
+
+} // namespace profiler
+} // namespace rwkv
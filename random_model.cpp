@@ -0,0 +1,190 @@
+#include "random_model.h"
+
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <vector>
+
+#include <msgpack.hpp>
+
+#include "check.h"
+#include "kernels/cpu/thread_pool.h"
+
+namespace rwkv {
+
+namespace {
+// splitmix64, seeded per block of elements so that the values do not depend
+// on the number of threads
+uint64_t splitmix64(uint64_t &state) {
+  uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+constexpr int64_t kBlockSize = 1 << 16;
+
+class Writer {
+public:
+  Writer(const std::string &path, uint64_t seed)
+      : _file(path, std::ios::binary | std::ios::out), _packer(_file),
+        _seed(seed) {
+    RV_CHECK(_file.good());
+  }
+
+  bool good() const { return _file.good(); }
+
+  msgpack::packer<std::ofstream> &packer() { return _packer; }
+
+  // Packs a tensor map (dtype, shape, data) with `fn(u)` of uniform random
+  // u in [0, 1) as elements
+  void tensor(const std::vector<int64_t> &shape, DType dtype,
+              const std::function<float(float)> &fn) {
+    int64_t numel = 1;
+    for (auto d : shape) {
+      numel *= d;
+    }
+    const int elem_size = dtype == DType::kFloat16 ? 2 : 4;
+    _buffer.resize(numel * elem_size);
+    const uint64_t tensor_seed = splitmix64(_seed);
+    const int64_t num_blocks = (numel + kBlockSize - 1) / kBlockSize;
+    auto &pool = cpu::ThreadPool::Instance();
+    pool.Run([&](int thread_id) {
+      auto [begin, end] =
+          cpu::ShardRange(num_blocks, thread_id, pool.num_threads(), 1);
+      for (int64_t block = begin; block < end; block++) {
+        uint64_t state = tensor_seed ^ (block * 0xd1b54a32d192ed03ULL);
+        for (int64_t i = block * kBlockSize;
+             i < std::min(numel, (block + 1) * kBlockSize); i++) {
+          float u = (splitmix64(state) >> 40) * (1.f / (1 << 24));
+          float x = fn(u);
+          if (dtype == DType::kFloat16) {
+            reinterpret_cast<float16 *>(_buffer.data())[i] = float16(x);
+          } else {
+            reinterpret_cast<float *>(_buffer.data())[i] = x;
+          }
+        }
+      }
+    });
+
+    _packer.pack_map(3);
+    _packer.pack(std::string("dtype"));
+    _packer.pack(std::string(dtype == DType::kFloat16 ? "torch.float16"
+                                                      : "torch.float32"));
+    _packer.pack(std::string("shape"));
+    _packer.pack(shape);
+    _packer.pack(std::string("data"));
+    _packer.pack_bin(_buffer.size());
+    _packer.pack_bin_body(_buffer.data(), _buffer.size());
+  }
+
+  void weight(const std::string &name, const std::vector<int64_t> &shape,
+              DType dtype, const std::function<float(float)> &fn) {
+    _packer.pack(name);
+    tensor(shape, dtype, fn);
+  }
+
+private:
+  std::ofstream _file;
+  msgpack::packer<std::ofstream> _packer;
+  uint64_t _seed;
+  std::vector<char> _buffer;
+};
+
+std::function<float(float)> uniform(float low, float high) {
+  return [=](float u) { return low + (high - low) * u; };
+}
+} // namespace
+
+void WriteRandomModel(const std::string &path,
+                      const RandomModelConfig &config) {
+  RV_CHECK(config.version == 4 || config.version == 5);
+  RV_CHECK(config.dtype == DType::kFloat16 || config.dtype == DType::kFloat32);
+  RV_CHECK(config.n_layer > 0 && config.n_embd > 0 && config.n_vocab > 0);
+  const int64_t C = config.n_embd;
+  const int64_t F = 4 * C;
+  const int64_t H = config.n_head;
+  if (config.version == 5) {
+    RV_CHECK(H > 0 && C % H == 0);
+  }
+  const DType dtype = config.dtype;
+
+  Writer writer(path, config.seed);
+  auto &pk = writer.packer();
+  pk.pack_map(config.version == 5 ? 5 : 4);
+  pk.pack(std::string("n_layer"));
+  pk.pack(config.n_layer);
+  pk.pack(std::string("n_embd"));
+  pk.pack(config.n_embd);
+  if (config.version == 5) {
+    pk.pack(std::string("n_head"));
+    pk.pack(config.n_head);
+  }
+
+  // weights are [in, out], scaled so that an output has the variance of an
+  // input
+  auto matrix = [&](const std::string &name, int64_t in, int64_t out) {
+    float s = std::sqrt(3.f / in);
+    writer.weight(name, {in, out}, dtype, uniform(-s, s));
+  };
+  auto layer_norm = [&](const std::string &prefix, int64_t n) {
+    writer.weight(prefix + "weight", {n}, dtype, uniform(0.7f, 1.3f));
+    writer.weight(prefix + "bias", {n}, dtype, uniform(-0.3f, 0.3f));
+  };
+  auto time_mix = [&](const std::string &name) {
+    writer.weight(name, {C}, dtype, uniform(0.f, 1.f));
+  };
+
+  pk.pack(std::string("weights"));
+  pk.pack_map(config.n_layer * (config.version == 5 ? 22 : 18) + 3);
+  for (int i = 0; i < config.n_layer; i++) {
+    std::string bbb_pf = "blocks." + std::to_string(i) + ".";
+    std::string att_pf = bbb_pf + "att.";
+    std::string ffn_pf = bbb_pf + "ffn.";
+    layer_norm(bbb_pf + "ln1.", C);
+    time_mix(att_pf + "time_mix_k");
+    time_mix(att_pf + "time_mix_v");
+    time_mix(att_pf + "time_mix_r");
+    if (config.version == 5) {
+      time_mix(att_pf + "time_mix_g");
+      // exp(-exp(decay)) and time_faaaa, as converted by ChatRWKV
+      writer.weight(att_pf + "time_decay", {H, C / H, 1}, DType::kFloat32,
+                    [](float u) { return std::exp(-std::exp(u - 0.5f)); });
+      writer.weight(att_pf + "time_faaaa", {H, C / H, 1}, DType::kFloat32,
+                    uniform(-0.3f, 0.3f));
+      matrix(att_pf + "key.weight", C, C);
+      matrix(att_pf + "value.weight", C, C);
+      matrix(att_pf + "receptance.weight", C, C);
+      matrix(att_pf + "gate.weight", C, C);
+      matrix(att_pf + "output.weight", C, C);
+      layer_norm(att_pf + "ln_x.", C);
+    } else {
+      // -exp(decay), as converted by ChatRWKV
+      writer.weight(att_pf + "time_decay", {C}, DType::kFloat32,
+                    [](float u) { return -std::exp(u - 0.5f); });
+      writer.weight(att_pf + "time_first", {C}, DType::kFloat32,
+                    uniform(-0.3f, 0.3f));
+      matrix(att_pf + "key.weight", C, C);
+      matrix(att_pf + "value.weight", C, C);
+      matrix(att_pf + "receptance.weight", C, C);
+      matrix(att_pf + "output.weight", C, C);
+    }
+    layer_norm(bbb_pf + "ln2.", C);
+    time_mix(ffn_pf + "time_mix_k");
+    time_mix(ffn_pf + "time_mix_r");
+    matrix(ffn_pf + "key.weight", C, F);
+    matrix(ffn_pf + "value.weight", F, C);
+    matrix(ffn_pf + "receptance.weight", C, C);
+  }
+  layer_norm("ln_out.", C);
+  matrix("head.weight", C, config.n_vocab);
+
+  pk.pack(std::string("embd_weights"));
+  pk.pack_array(config.n_vocab);
+  for (int i = 0; i < config.n_vocab; i++) {
+    writer.tensor({C}, dtype, uniform(-1.f, 1.f));
+  }
+  RV_CHECK(writer.good());
+}
+
+} // namespace rwkv
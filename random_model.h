@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "tensor.h"
+
+namespace rwkv {
+// The shape of a model written by `WriteRandomModel`
+struct RandomModelConfig {
+  int version = 4;  // 4 or 5 (RWKV-5.2)
+  int n_layer = 12;
+  int n_embd = 768;
+  int n_head = 12;  // RWKV-5 only
+  int n_vocab = 65536;
+  // the dtype of the weights, kFloat16 or kFloat32. time_decay and
+  // time_first are always fp32 as in ChatRWKV.
+  DType dtype = DType::kFloat16;
+  uint64_t seed = 0;
+};
+
+// Writes a faster-rwkv weight file (as tools/convert_weight.py) with random
+// weights, for tests and benchmarks which need no real model. The weights are
+// scaled so that the activations stay in a realistic range. The file is
+// streamed, so models of any size can be generated with little memory, and
+// the same config always gives the same file.
+void WriteRandomModel(const std::string &path,
+                      const RandomModelConfig &config);
+} // namespace rwkv
@@ -2,11 +2,26 @@
 #include "check.h"
 #include <iostream>
 #include <kernels/kernels.h>
-#include <kernels/ncnn-meta/kernels.h>
 #include <stdexcept>
 
 namespace rwkv {
 
+std::string DeviceName(Device device) {
+  switch (device) {
+  case Device::kCPU:
+    return "cpu";
+  case Device::kCUDA:
+    return "cuda";
+  case Device::kNCNNMeta:
+    return "ncnn-meta";
+  case Device::kONNXMeta:
+    return "onnx-meta";
+  case Device::kNCNN:
+    return "ncnn";
+  }
+  return "unknown";
+}
+
 void print_tensor(const Tensor &t, const std::string &name) {
   std::cout << "Tensor " << name << std::endl;
   auto t_cpu = Copy(t, Device::kCPU);
@@ -43,9 +58,12 @@ Tensor Copy(const Tensor &x, Device device, bool always_copy) {
     return y;
   }
 #endif
-  if (device == Device::kNCNNMeta && x.device() == Device::kCPU) {
-    y = ncnnmeta::MemoryData(x);
-    return y;
+  if ((device == Device::kNCNNMeta || device == Device::kONNXMeta) &&
+      x.device() == Device::kCPU) {
+    // kernels/ncnn-meta and kernels/onnx-meta are only built with
+    // FR_ENABLE_NCNN and FR_ENABLE_ONNX
+    return KernelRegistry::Instance().Get<Tensor (*)(const Tensor &)>(
+        "constant", device)(x);
   }
   if (device == Device::kCPU && x.device() == Device::kCPU) {
     memcpy(y.data_ptr(), x.data_ptr(), x.numel() * x.elem_size());
@@ -74,7 +92,13 @@ Tensor Tensor::Empty(const Shape &shape, DType dtype, Device device) {
 
 Tensor Tensor::FromPtr(void *dptr, const Shape &shape, DType dtype,
                        Device device) {
-  auto storage = std::make_shared<TensorStorage>(dptr, device);
+  return FromPtr(dptr, shape, dtype, device, nullptr);
+}
+
+Tensor Tensor::FromPtr(void *dptr, const Shape &shape, DType dtype,
+                       Device device, std::shared_ptr<void> owner) {
+  auto storage =
+      std::make_shared<TensorStorage>(dptr, device, std::move(owner));
   Tensor tensor;
   tensor._storage = storage;
   tensor._shape = shape;
@@ -104,20 +128,35 @@ Tensor operator/(const Tensor &lhs, const Tensor &rhs) {
 }
 
 TensorStorage::TensorStorage(size_t nbytes, Device device) {
-  _data = allocator(device).Allocate(nbytes);
+  _nbytes = nbytes;
+  _tag = CurrentAllocTag();
+  _data = allocator(device).Allocate(nbytes, _tag);
+  profiler::OnAllocate(nbytes);
   _device = device;
   _is_view = false;
 }
 
-TensorStorage::TensorStorage(void *external_ptr, Device device) {
+TensorStorage::TensorStorage(void *external_ptr, Device device)
+    : TensorStorage(external_ptr, device, nullptr) {}
+
+TensorStorage::TensorStorage(void *external_ptr, Device device,
+                             std::shared_ptr<void> owner) {
   _data = external_ptr;
   _device = device;
   _is_view = true;
+  _owner = std::move(owner);
 }
 
 TensorStorage::~TensorStorage() {
   if (!_is_view) {
-    allocator(_device).Deallocate(_data);
+    allocator(_device).Deallocate(_data, _nbytes, _tag);
+  }
+}
+
+void TensorStorage::set_alloc_tag(AllocTag tag) {
+  if (!_is_view) {
+    allocator(_device).Retag(_nbytes, _tag, tag);
+    _tag = tag;
   }
 }
 
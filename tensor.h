@@ -10,9 +10,16 @@
 #endif
 
 #include <check.h>
+#include <kernels/allocator.h>
+// half.hpp uses F16C intrinsics when __F16C__ is defined (e.g. with
+// -march=native) but checks for them before including immintrin.h
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
 #include <half.hpp>
 
 namespace rwkv {
+
 enum class DType {
   kInt8,
   kFloat16,
@@ -26,6 +33,8 @@ enum class Device {
   kONNXMeta,
   kNCNN,
 };
+// e.g. "cpu", as in the strategy
+std::string DeviceName(Device device);
 template <typename T> inline const DType dtype_v = DType::kFloat32;
 template <> inline const DType dtype_v<float16> = DType::kFloat16;
 #ifdef FR_ENABLE_CUDA
@@ -61,16 +70,23 @@ class TensorStorage {
 public:
   TensorStorage(size_t nbytes, Device device);
   TensorStorage(void *external_ptr, Device device);
+  // a view which keeps `owner` (e.g. the buffer holding `external_ptr`) alive
+  TensorStorage(void *external_ptr, Device device,
+                std::shared_ptr<void> owner);
   ~TensorStorage();
   void *data_ptr() const { return _data; }
   Device device() const { return _device; }
+  // see AllocTag, a no-op for views
+  void set_alloc_tag(AllocTag tag);
   FR_DISALLOW_COPY_AND_MOVE(TensorStorage);
 
 private:
   void *_data;
   size_t _nbytes;
+  AllocTag _tag = AllocTag::kActivations;
   bool _is_view = false;
   Device _device;
+  std::shared_ptr<void> _owner;
 };
 
 // prefer to pass Tensor by reference, but even if we pass by value, it's
@@ -92,12 +108,19 @@ public:
   LengthType size(int64_t dim) const { return _shape[dim]; }
   LengthType numel() const { return num_elements(_shape); }
   int32_t elem_size() const { return ::rwkv::elem_size(_dtype); }
+  // Accounts the storage of this tensor as `tag` from now on, see AllocTag
+  void set_alloc_tag(AllocTag tag) { _storage->set_alloc_tag(tag); }
 
   static Tensor Empty(const Shape &shape, DType dtype, Device device);
   static Tensor FromPtr(void *ptr, const Shape &shape, DType dtype, Device device);
+  // a view of `ptr` which keeps `owner` alive
+  static Tensor FromPtr(void *ptr, const Shape &shape, DType dtype,
+                        Device device, std::shared_ptr<void> owner);
 
   std::string name;
   bool is_constant = false;
+  // a kCPU weight repacked by cpu::shard_weight, see kernels/cpu/matmul.h
+  bool is_sharded = false;
 private:
   Tensor() = default;
   std::shared_ptr<TensorStorage> _storage;
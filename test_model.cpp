@@ -1,7 +1,34 @@
+#ifdef FR_ENABLE_ONNX
+#include "calibrate.h"
+#endif
+#include "kernels/cpu/matmul.h"
+#include "kernels/cpu/thread_pool.h"
+#include "kernels/kernels.h"
+#ifdef FR_ENABLE_ONNX
+#include "kernels/onnx-meta/kernels.h"
+#endif
+#include "lora.h"
 #include "model.h"
+#ifdef FR_ENABLE_PIPELINE
+#include "pipeline.h"
+#endif
+#include "random_model.h"
+#include "test_utils.h"
+
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include <msgpack.hpp>
 
 #include <gtest/gtest.h>
 
+using namespace rwkv::test;
+
 TEST(Model, load) {
   // rwkv::Model model("/home/dev/files/repos/rwkv.neo/models/rwkv-4-1.5b.fr", "cuda fp16");
   rwkv::Model model("../rwkv-4-0.1b-fp16.fr", "cuda fp16");
@@ -21,3 +48,572 @@ TEST(Model, ncnn) {
   EXPECT_FLOAT_EQ(output_ptr[0], -0.19592285);
   EXPECT_FLOAT_EQ(output_ptr[9], -10.234375);
 }
+
+TEST(Model, random_weights) {
+  for (int version : {4, 5}) {
+    auto config = TestModelConfig();
+    config.version = version;
+    config.n_head = 2;
+    rwkv::Model model(WriteTestModel(config), "cpu fp32");
+    auto states = model.CreateInitialStates();
+    auto output =
+        rwkv::Copy(model.Run({1, 2, 3}, states), rwkv::Device::kCPU);
+    auto states2 = model.CreateInitialStates();
+    model.Run(1, states2);
+    model.Run(2, states2);
+    auto output2 = rwkv::Copy(model.Run(3, states2), rwkv::Device::kCPU);
+    ASSERT_EQ(output.numel(), 100);
+    for (int i = 0; i < output.numel(); i++) {
+      EXPECT_TRUE(std::isfinite(output.data_ptr<float>()[i]));
+      EXPECT_NEAR(output.data_ptr<float>()[i], output2.data_ptr<float>()[i],
+                  1e-4);
+    }
+    if (version == 5) {
+      // from tools/rwkv5_reference.py on the same model, i.e. on the file of
+      // `generate_model random-v5.fr 2 128 100 fp16 v5 2` with ids 1 2 3
+      const float expected[] = {-0.57246, -1.34377, 1.25479, 1.22814,
+                                0.21116,  -1.23065, -0.74833, -0.86901,
+                                -1.15559, 0.06255};
+      for (int i = 0; i < 10; i++) {
+        EXPECT_NEAR(output.data_ptr<float>()[i], expected[i], 1e-3);
+      }
+    }
+  }
+}
+
+TEST(Model, cpu_rejects_fp16_activations) {
+  auto config = TestModelConfig();
+  config.n_layer = 1;
+  config.n_embd = 64;
+  config.n_vocab = 10;
+  EXPECT_THROW(rwkv::Model(WriteTestModel(config), "cpu fp16"),
+               std::runtime_error);
+}
+
+TEST(Model, memory_stats) {
+  const int kStates = static_cast<int>(rwkv::AllocTag::kStates);
+  const int kWeights = static_cast<int>(rwkv::AllocTag::kWeights);
+  rwkv::Model model(WriteTestModel(TestModelConfig()), "cpu fp32");
+  // the stats are per device, other tests may have allocated before
+  auto loaded = model.MemoryStats();
+  EXPECT_GE(loaded.tag_current_bytes[kWeights], 100 * 128 * 4);
+  model.ResetPeakMemoryStats();
+  EXPECT_EQ(model.MemoryStats().peak_bytes, loaded.current_bytes);
+  {
+    auto states = model.CreateInitialStates();
+    auto created = model.MemoryStats();
+    // 5 states of 128 floats per layer
+    EXPECT_EQ(created.tag_current_bytes[kStates] -
+                  loaded.tag_current_bytes[kStates],
+              2 * 5 * 512);
+    model.Run({1, 2, 3}, states);
+    auto run = model.MemoryStats();
+    EXPECT_EQ(run.num_forwards - created.num_forwards, 3);
+    // the replaced states are accounted as states, and nothing leaks
+    EXPECT_EQ(run.tag_current_bytes[kStates],
+              created.tag_current_bytes[kStates]);
+    EXPECT_EQ(run.current_bytes, created.current_bytes);
+    EXPECT_GE(run.peak_bytes, run.current_bytes);
+  }
+  EXPECT_EQ(model.MemoryStats().current_bytes, loaded.current_bytes);
+}
+
+TEST(RWKV, cpu_sharded_matmul) {
+  const int k = 67, n = 131;
+  auto a = rwkv::Tensor::Empty({k}, rwkv::DType::kFloat32, rwkv::Device::kCPU);
+  auto b = rwkv::Tensor::Empty({k, n}, rwkv::DType::kFloat16, rwkv::Device::kCPU);
+  for (int i = 0; i < k; i++) {
+    a.data_ptr<float>()[i] = (i % 7) * 0.25f - 0.5f;
+  }
+  for (int i = 0; i < k * n; i++) {
+    b.data_ptr<rwkv::float16>()[i] = static_cast<rwkv::float16>((i % 5) * 0.125f);
+  }
+  auto expected = rwkv::matmul(a, b);
+  auto actual = rwkv::matmul(a, rwkv::cpu::shard_weight(b));
+  for (int i = 0; i < n; i++) {
+    EXPECT_NEAR(actual.data_ptr<float>()[i], expected.data_ptr<float>()[i],
+                1e-4);
+  }
+}
+
+// An exception of any slice is rethrown by Run once every slice is done,
+// and the pool can run again
+TEST(RWKV, thread_pool_rethrows) {
+  rwkv::cpu::ThreadPool pool(4);
+  for (int thrower : {0, 2}) {
+    std::atomic<int> done{0};
+    auto slice = [&](int thread_id) {
+      if (thread_id == thrower) {
+        throw std::runtime_error("slice failed");
+      }
+      done++;
+    };
+    EXPECT_THROW(pool.Run(slice), std::runtime_error);
+    EXPECT_EQ(done.load(), 3);
+  }
+  std::atomic<int> done{0};
+  pool.Run([&](int) { done++; });
+  EXPECT_EQ(done.load(), 4);
+}
+
+namespace {
+template <typename Packer, typename T>
+void PackTensor(Packer &pk, const std::string &dtype,
+                const std::vector<int64_t> &shape, const std::vector<T> &data) {
+  pk.pack_map(3);
+  pk.pack(std::string("dtype"));
+  pk.pack(dtype);
+  pk.pack(std::string("shape"));
+  pk.pack(shape);
+  pk.pack(std::string("data"));
+  pk.pack_bin(data.size() * sizeof(T));
+  pk.pack_bin_body(reinterpret_cast<const char *>(data.data()),
+                   data.size() * sizeof(T));
+}
+} // namespace
+
+TEST(Model, delta) {
+  const int C = 128;
+  auto config = TestModelConfig();
+  // fp32, so that the materialized weights are not rounded to fp16
+  config.dtype = rwkv::DType::kFloat32;
+  auto model_path = WriteTestModel(config);
+  auto delta_path = TestPath(".frd");
+  {
+    // an int8 delta of a matrix and a whole replaced vector, as written by
+    // tools/make_delta.py
+    std::ofstream file(delta_path, std::ios::binary);
+    msgpack::packer<std::ofstream> pk(file);
+    pk.pack_map(4);
+    pk.pack(std::string("n_layer"));
+    pk.pack(config.n_layer);
+    pk.pack(std::string("n_embd"));
+    pk.pack(C);
+    pk.pack(std::string("weights"));
+    pk.pack_map(2);
+    pk.pack(std::string("blocks.1.ffn.key.weight"));
+    pk.pack_map(2);
+    std::vector<int8_t> q(C * 4 * C);
+    for (int i = 0; i < static_cast<int>(q.size()); i++) {
+      q[i] = static_cast<int8_t>(i * 37 % 255 - 127);
+    }
+    pk.pack(std::string("delta"));
+    PackTensor(pk, "torch.int8", {C, 4 * C}, q);
+    pk.pack(std::string("scale"));
+    PackTensor(pk, "torch.float32", {4 * C}, std::vector<float>(4 * C, 1e-3));
+    pk.pack(std::string("blocks.0.ln1.bias"));
+    PackTensor(pk, "torch.float16", {C},
+               std::vector<rwkv::float16>(C, rwkv::float16(0.1f)));
+    pk.pack(std::string("embd_weights"));
+    pk.pack_map(0);
+  }
+  rwkv::Model base(model_path, "cpu fp32");
+  rwkv::Model on_the_fly(base, delta_path);
+  rwkv::Model materialized(base, delta_path, /*materialize=*/true);
+  auto run = [](const rwkv::Model &model) {
+    auto states = model.CreateInitialStates();
+    return rwkv::Copy(model.Run({1, 2, 3}, states), rwkv::Device::kCPU);
+  };
+  auto base_output = run(base);
+  auto output = run(on_the_fly);
+  auto expected = run(materialized);
+  float max_change = 0;
+  for (int i = 0; i < output.numel(); i++) {
+    EXPECT_NEAR(output.data_ptr<float>()[i], expected.data_ptr<float>()[i],
+                1e-4);
+    max_change = std::max(max_change, std::abs(output.data_ptr<float>()[i] -
+                                               base_output.data_ptr<float>()[i]));
+  }
+  EXPECT_GT(max_change, 1e-2);
+  // the base model is not changed by its variants
+  auto base_output2 = run(base);
+  for (int i = 0; i < base_output.numel(); i++) {
+    EXPECT_EQ(base_output.data_ptr<float>()[i],
+              base_output2.data_ptr<float>()[i]);
+  }
+}
+
+namespace {
+using MsgpackMap = std::unordered_map<std::string, msgpack::object>;
+
+std::vector<float> Fp32Data(const msgpack::object &mp_tensor) {
+  auto map = mp_tensor.as<MsgpackMap>();
+  EXPECT_EQ(map["dtype"].as<std::string>(), "torch.float32");
+  auto data = map["data"].as<std::vector<char>>();
+  std::vector<float> ret(data.size() / sizeof(float));
+  std::copy_n(data.data(), data.size(), reinterpret_cast<char *>(ret.data()));
+  return ret;
+}
+
+// Copies the fp32 model `path` to `merged_path` with `w += scale * a @ b`
+// for every `name -> (a, b)` in `lora`, a is [K, r] and b is [r, N]
+void WriteMergedModel(
+    const std::string &path, const std::string &merged_path,
+    const std::map<std::string,
+                   std::pair<std::vector<float>, std::vector<float>>> &lora,
+    int rank, float scale) {
+  std::ifstream infile(path, std::ios::binary);
+  std::vector<char> data((std::istreambuf_iterator<char>(infile)),
+                         std::istreambuf_iterator<char>());
+  auto unpacked = msgpack::unpack(data.data(), data.size());
+  auto model = unpacked.get().as<MsgpackMap>();
+  std::ofstream file(merged_path, std::ios::binary);
+  msgpack::packer<std::ofstream> pk(file);
+  pk.pack_map(4);
+  pk.pack(std::string("n_layer"));
+  pk.pack(model["n_layer"].as<int>());
+  pk.pack(std::string("n_embd"));
+  pk.pack(model["n_embd"].as<int>());
+  auto weights = model["weights"].as<std::map<std::string, msgpack::object>>();
+  pk.pack(std::string("weights"));
+  pk.pack_map(weights.size());
+  for (auto &[name, mp_tensor] : weights) {
+    auto w = Fp32Data(mp_tensor);
+    auto shape =
+        mp_tensor.as<MsgpackMap>()["shape"].as<std::vector<int64_t>>();
+    auto it = lora.find(name);
+    if (it != lora.end()) {
+      auto &[a, b] = it->second;
+      auto k = shape[0];
+      auto n = shape[1];
+      for (int64_t i = 0; i < k; i++) {
+        for (int64_t j = 0; j < n; j++) {
+          float sum = 0;
+          for (int l = 0; l < rank; l++) {
+            sum += a[i * rank + l] * b[l * n + j];
+          }
+          w[i * n + j] += scale * sum;
+        }
+      }
+    }
+    pk.pack(name);
+    PackTensor(pk, "torch.float32", shape, w);
+  }
+  auto embd_weights =
+      model["embd_weights"].as<std::vector<msgpack::object>>();
+  pk.pack(std::string("embd_weights"));
+  pk.pack_array(embd_weights.size());
+  for (auto &mp_tensor : embd_weights) {
+    auto shape =
+        mp_tensor.as<MsgpackMap>()["shape"].as<std::vector<int64_t>>();
+    PackTensor(pk, "torch.float32", shape, Fp32Data(mp_tensor));
+  }
+}
+
+const int kTestLoraRank = 4;
+const float kTestLoraAlpha = 8;
+
+// Writes a random LoRA adapter of a few weights of the TestModelConfig()
+// model to `path` and returns its `name -> (a, b)`, see WriteMergedModel
+std::map<std::string, std::pair<std::vector<float>, std::vector<float>>>
+WriteTestLora(const std::string &path, uint32_t seed) {
+  const int C = 128;
+  std::map<std::string, std::pair<int, int>> shapes = {
+      {"blocks.0.att.key.weight", {C, C}},
+      {"blocks.1.ffn.value.weight", {4 * C, C}},
+      {"head.weight", {C, 100}}};
+  std::map<std::string, std::pair<std::vector<float>, std::vector<float>>>
+      lora;
+  std::ofstream file(path, std::ios::binary);
+  msgpack::packer<std::ofstream> pk(file);
+  pk.pack_map(2);
+  pk.pack(std::string("alpha"));
+  pk.pack(kTestLoraAlpha);
+  pk.pack(std::string("weights"));
+  pk.pack_map(shapes.size());
+  auto random = [&seed](int n) {
+    std::vector<float> ret(n);
+    for (auto &x : ret) {
+      seed = seed * 1103515245 + 12345;
+      x = ((seed >> 8) & 0xffff) / 65536.f * 0.4f - 0.2f;
+    }
+    return ret;
+  };
+  for (auto &[name, shape] : shapes) {
+    auto [k, n] = shape;
+    auto &ab = lora[name];
+    ab = {random(k * kTestLoraRank), random(kTestLoraRank * n)};
+    pk.pack(name);
+    pk.pack_map(2);
+    pk.pack(std::string("a"));
+    PackTensor(pk, "torch.float32", {k, kTestLoraRank}, ab.first);
+    pk.pack(std::string("b"));
+    PackTensor(pk, "torch.float32", {kTestLoraRank, n}, ab.second);
+  }
+  return lora;
+}
+} // namespace
+
+TEST(Model, lora) {
+  auto config = TestModelConfig();
+  config.dtype = rwkv::DType::kFloat32;
+  auto model_path = WriteTestModel(config);
+  auto lora_path = TestPath(".lora");
+  auto merged_path = TestPath("_merged.fr");
+  auto lora = WriteTestLora(lora_path, 1);
+  WriteMergedModel(model_path, merged_path, lora, kTestLoraRank,
+                   kTestLoraAlpha / kTestLoraRank);
+
+  auto run = [](const rwkv::Model &model, const rwkv::LoraAdapter *adapter) {
+    auto states = model.CreateInitialStates();
+    return rwkv::Copy(adapter ? model.Run({1, 2, 3}, states, *adapter)
+                              : model.Run({1, 2, 3}, states),
+                      rwkv::Device::kCPU);
+  };
+  rwkv::Model base(model_path, "cpu fp32");
+  rwkv::LoraAdapter adapter(lora_path);
+  auto base_output = run(base, nullptr);
+  auto unmerged = run(base, &adapter);
+  auto merged =
+      run(rwkv::Model(model_path, "cpu fp32 lora=" + lora_path), nullptr);
+  auto expected = run(rwkv::Model(merged_path, "cpu fp32"), nullptr);
+  float max_change = 0;
+  for (int i = 0; i < expected.numel(); i++) {
+    EXPECT_NEAR(unmerged.data_ptr<float>()[i], expected.data_ptr<float>()[i],
+                1e-4);
+    EXPECT_NEAR(merged.data_ptr<float>()[i], expected.data_ptr<float>()[i],
+                1e-4);
+    max_change = std::max(max_change, std::abs(expected.data_ptr<float>()[i] -
+                                               base_output.data_ptr<float>()[i]));
+  }
+  EXPECT_GT(max_change, 1e-2);
+}
+
+// Sessions with different adapters (and one without) decoded in one batch,
+// against each session run on its own
+TEST(Model, batch_lora) {
+  auto config = TestModelConfig();
+  config.dtype = rwkv::DType::kFloat32;
+  auto model_path = WriteTestModel(config);
+  auto lora_path_1 = TestPath("_1.lora");
+  auto lora_path_2 = TestPath("_2.lora");
+  WriteTestLora(lora_path_1, 1);
+  WriteTestLora(lora_path_2, 2);
+  rwkv::Model model(model_path, "cpu fp32");
+  rwkv::LoraAdapter adapter_1(lora_path_1);
+  rwkv::LoraAdapter adapter_2(lora_path_2);
+  std::vector<const rwkv::LoraAdapter *> loras = {&adapter_1, &adapter_2,
+                                                  nullptr};
+  const std::vector<std::vector<int>> ids = {{1, 2, 3}, {4, 5, 6}, {7, 8, 9}};
+
+  std::vector<rwkv::Tensor> expected;
+  for (size_t b = 0; b < loras.size(); b++) {
+    auto states = model.CreateInitialStates();
+    expected.push_back(rwkv::Copy(
+        loras[b] ? model.Run(ids[b], states, *loras[b])
+                 : model.Run(ids[b], states),
+        rwkv::Device::kCPU));
+  }
+  std::vector<std::vector<std::vector<rwkv::Tensor>>> states(loras.size());
+  std::vector<std::vector<std::vector<rwkv::Tensor>> *> state_ptrs;
+  for (auto &session_states : states) {
+    session_states = model.CreateInitialStates();
+    state_ptrs.push_back(&session_states);
+  }
+  std::vector<rwkv::Tensor> outputs;
+  for (size_t t = 0; t < ids[0].size(); t++) {
+    outputs.push_back(model.RunBatch({ids[0][t], ids[1][t], ids[2][t]},
+                                     state_ptrs, loras));
+  }
+  auto &output = outputs.back();
+  ASSERT_EQ(output.shape(), rwkv::Shape({3, 100}));
+  for (size_t b = 0; b < loras.size(); b++) {
+    for (int i = 0; i < 100; i++) {
+      EXPECT_NEAR(output.data_ptr<float>()[b * 100 + i],
+                  expected[b].data_ptr<float>()[i], 1e-5);
+    }
+  }
+}
+
+// A low-rank delta of every matmul weight (make_delta.py --form lowrank),
+// against the model merged by hand, and the memory a variant takes
+TEST(Model, low_rank_delta) {
+  const int C = 128;
+  const int kRank = 2;
+  const int kVariants = 5;
+  auto config = TestModelConfig();
+  config.dtype = rwkv::DType::kFloat32;
+  auto model_path = WriteTestModel(config);
+  auto delta_path = TestPath(".frd");
+  auto merged_path = TestPath("_merged.fr");
+
+  std::map<std::string, std::pair<int, int>> shapes = {
+      {"head.weight", {C, 100}}};
+  for (int i = 0; i < config.n_layer; i++) {
+    auto prefix = "blocks." + std::to_string(i) + ".";
+    for (auto name : {"key", "value", "receptance", "output"}) {
+      shapes[prefix + "att." + name + ".weight"] = {C, C};
+    }
+    shapes[prefix + "ffn.key.weight"] = {C, 4 * C};
+    shapes[prefix + "ffn.value.weight"] = {4 * C, C};
+    shapes[prefix + "ffn.receptance.weight"] = {C, C};
+  }
+  std::map<std::string, std::pair<std::vector<float>, std::vector<float>>>
+      delta;
+  // the a_t and b_t kept by the variant
+  int64_t delta_bytes = 0;
+  {
+    std::ofstream file(delta_path, std::ios::binary);
+    msgpack::packer<std::ofstream> pk(file);
+    pk.pack_map(4);
+    pk.pack(std::string("n_layer"));
+    pk.pack(config.n_layer);
+    pk.pack(std::string("n_embd"));
+    pk.pack(C);
+    pk.pack(std::string("weights"));
+    pk.pack_map(shapes.size());
+    uint32_t seed = 2;
+    auto random = [&seed](int n) {
+      std::vector<float> ret(n);
+      for (auto &x : ret) {
+        seed = seed * 1103515245 + 12345;
+        x = ((seed >> 8) & 0xffff) / 65536.f * 0.2f - 0.1f;
+      }
+      return ret;
+    };
+    for (auto &[name, shape] : shapes) {
+      auto [k, n] = shape;
+      auto &ab = delta[name];
+      ab = {random(k * kRank), random(kRank * n)};
+      delta_bytes += kRank * (k + n) * sizeof(float);
+      pk.pack(name);
+      pk.pack_map(2);
+      pk.pack(std::string("a"));
+      PackTensor(pk, "torch.float32", {k, kRank}, ab.first);
+      pk.pack(std::string("b"));
+      PackTensor(pk, "torch.float32", {kRank, n}, ab.second);
+    }
+    pk.pack(std::string("embd_weights"));
+    pk.pack_map(0);
+  }
+  WriteMergedModel(model_path, merged_path, delta, kRank, 1.f);
+
+  auto run = [](const rwkv::Model &model) {
+    auto states = model.CreateInitialStates();
+    return rwkv::Copy(model.Run({1, 2, 3}, states), rwkv::Device::kCPU);
+  };
+  // the stats are per device, other tests may have allocated before
+  auto weight_bytes = []() {
+    const int kWeights = static_cast<int>(rwkv::AllocTag::kWeights);
+    return rwkv::allocator(rwkv::Device::kCPU)
+        .stats()
+        .tag_current_bytes[kWeights];
+  };
+  auto before = weight_bytes();
+  rwkv::Model base(model_path, "cpu fp32");
+  auto base_bytes = weight_bytes() - before;
+  std::vector<std::unique_ptr<rwkv::Model>> variants;
+  for (int i = 0; i < kVariants; i++) {
+    variants.push_back(std::make_unique<rwkv::Model>(base, delta_path));
+  }
+  auto variant_bytes = (weight_bytes() - before - base_bytes) / kVariants;
+  // only a_t and b_t, with the alignment of their allocations
+  EXPECT_GE(variant_bytes, delta_bytes);
+  EXPECT_LE(variant_bytes, delta_bytes + 2 * 64 * shapes.size());
+  // the base and all variants in about the memory of one base model
+  EXPECT_LT(kVariants * variant_bytes, base_bytes / 5);
+
+  auto materialized = std::make_unique<rwkv::Model>(base, delta_path,
+                                                    /*materialize=*/true);
+  auto base_output = run(base);
+  auto output = run(*variants[0]);
+  auto materialized_output = run(*materialized);
+  auto expected = run(rwkv::Model(merged_path, "cpu fp32"));
+  float max_change = 0;
+  for (int i = 0; i < expected.numel(); i++) {
+    EXPECT_NEAR(output.data_ptr<float>()[i], expected.data_ptr<float>()[i],
+                1e-4);
+    EXPECT_NEAR(materialized_output.data_ptr<float>()[i],
+                expected.data_ptr<float>()[i], 1e-4);
+    max_change = std::max(max_change, std::abs(expected.data_ptr<float>()[i] -
+                                               base_output.data_ptr<float>()[i]));
+  }
+  EXPECT_GT(max_change, 1e-2);
+}
+
+#ifdef FR_ENABLE_PIPELINE
+TEST(PipelineModel, matches_model) {
+  auto config = TestModelConfig();
+  config.n_layer = 4;
+  auto model_path = WriteTestModel(config);
+  rwkv::Model model(model_path, "cpu fp32");
+  auto states = model.CreateInitialStates();
+  auto expected =
+      rwkv::Copy(model.Run({1, 2, 3}, states), rwkv::Device::kCPU);
+  // forked after the thread pool of this process has been created
+  rwkv::PipelineModel pipeline(model_path, "cpu fp32", 2);
+  int session = pipeline.CreateSession();
+  auto output = pipeline.Run(session, {1, 2, 3});
+  ASSERT_EQ(output.numel(), expected.numel());
+  for (int i = 0; i < output.numel(); i++) {
+    EXPECT_NEAR(output.data_ptr<float>()[i], expected.data_ptr<float>()[i],
+                1e-5);
+  }
+}
+
+// The batched pipeline run of sessions with different adapters
+TEST(PipelineModel, lora) {
+  auto config = TestModelConfig();
+  config.dtype = rwkv::DType::kFloat32;
+  auto model_path = WriteTestModel(config);
+  auto lora_path_1 = TestPath("_1.lora");
+  auto lora_path_2 = TestPath("_2.lora");
+  WriteTestLora(lora_path_1, 1);
+  WriteTestLora(lora_path_2, 2);
+  rwkv::Model model(model_path, "cpu fp32");
+  rwkv::LoraAdapter adapter_1(lora_path_1);
+  rwkv::LoraAdapter adapter_2(lora_path_2);
+  std::vector<const rwkv::LoraAdapter *> loras = {&adapter_1, &adapter_2,
+                                                  nullptr};
+  const std::vector<std::vector<int>> ids = {{1, 2, 3}, {4, 5, 6}, {7, 8, 9}};
+
+  rwkv::PipelineModel pipeline(model_path, "cpu fp32", 2);
+  std::vector<int> adapters = {pipeline.LoadAdapter(lora_path_1),
+                               pipeline.LoadAdapter(lora_path_2), -1};
+  std::vector<int> sessions;
+  for (size_t b = 0; b < loras.size(); b++) {
+    sessions.push_back(pipeline.CreateSession());
+  }
+  std::vector<rwkv::Tensor> outputs;
+  for (size_t t = 0; t < ids[0].size(); t++) {
+    outputs = pipeline.Run(sessions, {ids[0][t], ids[1][t], ids[2][t]},
+                           adapters);
+  }
+  for (size_t b = 0; b < loras.size(); b++) {
+    auto states = model.CreateInitialStates();
+    auto expected = rwkv::Copy(loras[b] ? model.Run(ids[b], states, *loras[b])
+                                        : model.Run(ids[b], states),
+                               rwkv::Device::kCPU);
+    ASSERT_EQ(outputs[b].numel(), expected.numel());
+    for (int i = 0; i < expected.numel(); i++) {
+      EXPECT_NEAR(outputs[b].data_ptr<float>()[i],
+                  expected.data_ptr<float>()[i], 1e-5);
+    }
+  }
+}
+#endif
+
+#ifdef FR_ENABLE_ONNX
+// The fp16 and the int8 (QDQ) exports of a random model pass the ONNX
+// checker, with shape inference. They are not run: the tree does not build
+// onnxruntime, so their outputs are not compared with the other backends.
+TEST(ONNX, export_passes_checker) {
+  auto model_path = WriteTestModel(TestModelConfig());
+  for (bool int8 : {false, true}) {
+    auto onnx_path = TestPath(int8 ? "_int8.onnx" : ".onnx");
+    std::map<std::string, float> input_absmax;
+    if (int8) {
+      input_absmax = calibrate(model_path, {{1, 2, 3, 4, 5}, {6, 7, 8}});
+    }
+    rwkv::onnxmeta::init(onnx_path);
+    rwkv::onnxmeta::set_int8_input_absmax(input_absmax);
+    {
+      rwkv::Model exporter(model_path, "onnx-meta fp32");
+      auto states = exporter.CreateInitialStates();
+      exporter.Run(0, states);
+    }
+    rwkv::onnxmeta::destroy();
+    EXPECT_NO_THROW(rwkv::onnxmeta::check_model(onnx_path)) << onnx_path;
+  }
+}
+#endif
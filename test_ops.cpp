@@ -1,8 +1,20 @@
+#include <calibrate.h>
 #include <kernels/kernels.h>
+#include <kernels/ncnn-meta/kernels.h>
+#include <model.h>
+#include <random_model.h>
 #include <tensor.h>
+#include <test_utils.h>
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 
+using namespace rwkv::test;
+
 TEST(RWKV, cpu_scalar_div_fp32) {
   auto x = rwkv::Tensor::Empty({256}, rwkv::DType::kFloat32, rwkv::Device::kCUDA);
   rwkv::fill_(x, 1.0f);
@@ -21,3 +33,158 @@ TEST(RWKV, cpu_scalar_div_fp16) {
   auto x_ptr = x.data_ptr<float>();
   EXPECT_EQ(x_ptr[0], 0.5f);
 }
+
+// The custom layers of the exported graphs (RWKVTimeMix, RWKVWkv,
+// RWKVReluSquare and RWKVGatedResidual, see kernels/ncnn/layers.cpp) against
+// the cpu att and ffn kernels, on a prompt (several rows per layer) and then
+// on single tokens:
+// - with one and several threads (OpenMP teams of `threads=`, see
+//   NCNN_OPENMP in CMakeLists.txt),
+// - with and without the packed layout of the built-in layers around them,
+//   which ncnn unpacks for our layers as they declare no support_packing,
+// - with fp32, bf16 and fp16 storage, which ncnn casts to fp32 for our
+//   layers as they declare no support_bf16_storage/support_fp16_storage.
+//   The rounding of the stored blobs is checked by relative error.
+TEST(RWKV, ncnn_layers_match_cpu) {
+  auto model_path = WriteTestModel(TestModelConfig());
+  auto ncnn_path = ExportNcnn(model_path);
+
+  rwkv::Model cpu_model(model_path, "cpu fp32");
+  const std::vector<std::vector<int>> inputs = {{1, 2, 3, 4}, {5}, {6}};
+  for (const std::string strategy :
+       {"ncnn fp32 threads=1", "ncnn fp32 threads=4",
+        "ncnn fp32 threads=4 packing=0", "ncnn fp16 threads=4",
+        "ncnn fp16 threads=4 bf16=0 fp16=1"}) {
+    const bool fp32 = strategy.find("fp32") != std::string::npos;
+    rwkv::Model ncnn_model(ncnn_path, strategy);
+    auto cpu_states = cpu_model.CreateInitialStates();
+    auto ncnn_states = ncnn_model.CreateInitialStates();
+    for (auto &ids : inputs) {
+      auto expected = rwkv::Copy(cpu_model.Run(ids, cpu_states),
+                                 rwkv::Device::kCPU);
+      auto output = rwkv::Copy(ncnn_model.Run(ids, ncnn_states),
+                               rwkv::Device::kCPU);
+      ASSERT_EQ(output.numel(), expected.numel());
+      if (fp32) {
+        for (int i = 0; i < output.numel(); i++) {
+          EXPECT_NEAR(output.data_ptr<float>()[i],
+                      expected.data_ptr<float>()[i], 1e-3)
+              << strategy << " token " << ids.back();
+        }
+      } else {
+        // bf16 keeps 8 bits of mantissa, a layer reading a blob in a wrong
+        // dtype or layout would be off by ~100%
+        EXPECT_LT(RelativeError(output, expected), 0.03)
+            << strategy << " token " << ids.back();
+      }
+    }
+  }
+}
+
+// The batch graph (ncnnmeta::set_batch) against separate cpu runs of each
+// session: sessions at different positions, advanced by Model::Run on the
+// batch graph and by RunBatch with other subsets of sessions, then run
+// together. The initial states of the fp16 model are partly fp16 and are
+// gathered through cast_dtype.
+TEST(RWKV, ncnn_batch_matches_cpu) {
+  auto config = TestModelConfig();
+  auto model_path = WriteTestModel(config);
+  auto ncnn_path = ExportNcnn(model_path, /*batch=*/true);
+
+  rwkv::Model cpu_model(model_path, "cpu fp32");
+  // the batched custom layers on one thread and on an OpenMP team, from fp16
+  // and from fp32 initial states
+  for (const std::string strategy :
+       {"ncnn fp16 bf16=0 threads=1", "ncnn fp32 threads=4"}) {
+    rwkv::Model ncnn_model(ncnn_path, strategy);
+    const int n_sessions = 4;
+    std::vector<std::vector<std::vector<rwkv::Tensor>>> cpu_states;
+    std::vector<std::vector<std::vector<rwkv::Tensor>>> ncnn_states;
+    for (int b = 0; b < n_sessions; b++) {
+      cpu_states.push_back(cpu_model.CreateInitialStates());
+      ncnn_states.push_back(ncnn_model.CreateInitialStates());
+    }
+    // session 0 is new, session 1 has run {1, 2, 3}, session 2 {4, 6} and
+    // session 3 {5}
+    const std::vector<std::vector<int>> histories = {
+        {}, {1, 2, 3}, {4, 6}, {5}};
+    for (int b = 0; b < n_sessions; b++) {
+      if (!histories[b].empty()) {
+        cpu_model.Run(histories[b], cpu_states[b]);
+      }
+    }
+    ncnn_model.Run(histories[1], ncnn_states[1]);
+    ncnn_model.RunBatch({4, 5}, {&ncnn_states[2], &ncnn_states[3]});
+    ncnn_model.RunBatch({6}, {&ncnn_states[2]});
+
+    std::vector<std::vector<std::vector<rwkv::Tensor>> *> batch_states;
+    for (auto &states : ncnn_states) {
+      batch_states.push_back(&states);
+    }
+    // the second step runs on the row views returned by the first one
+    for (const std::vector<int> &ids :
+         {std::vector<int>{7, 8, 9, 10}, std::vector<int>{11, 12, 13, 14}}) {
+      auto output = ncnn_model.RunBatch(ids, batch_states);
+      ASSERT_EQ(output.shape(), rwkv::Shape({n_sessions, config.n_vocab}));
+      for (int b = 0; b < n_sessions; b++) {
+        auto expected = rwkv::Copy(cpu_model.Run(ids[b], cpu_states[b]),
+                                   rwkv::Device::kCPU);
+        for (int i = 0; i < config.n_vocab; i++) {
+          EXPECT_NEAR(output.data_ptr<float>()[b * config.n_vocab + i],
+                      expected.data_ptr<float>()[i], 1e-3)
+              << strategy << " session " << b << " token " << ids[b];
+        }
+      }
+    }
+    for (int b = 0; b < n_sessions; b++) {
+      for (int i = 0; i < config.n_layer; i++) {
+        for (size_t j = 0; j < cpu_states[b][i].size(); j++) {
+          auto &state = ncnn_states[b][i][j];
+          auto &expected = cpu_states[b][i][j];
+          ASSERT_EQ(state.numel(), expected.numel());
+          for (int k = 0; k < state.numel(); k++) {
+            EXPECT_NEAR(state.data_ptr<float>()[k],
+                        expected.data_ptr<float>()[k], 1e-3)
+                << strategy << " session " << b << " state " << i << "_"
+                << j;
+          }
+        }
+      }
+    }
+  }
+}
+
+// The block weights exported as int8 InnerProducts (`8=2`), with the input
+// scales calibrated on the cpu, against the cpu fp32 model. The ncnn model
+// keeps ncnn's default use_int8_inference, and ncnn is built with NCNN_INT8
+// (see CMakeLists.txt).
+TEST(RWKV, ncnn_int8_matches_cpu) {
+  auto config = TestModelConfig();
+  auto model_path = WriteTestModel(config);
+  auto input_absmax = calibrate(model_path, {{1, 2, 3, 4, 5}, {6, 7, 8}});
+  auto ncnn_path = ExportNcnn(model_path, /*batch=*/false, input_absmax);
+  // att key, value, receptance and output and ffn key, value and receptance
+  // of every layer, the head stays fp16
+  int int8_layers = 0;
+  std::ifstream param_file(ncnn_path + ".param");
+  for (std::string line; std::getline(param_file, line);) {
+    int8_layers += line.find("InnerProduct") == 0 &&
+                   line.find(" 8=2") != std::string::npos;
+  }
+  EXPECT_EQ(int8_layers, 7 * config.n_layer);
+
+  rwkv::Model cpu_model(model_path, "cpu fp32");
+  rwkv::Model ncnn_model(ncnn_path, "ncnn fp32");
+  auto cpu_states = cpu_model.CreateInitialStates();
+  auto ncnn_states = ncnn_model.CreateInitialStates();
+  for (auto &ids : std::vector<std::vector<int>>{{1, 2, 3, 4}, {5}, {6}}) {
+    auto expected = rwkv::Copy(cpu_model.Run(ids, cpu_states),
+                               rwkv::Device::kCPU);
+    auto output = rwkv::Copy(ncnn_model.Run(ids, ncnn_states),
+                             rwkv::Device::kCPU);
+    ASSERT_EQ(output.numel(), expected.numel());
+    // the int8 rounding of the weights and activations adds a few percent of
+    // error, a wrong scale would be off by ~100%
+    EXPECT_LT(RelativeError(output, expected), 0.1) << "token " << ids.back();
+  }
+}
@@ -1,7 +1,12 @@
+#include "test_utils.h"
 #include "tokenizer.h"
 
+#include <filesystem>
+
 #include <gtest/gtest.h>
 
+using namespace rwkv::test;
+
 TEST(Tokenizer, load) {
   rwkv::Tokenizer tokenizer("../tokenizer_model");
 }
@@ -22,3 +27,44 @@ TEST(Tokenizer, encode_decode) {
   EXPECT_EQ(str, "今天天气不错");
 }
 
+
+TEST(Tokenizer, longest_match) {
+  rwkv::Tokenizer tokenizer("../tokenizer_model");
+  // "Cm" is not a word, but "Cmd" is
+  auto ids = tokenizer.encode("Cmd");
+  EXPECT_EQ(ids.size(), 1);
+  EXPECT_EQ(ids[0], 5736);
+  EXPECT_EQ(tokenizer.decode(ids), "Cmd");
+}
+
+TEST(Tokenizer, streaming_decode) {
+  rwkv::Tokenizer tokenizer("../tokenizer_model");
+  rwkv::StreamingDecoder decoder(tokenizer);
+  // "a" and the 3 bytes of "今" as single byte tokens
+  std::string str;
+  EXPECT_EQ(decoder.decode(98, str), 1);
+  EXPECT_EQ(decoder.decode(229, str), 0);
+  EXPECT_EQ(decoder.decode(188, str), 0);
+  EXPECT_EQ(str, "a");
+  EXPECT_EQ(decoder.decode(139, str), 3);
+  EXPECT_EQ(str, "a今");
+  EXPECT_EQ(decoder.decode(229, str), 0);
+  EXPECT_EQ(decoder.flush(str), 1);
+  EXPECT_EQ(str, "a今\xe4");
+}
+
+TEST(Tokenizer, compiled) {
+  rwkv::Tokenizer tokenizer("../tokenizer_model");
+  auto compiled_path = TestPath(".bin");
+  tokenizer.save(compiled_path);
+  {
+    rwkv::Tokenizer compiled(compiled_path);
+    const std::string str = "今天天气不错, Cmd <unk>\n\n";
+    auto ids = compiled.encode(str);
+    EXPECT_EQ(ids, tokenizer.encode(str));
+    EXPECT_EQ(compiled.decode(ids), str);
+    EXPECT_EQ(compiled.decode(0), "<unk>");
+  }
+  // unmapped once `compiled` is destroyed
+  std::filesystem::remove(compiled_path);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+// Helpers shared by the test_*.cpp files
+
+#include <cmath>
+#include <filesystem>
+#include <map>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "model.h"
+#include "random_model.h"
+#include "tensor.h"
+#ifdef FR_ENABLE_NCNN
+#include "kernels/ncnn-meta/kernels.h"
+#endif
+
+namespace rwkv {
+#ifdef FR_ENABLE_NCNN
+namespace ncnnmeta {
+void init(const std::string &bp_path, const std::string &pp_path);
+void destroy();
+} // namespace ncnnmeta
+#endif
+
+namespace test {
+// A file of the running test, in the temp directory and named after the
+// test: ctest runs every test as its own process, concurrently with `-j`
+inline std::string TestPath(const std::string &suffix) {
+  auto *info = ::testing::UnitTest::GetInstance()->current_test_info();
+  auto name = std::string("faster-rwkv-") + info->test_suite_name() + "." +
+              info->name() + suffix;
+  return (std::filesystem::temp_directory_path() / name).string();
+}
+
+// The random model of most tests, 2 layers of 128 channels and 100 tokens
+inline RandomModelConfig TestModelConfig() {
+  RandomModelConfig config;
+  config.n_layer = 2;
+  config.n_embd = 128;
+  config.n_vocab = 100;
+  return config;
+}
+
+// Writes the random model `config` to TestPath(".fr") and returns the path
+inline std::string WriteTestModel(const RandomModelConfig &config) {
+  auto path = TestPath(".fr");
+  WriteRandomModel(path, config);
+  return path;
+}
+
+// The relative RMS error of `output` against `expected`
+inline double RelativeError(const Tensor &output, const Tensor &expected) {
+  double error = 0;
+  double norm = 0;
+  for (int i = 0; i < output.numel(); i++) {
+    double diff = output.data_ptr<float>()[i] - expected.data_ptr<float>()[i];
+    error += diff * diff;
+    norm += expected.data_ptr<float>()[i] * expected.data_ptr<float>()[i];
+  }
+  return std::sqrt(error / norm);
+}
+
+#ifdef FR_ENABLE_NCNN
+// Exports `model_path` to the ncnn model TestPath("_ncnn") as export_ncnn
+// does, and returns its prefix
+inline std::string
+ExportNcnn(const std::string &model_path, bool batch = false,
+           const std::map<std::string, float> &int8_input_absmax = {}) {
+  auto prefix = TestPath("_ncnn");
+  ncnnmeta::init(prefix + ".bin", prefix + ".param");
+  ncnnmeta::set_batch(batch);
+  ncnnmeta::set_int8_input_absmax(int8_input_absmax);
+  {
+    Model exporter(model_path, "ncnn-meta fp32");
+    auto states = exporter.CreateInitialStates();
+    exporter.Run(0, states);
+  }
+  ncnnmeta::destroy();
+  return prefix;
+}
+#endif
+} // namespace test
+} // namespace rwkv
@@ -0,0 +1,166 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "kernels/cpu/thread_pool.h"
+#include "tokenizer.h"
+
+// usage: tokenize_corpus <tokenizer> <input> <output prefix>
+// Every non-empty line of the input is a document. The documents are encoded
+// on all cores (see FR_NUM_THREADS) and written, each followed by the end of
+// document token 0, as <output prefix>.bin and <output prefix>.idx in the
+// binidx format (MMapIndexedDataset of Megatron-LM, as used by RWKV-LM):
+//   .bin  the tokens, uint16 (or int32 for vocabs larger than 65536)
+//   .idx  "MMIDIDX\0\0", uint64 version (1), uint8 dtype code,
+//         uint64 document num, uint64 document num + 1,
+//         int32 sizes[document num] (in tokens),
+//         int64 pointers[document num] (byte offsets into .bin),
+//         int64 doc_idx[document num + 1] (0, 1, ..., document num)
+// so that both files can be mmap-ed and used in place.
+
+namespace {
+constexpr int kEndOfDocument = 0;
+// inputs are read and encoded in chunks of about this size, cut after a
+// newline
+constexpr size_t kChunkSize = 16 << 20;
+
+struct Chunk {
+  std::string text;
+  std::vector<int> tokens;
+  std::vector<int32_t> sizes;
+};
+
+void encode_chunk(const rwkv::Tokenizer &tokenizer, Chunk &chunk) {
+  std::string_view text(chunk.text);
+  while (!text.empty()) {
+    auto end = text.find('\n');
+    auto line = text.substr(0, end);
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+    if (line.empty()) {
+      continue;
+    }
+    auto ids = tokenizer.encode(line);
+    chunk.tokens.insert(chunk.tokens.end(), ids.begin(), ids.end());
+    chunk.tokens.push_back(kEndOfDocument);
+    chunk.sizes.push_back(ids.size() + 1);
+  }
+}
+
+// Reads the next chunk (up to kChunkSize bytes, extended to the end of the
+// line) into `chunk`, returns false at the end of the input
+bool read_chunk(std::ifstream &input, Chunk &chunk) {
+  chunk.text.resize(kChunkSize);
+  input.read(chunk.text.data(), kChunkSize);
+  chunk.text.resize(input.gcount());
+  if (chunk.text.empty()) {
+    return false;
+  }
+  if (chunk.text.back() != '\n') {
+    std::string rest;
+    std::getline(input, rest);
+    chunk.text += rest;
+    if (!input.eof()) {
+      chunk.text += '\n';
+    }
+  }
+  return true;
+}
+
+template <typename T>
+void write(std::ofstream &file, const T *data, size_t n) {
+  file.write(reinterpret_cast<const char *>(data), n * sizeof(T));
+}
+
+template <typename T> void write(std::ofstream &file, T value) {
+  write(file, &value, 1);
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  RV_CHECK(argc == 4);
+  rwkv::Tokenizer tokenizer(argv[1]);
+  std::ifstream input(argv[2], std::ios::binary);
+  RV_CHECK(input.good());
+  const std::string prefix = argv[3];
+  std::ofstream bin(prefix + ".bin", std::ios::binary);
+  RV_CHECK(bin.good());
+
+  const bool is_uint16 = tokenizer.vocab_size() <= 65536;
+  // numpy dtype codes of MMapIndexedDataset
+  const uint8_t dtype_code = is_uint16 ? 8 : 4;
+  const size_t token_size = is_uint16 ? 2 : 4;
+
+  auto &pool = rwkv::cpu::ThreadPool::Instance();
+  const int num_threads = pool.num_threads();
+  std::vector<Chunk> chunks(num_threads * 2);
+  std::vector<int32_t> sizes;
+  std::vector<int64_t> pointers;
+  int64_t bin_size = 0;
+  size_t input_size = 0;
+  std::vector<uint16_t> tokens_u16;
+
+  auto start = std::chrono::steady_clock::now();
+  bool eof = false;
+  while (!eof) {
+    size_t num_chunks = 0;
+    for (; num_chunks < chunks.size(); num_chunks++) {
+      if (!read_chunk(input, chunks[num_chunks])) {
+        eof = true;
+        break;
+      }
+      input_size += chunks[num_chunks].text.size();
+    }
+    std::atomic<size_t> next_chunk{0};
+    pool.Run([&](int) {
+      for (size_t i; (i = next_chunk++) < num_chunks;) {
+        encode_chunk(tokenizer, chunks[i]);
+      }
+    });
+    for (size_t i = 0; i < num_chunks; i++) {
+      auto &chunk = chunks[i];
+      for (auto size : chunk.sizes) {
+        sizes.push_back(size);
+        pointers.push_back(bin_size);
+        bin_size += size * token_size;
+      }
+      if (is_uint16) {
+        tokens_u16.assign(chunk.tokens.begin(), chunk.tokens.end());
+        write(bin, tokens_u16.data(), tokens_u16.size());
+      } else {
+        write(bin, chunk.tokens.data(), chunk.tokens.size());
+      }
+      chunk.tokens.clear();
+      chunk.sizes.clear();
+    }
+  }
+  RV_CHECK(bin.good());
+
+  std::ofstream idx(prefix + ".idx", std::ios::binary);
+  idx.write("MMIDIDX\0\0", 9);
+  write<uint64_t>(idx, 1);
+  write<uint8_t>(idx, dtype_code);
+  write<uint64_t>(idx, sizes.size());
+  write<uint64_t>(idx, sizes.size() + 1);
+  write(idx, sizes.data(), sizes.size());
+  write(idx, pointers.data(), pointers.size());
+  for (int64_t i = 0; i <= static_cast<int64_t>(sizes.size()); i++) {
+    write(idx, i);
+  }
+  RV_CHECK(idx.good());
+
+  auto seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  std::cout << "encoded " << sizes.size() << " documents, "
+            << bin_size / token_size << " tokens from " << input_size
+            << " bytes in " << seconds << "s ("
+            << input_size / seconds / 1e6 << " MB/s, " << num_threads
+            << " threads)" << std::endl;
+  return 0;
+}
@@ -1,69 +1,344 @@
 #include "tokenizer.h"
 
-#include <iostream>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
 #include <string_view>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <msgpack.hpp>
 
+#include "check.h"
+
 namespace rwkv {
+
+// The image of a tokenizer (and a compiled tokenizer file) is, in host byte
+// order:
+//   ImageHeader
+//   uint32_t root[256]                    trie children of the root
+//   uint32_t word_offsets[num_ids + 1]
+//   TrieNode nodes[num_nodes]
+//   uint32_t targets[num_edges]
+//   uint8_t labels[num_edges]
+//   char words[words_size]
+// so that every array is aligned when the image is.
+namespace {
+constexpr char kMagic[4] = {'F', 'R', 'T', 'K'};
+constexpr uint32_t kVersion = 1;
+
+struct ImageHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_ids;
+  uint32_t num_nodes;
+  uint32_t num_edges;
+  uint32_t words_size;
+};
+
+template <typename T>
+void append(std::vector<char> &image, const T *data, size_t n) {
+  const char *p = reinterpret_cast<const char *>(data);
+  image.insert(image.end(), p, p + n * sizeof(T));
+}
+
+bool is_compiled(const std::string &path) {
+  std::ifstream infile(path, std::ios::binary | std::ios::in);
+  char magic[sizeof(kMagic)];
+  return infile.read(magic, sizeof(magic)) &&
+         std::equal(magic, magic + sizeof(magic), kMagic);
+}
+} // namespace
+
 Tokenizer::Tokenizer(const std::string &path) {
+  if (is_compiled(path)) {
+#ifdef _WIN32
+    std::ifstream infile(path, std::ios::binary | std::ios::in);
+    _image.assign(std::istreambuf_iterator<char>(infile),
+                  std::istreambuf_iterator<char>());
+    attach_image(_image.data(), _image.size());
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    RV_CHECK(fd >= 0);
+    struct stat st;
+    RV_CHECK(fstat(fd, &st) == 0);
+    _mapped_size = st.st_size;
+    _mapped = mmap(nullptr, _mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    RV_CHECK(_mapped != MAP_FAILED);
+    attach_image(static_cast<const char *>(_mapped), _mapped_size);
+#endif
+    return;
+  }
+
   std::ifstream infile;
   infile.open(path, std::ios::binary | std::ios::in);
+  RV_CHECK(infile.good());
   infile.seekg(0, std::ios::end);
   int64_t length = infile.tellg();
   infile.seekg(0, std::ios::beg);
-  char *data = new char[length];
-  infile.read(data, length);
+  std::vector<char> data(length);
+  infile.read(data.data(), length);
   infile.close();
 
-  auto unpacker = msgpack::unpack(data, length);
+  auto unpacker = msgpack::unpack(data.data(), length);
   auto obj = unpacker.get();
-  _idx2word = obj.as<std::unordered_map<int, std::string>>();
-  for (auto &pair : _idx2word) {
-    _word2idx[pair.second] = pair.first;
+  _image = build_image(obj.as<std::unordered_map<int, std::string>>());
+  attach_image(_image.data(), _image.size());
+}
+
+Tokenizer::~Tokenizer() {
+#ifndef _WIN32
+  if (_mapped != nullptr) {
+    munmap(_mapped, _mapped_size);
   }
+#endif
 }
 
-std::vector<int> Tokenizer::encode(std::string_view str) const {
-  std::vector<int> ids;
-  int str_idx = 0;
-  int word_len = 1;
-  int id = 0;
-  while (str_idx < str.size()) {
-    if (str_idx + word_len > str.size()) {
-      ids.push_back(id);
-      break;
+void Tokenizer::attach_image(const char *image, size_t size) {
+  RV_CHECK(size >= sizeof(ImageHeader));
+  ImageHeader header;
+  std::memcpy(&header, image, sizeof(header));
+  RV_CHECK(std::equal(header.magic, header.magic + sizeof(kMagic), kMagic));
+  RV_CHECK(header.version == kVersion);
+  RV_CHECK(header.num_nodes > 0);
+  const char *p = image + sizeof(header);
+  auto take = [&](size_t bytes) {
+    const char *q = p;
+    p += bytes;
+    RV_CHECK(p <= image + size);
+    return q;
+  };
+  _num_ids = header.num_ids;
+  _trie_root = reinterpret_cast<const uint32_t *>(take(256 * sizeof(uint32_t)));
+  _word_offsets = reinterpret_cast<const uint32_t *>(
+      take((_num_ids + 1) * sizeof(uint32_t)));
+  _trie_nodes = reinterpret_cast<const TrieNode *>(
+      take(header.num_nodes * sizeof(TrieNode)));
+  _trie_targets = reinterpret_cast<const uint32_t *>(
+      take(header.num_edges * sizeof(uint32_t)));
+  _trie_labels = reinterpret_cast<const uint8_t *>(take(header.num_edges));
+  _words = take(header.words_size);
+  RV_CHECK(_word_offsets[_num_ids] == header.words_size);
+}
+
+void Tokenizer::save(const std::string &path) const {
+  std::ofstream outfile(path, std::ios::binary | std::ios::out);
+  const char *image = reinterpret_cast<const char *>(_trie_root) -
+                      sizeof(ImageHeader);
+  outfile.write(image, _words + _word_offsets[_num_ids] - image);
+  RV_CHECK(outfile.good());
+}
+
+std::vector<char> Tokenizer::build_image(
+    const std::unordered_map<int, std::string> &idx2word) {
+  int max_id = -1;
+  size_t total_size = 0;
+  for (auto &pair : idx2word) {
+    RV_CHECK(pair.first >= 0);
+    max_id = std::max(max_id, pair.first);
+    total_size += pair.second.size();
+  }
+  std::string words_buffer;
+  std::vector<uint32_t> word_offsets;
+  words_buffer.reserve(total_size);
+  word_offsets.reserve(max_id + 2);
+  for (int id = 0; id <= max_id; id++) {
+    word_offsets.push_back(words_buffer.size());
+    auto it = idx2word.find(id);
+    words_buffer += it == idx2word.end() ? kUnknownWord : it->second;
+  }
+  word_offsets.push_back(words_buffer.size());
+
+  std::vector<std::pair<std::string_view, int>> words;
+  words.reserve(idx2word.size());
+  for (auto &pair : idx2word) {
+    if (!pair.second.empty()) {
+      words.emplace_back(pair.second, pair.first);
     }
-    auto substr = str.substr(str_idx, word_len);
-    auto it = _word2idx.find(std::string(substr));
-    if (it == _word2idx.end()) {
-      ids.push_back(id);
-      str_idx += (word_len - 1);
-      word_len = 1;
-    } else {
-      id = it->second;
-      word_len++;
+  }
+  // std::string_view compares bytes as unsigned char, so the words sharing a
+  // prefix are contiguous and their next bytes are sorted
+  std::sort(words.begin(), words.end());
+
+  // nodes are created breadth first, each with the range of `words` having
+  // its prefix; the edges of a node are appended when it is expanded, so they
+  // are contiguous
+  struct Pending {
+    uint32_t node;
+    size_t depth;
+    size_t lo;
+    size_t hi;
+  };
+  std::vector<Pending> queue;
+  std::vector<TrieNode> nodes;
+  std::vector<uint8_t> labels;
+  std::vector<uint32_t> targets;
+  nodes.push_back({-1, 0, 0});
+  queue.push_back({0, 0, 0, words.size()});
+  for (size_t q = 0; q < queue.size(); q++) {
+    auto [node, depth, lo, hi] = queue[q];
+    if (lo < hi && words[lo].first.size() == depth) {
+      nodes[node].id = words[lo].second;
+      lo++;
+    }
+    nodes[node].begin = labels.size();
+    while (lo < hi) {
+      uint8_t label = words[lo].first[depth];
+      size_t group_end = lo;
+      while (group_end < hi &&
+             static_cast<uint8_t>(words[group_end].first[depth]) == label) {
+        group_end++;
+      }
+      uint32_t child = nodes.size();
+      nodes.push_back({-1, 0, 0});
+      labels.push_back(label);
+      targets.push_back(child);
+      queue.push_back({child, depth + 1, lo, group_end});
+      lo = group_end;
     }
+    nodes[node].end = labels.size();
   }
-  return ids;
+
+  // 0 (the root) means no child
+  uint32_t root[256] = {};
+  for (uint32_t i = nodes[0].begin; i < nodes[0].end; i++) {
+    root[labels[i]] = targets[i];
+  }
+
+  ImageHeader header;
+  std::copy(kMagic, kMagic + sizeof(kMagic), header.magic);
+  header.version = kVersion;
+  header.num_ids = max_id + 1;
+  header.num_nodes = nodes.size();
+  header.num_edges = labels.size();
+  header.words_size = words_buffer.size();
+  std::vector<char> image;
+  append(image, &header, 1);
+  append(image, root, 256);
+  append(image, word_offsets.data(), word_offsets.size());
+  append(image, nodes.data(), nodes.size());
+  append(image, targets.data(), targets.size());
+  append(image, labels.data(), labels.size());
+  append(image, words_buffer.data(), words_buffer.size());
+  return image;
 }
 
-std::string Tokenizer::decode(int id) const {
-  auto it = _idx2word.find(id);
-  if (it == _idx2word.end()) {
-    return "<unk>";
-  } else {
-    return it->second;
+// Greedy longest match: at each position, emit the longest word that is a
+// prefix of the rest of the input.
+std::vector<int> Tokenizer::encode(std::string_view str) const {
+  std::vector<int> ids;
+  // locals, as the stores to `ids` may alias the members
+  const uint32_t *root = _trie_root;
+  const TrieNode *nodes = _trie_nodes;
+  const uint32_t *targets = _trie_targets;
+  const uint8_t *labels = _trie_labels;
+  const auto *data = reinterpret_cast<const uint8_t *>(str.data());
+  const size_t size = str.size();
+  size_t pos = 0;
+  while (pos < size) {
+    int id = -1;
+    size_t len = 0;
+    uint32_t node = root[data[pos]];
+    size_t i = pos + 1;
+    while (node != 0) {
+      const auto &n = nodes[node];
+      if (n.id >= 0) {
+        id = n.id;
+        len = i - pos;
+      }
+      if (i == size) {
+        break;
+      }
+      // the edges are sorted by label
+      const uint8_t *it =
+          std::lower_bound(labels + n.begin, labels + n.end, data[i]);
+      if (it == labels + n.end || *it != data[i]) {
+        break;
+      }
+      node = targets[it - labels];
+      i++;
+    }
+    if (id < 0) {
+      throw std::runtime_error("no token for byte " +
+                               std::to_string(data[pos]) + " at offset " +
+                               std::to_string(pos));
+    }
+    ids.push_back(id);
+    pos += len;
   }
+  return ids;
 }
 
 std::string Tokenizer::decode(const std::vector<int> &ids) const {
+  size_t size = 0;
+  for (auto id : ids) {
+    size += decode(id).size();
+  }
   std::string str;
+  str.reserve(size);
   for (auto id : ids) {
     str += decode(id);
   }
   return str;
 }
 
+namespace {
+// The length of the UTF-8 sequence starting with `c`, 0 for a continuation
+// byte. Invalid lead bytes count as a single byte.
+int utf8_sequence_length(uint8_t c) {
+  if (c < 0x80) {
+    return 1;
+  } else if (c < 0xC0) {
+    return 0;
+  } else if (c < 0xE0) {
+    return 2;
+  } else if (c < 0xF0) {
+    return 3;
+  } else if (c < 0xF8) {
+    return 4;
+  }
+  return 1;
+}
+} // namespace
+
+size_t StreamingDecoder::decode(int id, std::string &out) {
+  const size_t start = out.size();
+  out.append(_pending, _num_pending);
+  out += _tokenizer.decode(id);
+  _num_pending = 0;
+  // hold back the last character if it is incomplete, i.e. a lead byte in the
+  // last 3 bytes followed by fewer continuation bytes than it needs
+  const size_t end = out.size();
+  for (size_t i = end; i > start && end - i < 4;) {
+    i--;
+    int len = utf8_sequence_length(out[i]);
+    if (len == 0) {
+      continue;
+    }
+    if (static_cast<size_t>(len) > end - i) {
+      _num_pending = end - i;
+      std::copy(out.begin() + i, out.end(), _pending);
+      out.resize(i);
+    }
+    break;
+  }
+  return out.size() - start;
+}
+
+size_t StreamingDecoder::flush(std::string &out) {
+  out.append(_pending, _num_pending);
+  size_t n = _num_pending;
+  _num_pending = 0;
+  return n;
+}
+
 } // namespace rwkv
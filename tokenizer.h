@@ -1,19 +1,93 @@
 #pragma once
 
+#include <cstdint>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace rwkv {
+// Loads either a msgpack vocab (id -> bytes, see tools/convert_tokenizer.py)
+// or a compiled tokenizer file (see `save` and compile_tokenizer.cpp). A
+// compiled file is mmap-ed and used in place, so loading it is O(1) and its
+// pages are shared by all processes using it.
 class Tokenizer {
 public:
   Tokenizer(const std::string &path);
+  ~Tokenizer();
+  Tokenizer(const Tokenizer &) = delete;
+  Tokenizer &operator=(const Tokenizer &) = delete;
+
   std::vector<int> encode(std::string_view str) const;
   std::string decode(const std::vector<int> &ids) const;
-  std::string decode(int id) const;
+  // The bytes of token `id` (which may be part of a UTF-8 character), valid
+  // as long as the tokenizer
+  std::string_view decode(int id) const {
+    if (id < 0 || static_cast<uint32_t>(id) >= _num_ids) {
+      return kUnknownWord;
+    }
+    return std::string_view(_words + _word_offsets[id],
+                            _word_offsets[id + 1] - _word_offsets[id]);
+  }
+  // ids are in [0, vocab_size())
+  uint32_t vocab_size() const { return _num_ids; }
+  // Writes the compiled tokenizer file
+  void save(const std::string &path) const;
+
+private:
+  static constexpr std::string_view kUnknownWord = "<unk>";
+
+  // A byte trie of all words in flat arrays. The edges of a node are
+  // `_trie_labels/_trie_targets[begin, end)`, sorted by label. The children
+  // of the root are indexed by byte in `_trie_root` instead.
+  struct TrieNode {
+    int32_t id;       // the word ending at this node, or -1
+    uint32_t begin;
+    uint32_t end;
+  };
+
+  // The vocab and the trie are laid out in one image, which is the content
+  // of a compiled tokenizer file, see tokenizer.cpp
+  static std::vector<char>
+  build_image(const std::unordered_map<int, std::string> &idx2word);
+  void attach_image(const char *image, size_t size);
+
+  // the image built from a msgpack vocab, or empty if it is mmap-ed
+  std::vector<char> _image;
+  void *_mapped = nullptr;
+  size_t _mapped_size = 0;
+
+  // The words of all ids packed in one buffer: word `id` is
+  // `_words[_word_offsets[id], _word_offsets[id + 1])`. Ids missing from the
+  // vocab hold kUnknownWord.
+  uint32_t _num_ids;
+  const uint32_t *_word_offsets;
+  const char *_words;
+
+  const uint32_t *_trie_root;
+  const TrieNode *_trie_nodes;
+  const uint32_t *_trie_targets;
+  const uint8_t *_trie_labels;
+};
+
+// Decodes a stream of ids into a caller-provided string, holding back the
+// trailing bytes of a UTF-8 character split across tokens until the token
+// completing it arrives, so that every appended piece is valid text (as far
+// as the tokens are).
+class StreamingDecoder {
+public:
+  explicit StreamingDecoder(const Tokenizer &tokenizer)
+      : _tokenizer(tokenizer) {}
+  // Appends the complete characters decoded so far to `out`, returns the
+  // number of bytes appended.
+  size_t decode(int id, std::string &out);
+  // Appends the held back bytes, if any (an incomplete character at the end
+  // of the stream).
+  size_t flush(std::string &out);
 
 private:
-  std::unordered_map<std::string, int> _word2idx;
-  std::unordered_map<int, std::string> _idx2word;
+  const Tokenizer &_tokenizer;
+  char _pending[4];
+  int _num_pending = 0;
 };
 }
@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+
+# Usage: convert_lora.py lora_checkpoint.pth lora_alpha output.lora
+#
+# Converts the LoRA weights (`*.lora_A` [r, in] and `*.lora_B` [out, r], as
+# saved by RWKV-LM-LoRA) of a checkpoint into a faster-rwkv LoRA file. Like
+# the converted model weights, `a` and `b` are stored as [in, r] and [r, out].
+
+import sys
+
+import torch
+import msgpack
+
+
+w = torch.load(sys.argv[1], map_location=torch.device('cpu'))
+alpha = float(sys.argv[2])
+
+d = {'alpha': alpha, 'weights': {}}
+
+for k, v in w.items():
+    if not k.endswith('.lora_A'):
+        continue
+    pf = k[:-len('lora_A')]
+    a = v.float().t().contiguous()
+    b = w[pf + 'lora_B'].float().t().contiguous()
+    d['weights'][pf + 'weight'] = {'a': a, 'b': b}
+
+def pack(x):
+    if isinstance(x, torch.Tensor):
+        return {'dtype': x.dtype, 'data': x.numpy().tobytes(), 'shape': x.shape}
+    elif isinstance(x, torch.dtype):
+        return str(x)
+    return x
+
+msgpack.pack(d, open(sys.argv[3], 'wb'), default=pack)
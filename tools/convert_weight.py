@@ -43,6 +43,10 @@ for x in w.keys():
 
 d['n_layer'] = n_layer
 d['n_embd'] = w['emb.weight'].shape[1]
+# RWKV-5, time_decay is [n_head, 1, 1] or [n_head, head_size, 1] after
+# ChatRWKV conversion
+if 'blocks.0.att.ln_x.weight' in w:
+    d['n_head'] = w['blocks.0.att.time_decay'].shape[0]
 
 def pack(x):
     if isinstance(x, torch.Tensor):
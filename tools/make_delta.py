@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+# Usage: make_delta.py [--form int8|lowrank] [--rank R] base.fr variant.fr
+#                      output.frd [threshold]
+#
+# Stores `variant.fr` (a full fine-tune of `base.fr`) as a delta against
+# `base.fr`, to be loaded by `rwkv::Model(base_model, "output.frd")`.
+#
+# * matmul weights are stored
+#   - with `--form int8` (default) as int8 deltas with one fp32 scale per
+#     output column, `variant = base + delta * scale`, about half of an fp16
+#     weight,
+#   - with `--form lowrank` as the rank R (default 16) truncated SVD of the
+#     delta, `variant = base + a @ b`, r * (K + N) values. It is exact only
+#     for fine-tunes whose delta has rank <= R (e.g. merged LoRAs), the
+#     relative error of the others is printed.
+# * other weights and embedding rows are stored as they are in `variant.fr`
+# * tensors equal to the base, or whose delta is smaller than
+#   `threshold * norm(base)` (default 0), are not stored at all
+
+import argparse
+
+import numpy as np
+import msgpack
+
+np_dtypes = {
+    'torch.int8': np.int8,
+    'torch.float16': np.float16,
+    'torch.float32': np.float32,
+}
+
+
+def load(path):
+    return msgpack.unpack(open(path, 'rb'), raw=False)
+
+
+def to_np(t):
+    return np.frombuffer(t['data'], dtype=np_dtypes[t['dtype']]).reshape(t['shape'])
+
+
+def from_np(x):
+    dtype = {v: k for k, v in np_dtypes.items()}[x.dtype.type]
+    return {'dtype': dtype, 'data': x.tobytes(), 'shape': list(x.shape)}
+
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--form', choices=['int8', 'lowrank'], default='int8')
+parser.add_argument('--rank', type=int, default=16)
+parser.add_argument('base')
+parser.add_argument('variant')
+parser.add_argument('output')
+parser.add_argument('threshold', type=float, nargs='?', default=0.)
+args = parser.parse_args()
+
+base = load(args.base)
+variant = load(args.variant)
+threshold = args.threshold
+
+assert base['n_layer'] == variant['n_layer']
+assert base['n_embd'] == variant['n_embd']
+assert base['weights'].keys() == variant['weights'].keys()
+assert len(base['embd_weights']) == len(variant['embd_weights'])
+
+d = {'n_layer': variant['n_layer'], 'n_embd': variant['n_embd'],
+     'weights': {}, 'embd_weights': {}}
+
+n_stored = 0
+max_error = 0.
+for k, v in variant['weights'].items():
+    w = to_np(base['weights'][k]).astype(np.float32)
+    diff = to_np(v).astype(np.float32) - w
+    if np.linalg.norm(diff) <= threshold * np.linalg.norm(w):
+        continue
+    n_stored += 1
+    # load_delta tells the forms apart by the 'delta' and 'a' keys
+    if diff.ndim == 2 and args.form == 'lowrank':
+        u, s, vt = np.linalg.svd(diff, full_matrices=False)
+        a = (u[:, :args.rank] * s[:args.rank]).astype(np.float32)
+        b = vt[:args.rank].astype(np.float32)
+        max_error = max(max_error, np.linalg.norm(diff - a @ b) / np.linalg.norm(diff))
+        d['weights'][k] = {'a': from_np(a), 'b': from_np(b)}
+    elif diff.ndim == 2:
+        scale = np.abs(diff).max(axis=0) / 127
+        scale[scale == 0] = 1
+        q = np.clip(np.round(diff / scale), -127, 127).astype(np.int8)
+        d['weights'][k] = {'delta': from_np(q), 'scale': from_np(scale.astype(np.float32))}
+    else:
+        d['weights'][k] = v
+
+for i, (b, v) in enumerate(zip(base['embd_weights'], variant['embd_weights'])):
+    if b['data'] != v['data']:
+        d['embd_weights'][i] = v
+
+print(f'{n_stored}/{len(variant["weights"])} weights and '
+      f'{len(d["embd_weights"])}/{len(variant["embd_weights"])} embeddings differ from the base')
+
+if args.form == 'lowrank':
+    print(f'max relative error of the rank {args.rank} deltas: {max_error:.3g}')
+
+msgpack.pack(d, open(args.output, 'wb'))
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+
+# Usage: rwkv5_reference.py model.fr id [id ...]
+#
+# Runs the token ids through the RWKV-5.2 faster-rwkv weight file
+# `model.fr` (as converted by convert_weight.py or written by
+# generate_model) one token at a time, in plain fp64 numpy following
+# ChatRWKV's RWKV_x052 forward, and prints the first 10 logits of the last
+# token. It is the reference of the v5 logits in test_model.cpp, e.g. for
+#
+#   ./generate_model random-v5.fr 2 128 100 fp16 v5 2
+#   python3 tools/rwkv5_reference.py random-v5.fr 1 2 3
+
+import sys
+
+import numpy as np
+import msgpack
+
+np_dtypes = {
+    'torch.float16': np.float16,
+    'torch.float32': np.float32,
+}
+
+
+def to_np(t):
+    x = np.frombuffer(t['data'], dtype=np_dtypes[t['dtype']])
+    return x.reshape(t['shape']).astype(np.float64)
+
+
+def layer_norm(x, w, b, eps=1e-5):
+    mean = x.mean()
+    var = ((x - mean) ** 2).mean()
+    return (x - mean) / np.sqrt(var + eps) * w + b
+
+
+def sigmoid(x):
+    return 1 / (1 + np.exp(-x))
+
+
+model = msgpack.unpack(open(sys.argv[1], 'rb'), raw=False)
+ids = [int(x) for x in sys.argv[2:]]
+n_layer = model['n_layer']
+C = model['n_embd']
+H = model['n_head']
+N = C // H
+w = {k: to_np(v) for k, v in model['weights'].items()}
+emb = model['embd_weights']
+
+# att sx, wkv state, ffn sx of every layer
+states = [[np.zeros(C), np.zeros((H, N, N)), np.zeros(C)]
+          for _ in range(n_layer)]
+
+for id in ids:
+    x = to_np(emb[id])
+    for i in range(n_layer):
+        att = f'blocks.{i}.att.'
+        ffn = f'blocks.{i}.ffn.'
+        state = states[i]
+
+        xx = layer_norm(x, w[f'blocks.{i}.ln1.weight'],
+                        w[f'blocks.{i}.ln1.bias'])
+        sx = state[0]
+
+        def mix(name):
+            m = w[att + 'time_mix_' + name]
+            return xx * m + sx * (1 - m)
+
+        k = (mix('k') @ w[att + 'key.weight']).reshape(H, N, 1)
+        v = (mix('v') @ w[att + 'value.weight']).reshape(H, 1, N)
+        r = (mix('r') @ w[att + 'receptance.weight']).reshape(H, 1, N)
+        g = mix('g') @ w[att + 'gate.weight']
+        g = g * sigmoid(g)
+        # time_decay is already exp(-exp(decay)), [H, N, 1] or [H, 1, 1]
+        decay = w[att + 'time_decay'].reshape(H, -1, 1)
+        first = w[att + 'time_faaaa'].reshape(H, -1, 1)
+        a = k @ v
+        out = (r @ (first * a + state[1])).reshape(H, N)
+        state[1] = a + decay * state[1]
+        # group norm, one group per head
+        mean = out.mean(axis=1, keepdims=True)
+        var = ((out - mean) ** 2).mean(axis=1, keepdims=True)
+        out = ((out - mean) / np.sqrt(var + 64e-5)).reshape(C)
+        out = (out * w[att + 'ln_x.weight'] + w[att + 'ln_x.bias']) * g
+        x = x + out @ w[att + 'output.weight']
+        state[0] = xx
+
+        xx = layer_norm(x, w[f'blocks.{i}.ln2.weight'],
+                        w[f'blocks.{i}.ln2.bias'])
+        sx = state[2]
+        km = w[ffn + 'time_mix_k']
+        rm = w[ffn + 'time_mix_r']
+        kx = xx * km + sx * (1 - km)
+        rx = xx * rm + sx * (1 - rm)
+        r = sigmoid(rx @ w[ffn + 'receptance.weight'])
+        k = np.maximum(kx @ w[ffn + 'key.weight'], 0) ** 2
+        x = x + r * (k @ w[ffn + 'value.weight'])
+        state[2] = xx
+
+x = layer_norm(x, w['ln_out.weight'], w['ln_out.bias'])
+logits = x @ w['head.weight']
+print(', '.join(f'{y:.5f}' for y in logits[:10]))